@@ -0,0 +1,124 @@
+/* arena.c - bump allocator for per-line data in smsh
+ *
+ *    void  arena_init(struct arena *a)            - empty arena
+ *    void *arena_alloc(struct arena *a, size_t n) - aligned block
+ *    char *arena_strndup(a, const char *s, n)     - counted copy
+ *    char *arena_room(a, size_t n)                - n writable bytes
+ *    void  arena_commit(a, size_t n)              - keep n of them
+ *    void  arena_reset(struct arena *a)           - drop everything
+ *    void  arena_free(struct arena *a)            - release memory
+ *
+ *    Everything parsed from one command line lives in one arena and
+ *    is released by a single arena_reset().  After a reset the arena
+ *    keeps one block as big as everything the last line needed, so a
+ *    steady stream of similar lines never calls malloc at all.
+ */
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	"smsh.h"
+
+#define	ARENA_BLOCK	8192
+#define	ARENA_ALIGN	16
+
+void arena_init(struct arena *a)
+{
+    a->head = NULL;
+}
+
+static struct arena_blk *new_block(struct arena *a, size_t n)
+{
+    struct arena_blk *b;
+    size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+
+    b = emalloc(sizeof(struct arena_blk) + size);
+    b->size = size;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
+    return b;
+}
+
+void *arena_alloc(struct arena *a, size_t n)
+/*
+ * purpose: carve n bytes out of the arena
+ * returns: pointer aligned for any type, never NULL
+ */
+{
+    struct arena_blk *b = a->head;
+    size_t off;
+
+    off = b ? (b->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : 0;
+    if (b == NULL || off + n > b->size) {
+        b = new_block(a, n);
+        off = 0;
+    }
+    b->used = off + n;
+    return b->data + off;
+}
+
+char *arena_room(struct arena *a, size_t n)
+/*
+ * purpose: make n bytes available at the top of the arena
+ * returns: pointer to them; nothing is allocated until arena_commit()
+ *    note: lets a string be built in place when only its maximum
+ *          length is known
+ */
+{
+    struct arena_blk *b = a->head;
+
+    if (b == NULL || b->used + n > b->size)
+        b = new_block(a, n);
+    return b->data + b->used;
+}
+
+void arena_commit(struct arena *a, size_t n)
+{
+    a->head->used += n;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t n)
+{
+    char *p = arena_room(a, n + 1);
+
+    memcpy(p, s, n);
+    p[n] = '\0';
+    arena_commit(a, n + 1);
+    return p;
+}
+
+void arena_reset(struct arena *a)
+/*
+ * purpose: release everything allocated since the last reset
+ *  action: a single block is just rewound; several are replaced by
+ *          one block large enough to hold all of them
+ */
+{
+    struct arena_blk *b, *next;
+    size_t total = 0;
+
+    if (a->head == NULL)
+        return;
+    if (a->head->next == NULL) {
+        a->head->used = 0;
+        return;
+    }
+    for (b = a->head; b != NULL; b = next) {
+        next = b->next;
+        total += b->size;
+        free(b);
+    }
+    a->head = NULL;
+    new_block(a, total);
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_blk *b, *next;
+
+    for (b = a->head; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->head = NULL;
+}
@@ -0,0 +1,237 @@
+/* bench_macro.c - whole-shell throughput: commands, pipelines, redirections
+ *
+ *    usage: bench_macro [-n count] [-s MB] [-d dir] shell [shell...]
+ *
+ *    Feeds each shell generated scripts on its stdin and times them:
+ *    count trivial commands ("true", a builtin in smsh4, and
+ *    "/bin/true", always a process), count command substitutions
+ *    (of echo, run in place by smsh4, and of /bin/echo, which takes a
+ *    forked copy of the shell as well), about count stages' worth of
+ *    pipelines 2, 10, 100, 1000 and 10000 stages long (at least one
+ *    of each; stages/s should not fall as they get longer if launch
+ *    cost is linear in the length), and an MB-sized file copied
+ *    through "cat < in > out" and "cat < in | cat > out" (best of three
+ *    runs).  Last, a script of count * 10 lines of builtins, named on
+ *    the command line, is timed with SMSH_SCRIPTCACHE set to off, cold
+ *    (parsed and its cache file written every run) and on (the cache
+ *    file read), to show what parsing costs a script.  Scripts and data
+ *    go in dir (default /tmp) and are removed after.
+ *
+ *    Output is one tab-separated record per line, as in bench_micro:
+ *
+ *        suite  case  shell  value  unit
+ *
+ *    Naming two builds of smsh puts their records side by side.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<fcntl.h>
+#include	<spawn.h>
+#include	<time.h>
+#include	<unistd.h>
+#include	<sys/wait.h>
+
+extern char **environ;
+
+static char *dir = "/tmp";
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(char *name, char *shell, double value, char *unit)
+{
+    printf("macro\t%s\t%s\t%.1f\t%s\n", name, shell, value, unit);
+    fflush(stdout);
+}
+
+static FILE *script(char *path)
+{
+    FILE *fp;
+
+    snprintf(path, 4096, "%s/smsh-bench.%d.sh", dir, (int)getpid());
+    if ((fp = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    return fp;
+}
+
+static double run(char *shell, char *path, int asarg)
+/*
+ * purpose: run shell with the script at path as its stdin, or as its
+ *          argument if asarg
+ * returns: the seconds it took
+ */
+{
+    posix_spawn_file_actions_t fa;
+    char *argv[] = { shell, asarg ? path : NULL, NULL };
+    double t0;
+    pid_t pid;
+
+    posix_spawn_file_actions_init(&fa);
+    if (!asarg)
+        posix_spawn_file_actions_addopen(&fa, 0, path, O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+    t0 = now();
+    if (posix_spawn(&pid, shell, &fa, NULL, argv, environ) != 0) {
+        perror(shell);
+        exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    posix_spawn_file_actions_destroy(&fa);
+    return now() - t0;
+}
+
+static void trivial(char *shell, char *cmd, int count)
+{
+    char path[4096], name[64];
+    FILE *fp = script(path);
+    int i;
+
+    for (i = 0; i < count; i++)
+        fprintf(fp, "%s\n", cmd);
+    fclose(fp);
+    snprintf(name, sizeof name, "commands/%s", cmd);
+    record(name, shell, count / run(shell, path, 0), "cmds/s");
+    unlink(path);
+}
+
+static void pipelines(char *shell, int stages, int count)
+{
+    char path[4096], name[64];
+    FILE *fp = script(path);
+    int i, j, lines = count / stages > 0 ? count / stages : 1;
+    double t;
+
+    for (i = 0; i < lines; i++) {
+        fprintf(fp, "/bin/echo x");
+        for (j = 1; j < stages; j++)
+            fprintf(fp, " | /bin/cat");
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+    t = run(shell, path, 0);
+    snprintf(name, sizeof name, "pipeline/%d", stages);
+    record(name, shell, lines / t, "pipelines/s");
+    record(name, shell, (double)lines * stages / t, "stages/s");
+    unlink(path);
+}
+
+static void make_input(char *path, int mb)
+{
+    char buf[1 << 16];
+    int fd, i;
+
+    for (i = 0; i < (int)sizeof buf; i++)
+        buf[i] = "0123456789abcdef\n"[i % 17];
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < mb * 16; i++)
+        if (write(fd, buf, sizeof buf) != sizeof buf) {
+            perror(path);
+            exit(1);
+        }
+    fsync(fd);				/* no writeback in the first run */
+    close(fd);
+}
+
+static void redirect(char *shell, char *fmt, char *name, int mb)
+/*
+ * purpose: time one copy command, the best of three runs
+ */
+{
+    char path[4096];
+    FILE *fp = script(path);
+    int pid = (int)getpid(), i;
+    double t, best = 0;
+
+    fprintf(fp, fmt, dir, pid, dir, pid);
+    fprintf(fp, "\n");
+    fclose(fp);
+    for (i = 0; i < 3; i++)
+        if ((t = run(shell, path, 0)) < best || i == 0)
+            best = t;
+    record(name, shell, mb / best, "MB/s");
+    unlink(path);
+}
+
+static void cached(char *shell, int count)
+/*
+ * purpose: time one script run without, before and with its cache
+ *   notes: the cache file is .name.smshc next to the script
+ */
+{
+    static char *modes[] = { "off", "cold", "on", NULL };
+    char path[4096], cpath[4200], name[64];
+    FILE *fp = script(path);
+    int i, j;
+    double t, best = 0;
+
+    for (i = 0; i < count * 10; i++)
+        fprintf(fp, "true \"$HOME\" ${X:-y} {1,2,3} && : x y > /dev/null || false\n");
+    fclose(fp);
+    for (i = 0; modes[i] != NULL; i++) {
+        setenv("SMSH_SCRIPTCACHE", modes[i], 1);
+        run(shell, path, 1);			/* the cache is warm for "on" */
+        for (j = 0; j < 3; j++)
+            if ((t = run(shell, path, 1)) < best || j == 0)
+                best = t;
+        snprintf(name, sizeof name, "script/%s", modes[i]);
+        record(name, shell, best * 1e3, "ms");
+    }
+    unsetenv("SMSH_SCRIPTCACHE");
+    snprintf(cpath, sizeof cpath, "%s/.%s.smshc", dir, strrchr(path, '/') + 1);
+    unlink(cpath);
+    unlink(path);
+}
+
+int main(int ac, char **av)
+{
+    static int lengths[] = { 2, 10, 100, 1000, 10000 };
+    int count = 2000, mb = 256, c, i;
+    char in[4096], out[4096];
+
+    while ((c = getopt(ac, av, "n:s:d:")) != -1) {
+        if (c == 'n')
+            count = atoi(optarg);
+        else if (c == 's')
+            mb = atoi(optarg);
+        else if (c == 'd')
+            dir = optarg;
+        else
+            break;
+    }
+    if (c != -1 || optind >= ac) {
+        fprintf(stderr, "usage: bench_macro [-n count] [-s MB] [-d dir] shell...\n");
+        return 2;
+    }
+    snprintf(in, sizeof in, "%s/smsh-bench.%d.in", dir, (int)getpid());
+    snprintf(out, sizeof out, "%s/smsh-bench.%d.out", dir, (int)getpid());
+    make_input(in, mb);
+    for (; optind < ac; optind++) {
+        trivial(av[optind], "true", count);
+        trivial(av[optind], "/bin/true", count);
+        trivial(av[optind], "x=$(echo x)", count);
+        trivial(av[optind], "x=$(/bin/echo x)", count);
+        for (i = 0; i < (int)(sizeof lengths / sizeof lengths[0]); i++)
+            pipelines(av[optind], lengths[i], count);
+        redirect(av[optind], "cat < %s/smsh-bench.%d.in > %s/smsh-bench.%d.out",
+                 "redirect/cat", mb);
+        redirect(av[optind], "cat < %s/smsh-bench.%d.in | cat > %s/smsh-bench.%d.out",
+                 "redirect/cat|cat", mb);
+        cached(av[optind], count);
+    }
+    unlink(in);
+    unlink(out);
+    return 0;
+}
@@ -0,0 +1,245 @@
+/* bench_micro.c - time the shell's own hot paths, without any children
+ *
+ *    usage: bench_micro [-t secs] [-l lines] [-d dir]
+ *
+ *    Times next_cmd() reading a script of many lines, splitline(),
+ *    splitline2() and parse_line() on typical command lines, and
+ *    handle_globbing() on patterns over synthetic directories of 100
+ *    and 10000 files made under dir (default /tmp) and removed after
+ *    (the listings are cached after the first call, as in the shell).
+ *    Each case is repeated, doubling the count, until a run takes at
+ *    least secs (default 0.2).
+ *
+ *    Output is one record per line, tab separated, in the form every
+ *    bench_micro and bench_macro line shares:
+ *
+ *        suite  case  shell  value  unit
+ *
+ *    (shell is "-" here), so the records of two builds can be joined
+ *    on the first three columns and compared.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<fcntl.h>
+#include	<time.h>
+#include	<unistd.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+char **handle_globbing(struct arena *, struct stage *);
+
+static double mintime = 0.2;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record(char *name, double value, char *unit)
+{
+    printf("micro\t%s\t-\t%.1f\t%s\n", name, value, unit);
+    fflush(stdout);
+}
+
+static double per_op(void (*fn)(void *), void *arg)
+/*
+ * purpose: call fn(arg) in runs of doubling length until one run
+ *          takes mintime
+ * returns: seconds per call in that run
+ */
+{
+    long n, i;
+    double t0, t;
+
+    for (n = 1; ; n *= 2) {
+        t0 = now();
+        for (i = 0; i < n; i++)
+            fn(arg);
+        if ((t = now() - t0) >= mintime || n >= 1L << 30)
+            return t / n;
+    }
+}
+
+/*
+ * next_cmd: one pass over a generated script
+ */
+
+static void bench_next_cmd(char *dir, long lines)
+{
+    static char line[] = "ls -l /usr/include | grep stdio > out.txt 2>&1\n";
+    char path[4096], *s;
+    FILE *fp;
+    long i, n = 0;
+    double t0, t;
+
+    snprintf(path, sizeof path, "%s/smsh-bench-script", dir);
+    if ((fp = fopen(path, "w")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < lines; i++)
+        fputs(line, fp);
+    fclose(fp);
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    t0 = now();
+    while ((s = next_cmd("", fp)) != NULL) {
+        free(s);
+        n++;
+    }
+    t = now() - t0;
+    fclose(fp);
+    unlink(path);
+    record("next_cmd", t / n * 1e9, "ns/line");
+    record("next_cmd", n * (sizeof line - 1) / t / (1 << 20), "MB/s");
+}
+
+/*
+ * splitting and parsing one line
+ */
+
+static char cmdline[] = "gcc -std=c99 -Wall -O2 -o smsh4 arena.c parse.c smsh4.c";
+static char pipeline[] = "cat access.log | grep GET | sort | uniq -c | sort -rn";
+
+static void do_splitline(void *arg)
+{
+    freelist(splitline(arg));
+}
+
+static void do_splitline2(void *arg)
+{
+    freelist(splitline2(arg, "|"));
+}
+
+static struct arena parena;
+
+static void do_parse(void *arg)
+{
+    char copy[256];
+
+    strcpy(copy, arg);			/* the lexer may write in place	*/
+    parse_line(&parena, copy);
+    arena_reset(&parena);
+}
+
+/*
+ * handle_globbing over synthetic directories
+ */
+
+static void make_dir(char *path, int nfiles)
+/*
+ * purpose: a directory of nfiles empty files, f000000.c, f000001.h, ...
+ *   notes: dated an hour back, as sglob will not trust a cached listing
+ *          of a directory changed within the last second
+ */
+{
+    struct timespec ts[2];
+    char name[4096];
+    int i, fd;
+
+    if (mkdir(path, 0755) == -1) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof name, "%s/f%06d.%c", path, i, "ch"[i % 2]);
+        if ((fd = open(name, O_WRONLY | O_CREAT, 0644)) == -1) {
+            perror(name);
+            exit(1);
+        }
+        close(fd);
+    }
+    clock_gettime(CLOCK_REALTIME, &ts[0]);
+    ts[0].tv_sec -= 3600;
+    ts[1] = ts[0];
+    utimensat(AT_FDCWD, path, ts, 0);
+}
+
+static void remove_dir(char *path, int nfiles)
+{
+    char name[4096];
+    int i;
+
+    for (i = 0; i < nfiles; i++) {
+        snprintf(name, sizeof name, "%s/f%06d.%c", path, i, "ch"[i % 2]);
+        unlink(name);
+    }
+    rmdir(path);
+}
+
+struct globcase {
+    struct stage	*st;
+    struct arena	out;
+};
+
+static void do_glob(void *arg)
+{
+    struct globcase *g = arg;
+
+    handle_globbing(&g->out, g->st);
+    arena_reset(&g->out);
+}
+
+static void bench_glob(char *dir, int nfiles)
+{
+    static char *pats[] = { "*", "*.c", "f00001*", "f00000[0-4].?", NULL };
+    char path[1024], line[2048], name[256];
+    struct arena in;
+    struct globcase g;
+    struct node *n;
+    int i;
+
+    snprintf(path, sizeof path, "%s/smsh-bench-glob.%d", dir, (int)getpid());
+    make_dir(path, nfiles);
+    arena_init(&in);
+    arena_init(&g.out);
+    for (i = 0; pats[i] != NULL; i++) {
+        arena_reset(&in);
+        snprintf(line, sizeof line, "echo %s/%s", path, pats[i]);
+        if ((n = parse_line(&in, line)) == NULL || n->type != N_PIPE)
+            exit(1);
+        g.st = &n->pl->stages[0];
+        snprintf(name, sizeof name, "handle_globbing/%d/%s", nfiles, pats[i]);
+        record(name, per_op(do_glob, &g) * 1e9, "ns/op");
+    }
+    arena_free(&in);
+    arena_free(&g.out);
+    remove_dir(path, nfiles);
+}
+
+int main(int ac, char **av)
+{
+    char *dir = "/tmp";
+    long lines = 1000000;
+    int c;
+
+    while ((c = getopt(ac, av, "t:l:d:")) != -1) {
+        if (c == 't')
+            mintime = atof(optarg);
+        else if (c == 'l')
+            lines = atol(optarg);
+        else if (c == 'd')
+            dir = optarg;
+        else {
+            fprintf(stderr, "usage: bench_micro [-t secs] [-l lines] [-d dir]\n");
+            return 2;
+        }
+    }
+    bench_next_cmd(dir, lines);
+    record("splitline", per_op(do_splitline, cmdline) * 1e9, "ns/op");
+    record("splitline2", per_op(do_splitline2, pipeline) * 1e9, "ns/op");
+    arena_init(&parena);
+    record("parse_line", per_op(do_parse, cmdline) * 1e9, "ns/op");
+    record("parse_line/pipeline", per_op(do_parse, pipeline) * 1e9, "ns/op");
+    bench_glob(dir, 100);
+    bench_glob(dir, 10000);
+    return 0;
+}
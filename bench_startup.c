@@ -0,0 +1,121 @@
+/* bench_startup.c - how long a non-interactive smsh takes to start
+ *
+ *    usage: bench_startup [-n count] [-s socket] shell [shell...]
+ *
+ *    Runs "shell -c ''" count times for each shell named and prints
+ *    the mean microseconds from launch to exit, so smsh can be
+ *    compared against itself between versions and against /bin/sh.
+ *    With -s, also sends '' count times to the "smsh4 --server" at
+ *    socket (waiting up to a second for it to appear), with this
+ *    process's stdin, stdout and stderr, and prints the mean
+ *    microseconds from connect to the status coming back: what a task
+ *    costs when the shell is already running.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<spawn.h>
+#include	<time.h>
+#include	<string.h>
+#include	<unistd.h>
+#include	<sys/socket.h>
+#include	<sys/un.h>
+#include	<sys/wait.h>
+
+extern char **environ;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int request(char *path)
+/*
+ * purpose: run '' on the server at path, passing fds 0, 1 and 2
+ * returns: 0, or -1 if it could not be done
+ */
+{
+    union {
+        struct cmsghdr	h;
+        char		space[CMSG_SPACE(3 * sizeof(int))];
+    } u;
+    struct sockaddr_un addr;
+    struct iovec iov = { "", 1 };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    int fd, fds[3] = { 0, 1, 2 }, rv = -1;
+    char reply[16];
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.space;
+    msg.msg_controllen = sizeof u.space;
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(c), fds, sizeof fds);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == 0
+        && sendmsg(fd, &msg, 0) == 1 && recv(fd, reply, sizeof reply, 0) > 0)
+        rv = 0;
+    close(fd);
+    return rv;
+}
+
+int main(int ac, char **av)
+{
+    int count = 1000, c, i;
+    char *argv[4], *sock = NULL;
+    double t0;
+    pid_t pid;
+
+    while ((c = getopt(ac, av, "n:s:")) != -1) {
+        if (c == 'n')
+            count = atoi(optarg);
+        else if (c == 's')
+            sock = optarg;
+        else {
+            fprintf(stderr, "usage: bench_startup [-n count] [-s socket] shell...\n");
+            return 2;
+        }
+    }
+    for (; optind < ac; optind++) {
+        argv[0] = av[optind];
+        argv[1] = "-c";
+        argv[2] = "";
+        argv[3] = NULL;
+        t0 = now();
+        for (i = 0; i < count; i++) {
+            if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+                perror(argv[0]);
+                return 1;
+            }
+            waitpid(pid, NULL, 0);
+        }
+        printf("startup %-12s %d runs  %.1f us/run\n", argv[0], count,
+               (now() - t0) / count * 1e6);
+    }
+    if (sock != NULL) {
+        for (i = 0; i < 100 && request(sock) == -1; i++)
+            usleep(10000);
+        t0 = now();
+        for (i = 0; i < count; i++)
+            if (request(sock) == -1) {
+                perror(sock);
+                return 1;
+            }
+        printf("server  %-12s %d runs  %.1f us/run\n", sock, count,
+               (now() - t0) / count * 1e6);
+    }
+    return 0;
+}
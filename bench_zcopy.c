@@ -0,0 +1,107 @@
+/* bench_zcopy.c - redirection throughput with and without the in-shell cat
+ *
+ *    usage: bench_zcopy [-s MB] [-n runs] [-d dir] shell
+ *
+ *    Writes an MB-sized file into dir (default .), then times the shell
+ *    running "cat < in > out", "cat < in | wc -c" and "cat < in | cat
+ *    > out" with SMSH_ZCOPY=off (a cat process and pipe copies) and
+ *    with the default kernel copy, and prints MB/s for each.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<fcntl.h>
+#include	<spawn.h>
+#include	<time.h>
+#include	<unistd.h>
+#include	<sys/wait.h>
+
+extern char **environ;
+
+static char *cases[] = {
+    "cat < %s/zc.in > %s/zc.out",
+    "cat < %s/zc.in | wc -c > /dev/null",
+    "cat < %s/zc.in | cat > %s/zc.out",
+    NULL
+};
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_input(char *path, int mb)
+{
+    char buf[1 << 16];
+    int fd, i;
+
+    for (i = 0; i < (int)sizeof buf; i++)
+        buf[i] = "0123456789abcdef\n"[i % 17];
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        perror(path);
+        exit(1);
+    }
+    for (i = 0; i < mb * 16; i++)
+        if (write(fd, buf, sizeof buf) != sizeof buf) {
+            perror(path);
+            exit(1);
+        }
+    close(fd);
+}
+
+int main(int ac, char **av)
+{
+    int mb = 256, runs = 3, c, i, k, mode;
+    char *dir = ".", cmd[1024], path[1024], *argv[4];
+    double t0;
+    pid_t pid;
+
+    while ((c = getopt(ac, av, "s:n:d:")) != -1) {
+        if (c == 's')
+            mb = atoi(optarg);
+        else if (c == 'n')
+            runs = atoi(optarg);
+        else if (c == 'd')
+            dir = optarg;
+        else {
+            fprintf(stderr, "usage: bench_zcopy [-s MB] [-n runs] [-d dir] shell\n");
+            return 2;
+        }
+    }
+    if (optind >= ac) {
+        fprintf(stderr, "usage: bench_zcopy [-s MB] [-n runs] [-d dir] shell\n");
+        return 2;
+    }
+    snprintf(path, sizeof path, "%s/zc.in", dir);
+    make_input(path, mb);
+
+    argv[0] = av[optind];
+    argv[1] = "-c";
+    argv[2] = cmd;
+    argv[3] = NULL;
+    for (k = 0; cases[k] != NULL; k++) {
+        snprintf(cmd, sizeof cmd, cases[k], dir, dir);
+        for (mode = 0; mode < 2; mode++) {
+            setenv("SMSH_ZCOPY", mode ? "on" : "off", 1);
+            t0 = now();
+            for (i = 0; i < runs; i++) {
+                if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+                    perror(argv[0]);
+                    return 1;
+                }
+                waitpid(pid, NULL, 0);
+            }
+            printf("zcopy %-4s %8.1f MB/s  %s\n", mode ? "on" : "off",
+                   (double)mb * runs / (now() - t0), cmd);
+        }
+    }
+    unlink(path);
+    snprintf(path, sizeof path, "%s/zc.out", dir);
+    unlink(path);
+    return 0;
+}
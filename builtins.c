@@ -0,0 +1,611 @@
+/* builtins.c - commands smsh runs itself instead of launching
+ *
+ *    const struct builtin *find_builtin(char *name)
+ *
+ *    The dispatch table is sorted by name and searched before anything
+ *    is spawned.  cd, export, unset and exit must run inside the shell
+ *    to mean anything, as must break, continue, return and shift,
+ *    which steer the loops and functions run_node() interprets; echo,
+ *    pwd, test, true and false are here because they are most of what
+ *    scripts run and cost nothing when no process has to be started
+ *    for them.  Each function takes argv and the fd it should read as
+ *    its input (stdin unless BI_OWNIN asked otherwise).
+ *    Those flagged BI_PURE leave the shell as they found it, so a
+ *    $(command) made of nothing else is run without forking a copy.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<limits.h>
+#include	<unistd.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+static int bi_true(char **argv, int in_fd)
+{
+    return 0;
+}
+
+static int bi_false(char **argv, int in_fd)
+{
+    return 1;
+}
+
+static int bi_echo(char **argv, int in_fd)
+/*
+ * purpose: echo [-neE] args: write args separated by blanks
+ *   notes: -e turns on \n \t \\ \c style escapes, as in bash
+ */
+{
+    int i = 1, nl = YES, esc = NO, k;
+    char *p;
+
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1))
+            break;
+        for (p = argv[i] + 1; *p != '\0'; p++) {
+            if (*p == 'n')
+                nl = NO;
+            else
+                esc = (*p == 'e');
+        }
+    }
+    for (k = i; argv[k] != NULL; k++) {
+        if (k > i)
+            putchar(' ');
+        if (!esc) {
+            fputs(argv[k], stdout);
+            continue;
+        }
+        for (p = argv[k]; *p != '\0'; p++) {
+            if (*p != '\\' || p[1] == '\0') {
+                putchar(*p);
+                continue;
+            }
+            switch (*++p) {
+            case 'n':  putchar('\n'); break;
+            case 't':  putchar('\t'); break;
+            case 'r':  putchar('\r'); break;
+            case 'a':  putchar('\a'); break;
+            case 'b':  putchar('\b'); break;
+            case '\\': putchar('\\'); break;
+            case 'c':  return 0;		/* no more output at all	*/
+            default:   putchar('\\'); putchar(*p);
+            }
+        }
+    }
+    if (nl)
+        putchar('\n');
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "echo: write error: %s\n", strerror(errno));
+        clearerr(stdout);
+        return 1;
+    }
+    return 0;
+}
+
+static int bi_pwd(char **argv, int in_fd)
+{
+    char buf[PATH_MAX];
+
+    if (getcwd(buf, sizeof buf) == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    puts(buf);
+    return 0;
+}
+
+static int bi_cd(char **argv, int in_fd)
+/*
+ * purpose: cd [dir | -]: change directory, keeping PWD and OLDPWD
+ */
+{
+    char *dir = argv[1], old[PATH_MAX], now[PATH_MAX];
+
+    if (dir == NULL && (dir = var_get("HOME", 4)) == NULL) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (strcmp(dir, "-") == 0 && (dir = var_get("OLDPWD", 6)) == NULL) {
+        fprintf(stderr, "cd: OLDPWD not set\n");
+        return 1;
+    }
+    if (getcwd(old, sizeof old) == NULL)
+        old[0] = '\0';
+    if (chdir(dir) == -1) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    if (argv[1] != NULL && strcmp(argv[1], "-") == 0)
+        puts(dir);
+    if (old[0] != '\0')
+        var_set("OLDPWD", 6, old, V_EXPORT);
+    if (getcwd(now, sizeof now) != NULL)
+        var_set("PWD", 3, now, V_EXPORT);
+    return 0;
+}
+
+static int bi_export(char **argv, int in_fd)
+{
+    return builtin_export(argv);
+}
+
+static int bi_exit(char **argv, int in_fd)
+{
+    int code = argv[1] ? atoi(argv[1]) : last_status;
+
+    fflush(stdout);
+    job_hangup();
+    exit(code & 0377);
+}
+
+static int bi_break(char **argv, int in_fd)
+/*
+ * purpose: break [n] and continue [n]: leave, or go on with the next
+ *          pass of, the n-th enclosing loop (default the innermost)
+ *   notes: the loops see jump when this returns (smsh4.c)
+ */
+{
+    int n = argv[1] ? atoi(argv[1]) : 1;
+
+    if (loop_depth == 0) {
+        fprintf(stderr, "smsh: %s: only meaningful in a loop\n", argv[0]);
+        return 0;
+    }
+    if (n < 1) {
+        fprintf(stderr, "smsh: %s: %s: loop count out of range\n", argv[0], argv[1]);
+        return 1;
+    }
+    jump = argv[0][0] == 'b' ? J_BREAK : J_CONTINUE;
+    jump_levels = n < loop_depth ? n : loop_depth;
+    return 0;
+}
+
+static int bi_return(char **argv, int in_fd)
+/*
+ * purpose: return [n]: end the function running, with status n
+ */
+{
+    if (func_depth == 0) {
+        fprintf(stderr, "smsh: return: can only return from a function\n");
+        return 1;
+    }
+    jump = J_RETURN;
+    return argv[1] ? atoi(argv[1]) & 0377 : last_status;
+}
+
+static int bi_shift(char **argv, int in_fd)
+/*
+ * purpose: shift [n]: drop the first n positional parameters
+ */
+{
+    int n = argv[1] ? atoi(argv[1]) : 1;
+
+    if (n < 0 || n > nparams) {
+        fprintf(stderr, "smsh: shift: %s: shift count out of range\n", argv[1] ? argv[1] : "1");
+        return 1;
+    }
+    var_args(params + n);
+    return 0;
+}
+
+static int read_line(int fd, char **linep, int *eof)
+/*
+ * purpose: read one line from fd, and not a byte past it, so whatever
+ *          reads fd next starts on the line after
+ * returns: the length, or -1 at end of input with nothing read;
+ *          *eof is YES if the input ended before a newline
+ *   notes: a seekable fd is read in blocks and wound back to the end
+ *          of the line; a pipe has to be read a byte at a time
+ */
+{
+    static char *buf;
+    static size_t cap;
+    size_t len = 0;
+    ssize_t n;
+    char *nl;
+    int seekable = lseek(fd, 0, SEEK_CUR) != -1;
+
+    for (;;) {
+        if (len + 512 > cap) {
+            cap = (len + 512) * 2;
+            buf = erealloc(buf, cap);
+        }
+        if ((n = read(fd, buf + len, seekable ? 512 : 1)) <= 0)
+            break;
+        if ((nl = memchr(buf + len, '\n', n)) != NULL) {
+            if (seekable)
+                lseek(fd, (nl + 1) - (buf + len + n), SEEK_CUR);
+            len = nl - buf;
+            buf[len] = '\0';
+            *linep = buf;
+            *eof = NO;
+            return len;
+        }
+        len += n;
+    }
+    buf = erealloc(buf, len + 1);
+    cap = cap > len + 1 ? cap : len + 1;
+    buf[len] = '\0';
+    *linep = buf;
+    *eof = YES;
+    return len > 0 ? (int)len : -1;
+}
+
+#define	QUOTED	'\001'			/* read: next char was escaped	*/
+
+static int store(char *name, char *s, size_t n)
+/*
+ * purpose: set name to s[0..n), without read's QUOTED marks
+ * returns: 0, or -1 if name is not a valid name
+ */
+{
+    char *v = emalloc(n + 1), *q = v;
+    size_t i;
+    int rv;
+
+    for (i = 0; i < n; i++)
+        if (s[i] != QUOTED)
+            *q++ = s[i];
+    *q = '\0';
+    rv = var_set(name, strlen(name), v, 0);
+    free(v);
+    return rv;
+}
+
+static int bi_read(char **argv, int in_fd)
+/*
+ * purpose: read [-r] [name ...]: split a line of input at blanks into
+ *          the names (default REPLY), the last taking the rest of it
+ * returns: 0, or 1 at the end of the input
+ *   notes: without -r a backslash quotes the next character, and one
+ *          at the end of the line joins the next line on
+ */
+{
+    static char *reply[] = { "REPLY", NULL };
+    char **names = argv + 1, *line, *value = NULL, *p, *q;
+    size_t vlen = 0, n;
+    int raw = NO, more, len, eof, rv = 0;
+
+    if (*names != NULL && strcmp(*names, "-r") == 0) {
+        raw = YES;
+        names++;
+    }
+    if (*names == NULL)
+        names = reply;
+    do {
+        if ((len = read_line(in_fd, &line, &eof)) == -1) {
+            if (value == NULL)
+                return 1;
+            break;
+        }
+        value = erealloc(value, vlen + 2 * len + 1);
+        more = NO;
+        for (p = line, q = value + vlen; *p != '\0'; p++) {
+            if (!raw && *p == '\\') {
+                if (p[1] == '\0') {
+                    more = YES;
+                    break;
+                }
+                *q++ = QUOTED;
+                p++;
+            }
+            *q++ = *p;
+        }
+        vlen = q - value;
+    } while (more);
+    value[vlen] = '\0';
+
+    for (p = value; *names != NULL && rv == 0; names++) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        for (q = p; *q != '\0'; q++) {
+            if (*q == QUOTED)
+                q++;
+            else if ((*q == ' ' || *q == '\t') && names[1] != NULL)
+                break;
+        }
+        n = q - p;
+        while (names[1] == NULL && n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')
+               && (n < 2 || p[n - 2] != QUOTED))
+            n--;			/* the last keeps no trailing blanks */
+        if ((rv = store(*names, p, n)) == -1)
+            fprintf(stderr, "smsh: read: '%s': not a valid identifier\n", *names);
+        p = q;
+    }
+    free(value);
+    return rv == 0 && !eof ? 0 : 1;
+}
+
+/* test and [ */
+static char	**targ;
+static int	tpos, tend, terr;
+
+static int t_or();
+
+static int t_int(char *s, long *vp)
+{
+    char *end;
+
+    errno = 0;
+    *vp = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", s);
+        terr = YES;
+        return NO;
+    }
+    return YES;
+}
+
+static int t_unary(char op, char *arg)
+{
+    struct stat st;
+
+    switch (op) {
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+    case 't': return isatty(atoi(arg));
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+    if (stat(arg, &st) == -1)
+        return NO;
+    switch (op) {
+    case 'e': return YES;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    }
+    return NO;
+}
+
+static int t_binary(char *l, char *op, char *r)
+/*
+ * returns: the result, or -1 if op is not a binary operator
+ */
+{
+    struct stat a, b;
+    long x, y;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(l, r) == 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(l, r) != 0;
+    if (strcmp(op, "<") == 0)
+        return strcmp(l, r) < 0;
+    if (strcmp(op, ">") == 0)
+        return strcmp(l, r) > 0;
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        if (stat(l, &a) == -1 || stat(r, &b) == -1)
+            return NO;
+        if (op[1] == 'e')
+            return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        return op[1] == 'n' ? a.st_mtime > b.st_mtime : a.st_mtime < b.st_mtime;
+    }
+    if (op[0] != '-' || strlen(op) != 3 || strstr("-eq-ne-lt-le-gt-ge", op) == NULL)
+        return -1;
+    if (!t_int(l, &x) || !t_int(r, &y))
+        return NO;
+    switch (op[1] * 256 + op[2]) {
+    case 'e' * 256 + 'q': return x == y;
+    case 'n' * 256 + 'e': return x != y;
+    case 'l' * 256 + 't': return x < y;
+    case 'l' * 256 + 'e': return x <= y;
+    case 'g' * 256 + 't': return x > y;
+    }
+    return x >= y;
+}
+
+static int t_prim()
+/*
+ * purpose: ( expr ) | -op arg | arg binop arg | arg
+ */
+{
+    char *s;
+    int v;
+
+    if (tpos >= tend) {
+        fprintf(stderr, "test: argument expected\n");
+        terr = YES;
+        return NO;
+    }
+    s = targ[tpos];
+    if (strcmp(s, "(") == 0 && tpos + 1 < tend) {
+        tpos++;
+        v = t_or();
+        if (tpos >= tend || strcmp(targ[tpos], ")") != 0) {
+            fprintf(stderr, "test: ')' expected\n");
+            terr = YES;
+        }
+        tpos++;
+        return v;
+    }
+    if (tpos + 3 <= tend
+        && (v = t_binary(s, targ[tpos + 1], targ[tpos + 2])) != -1) {
+        tpos += 3;
+        return v;
+    }
+    if (s[0] == '-' && s[1] != '\0' && s[2] == '\0' && tpos + 1 < tend
+        && strchr("nztLhrwxefdbcpSsug", s[1]) != NULL) {
+        tpos += 2;
+        return t_unary(s[1], targ[tpos - 1]);
+    }
+    tpos++;
+    return s[0] != '\0';
+}
+
+static int t_not()
+{
+    if (tpos < tend && strcmp(targ[tpos], "!") == 0 && tpos + 1 < tend) {
+        tpos++;
+        return !t_not();
+    }
+    return t_prim();
+}
+
+static int t_and()
+{
+    int v = t_not();
+
+    while (tpos < tend && strcmp(targ[tpos], "-a") == 0) {
+        tpos++;
+        v = t_not() && v;
+    }
+    return v;
+}
+
+static int t_or()
+{
+    int v = t_and();
+
+    while (tpos < tend && strcmp(targ[tpos], "-o") == 0) {
+        tpos++;
+        v = t_and() || v;
+    }
+    return v;
+}
+
+static int bi_test(char **argv, int in_fd)
+/*
+ * purpose: test expr, [ expr ]
+ * returns: 0 if expr is true, 1 if false, 2 on a usage error
+ */
+{
+    int v;
+
+    for (tend = 0; argv[tend + 1] != NULL; tend++)
+        ;
+    if (strcmp(argv[0], "[") == 0) {
+        if (tend == 0 || strcmp(argv[tend], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        tend--;
+    }
+    targ = argv + 1;
+    tpos = 0;
+    terr = NO;
+    if (tend == 0)
+        return 1;
+    v = t_or();
+    if (!terr && tpos < tend) {
+        fprintf(stderr, "test: %s: unexpected argument\n", targ[tpos]);
+        terr = YES;
+    }
+    return terr ? 2 : !v;
+}
+
+/* builtins that live with the state they work on */
+static int bi_hash(char **argv, int in_fd)
+{
+    return builtin_hash(argv);
+}
+
+static int bi_history(char **argv, int in_fd)
+{
+    return builtin_history(argv);
+}
+
+static int bi_set(char **argv, int in_fd)
+{
+    return builtin_set(argv);
+}
+
+static int bi_unset(char **argv, int in_fd)
+{
+    return builtin_unset(argv);
+}
+
+static int bi_stats(char **argv, int in_fd)
+{
+    return builtin_stats(argv);
+}
+
+static int bi_parallel(char **argv, int in_fd)
+{
+    return builtin_parallel(argv, in_fd);
+}
+
+static int bi_cached(char **argv, int in_fd)
+{
+    return builtin_cached(argv, in_fd);
+}
+
+static int bi_jobs(char **argv, int in_fd)
+{
+    return builtin_jobs(argv);
+}
+
+static int bi_fg(char **argv, int in_fd)
+{
+    return builtin_fg(argv);
+}
+
+static int bi_bg(char **argv, int in_fd)
+{
+    return builtin_bg(argv);
+}
+
+static int bi_wait(char **argv, int in_fd)
+{
+    return builtin_wait(argv);
+}
+
+static const struct builtin table[] = {		/* sorted for bsearch	*/
+    { ":",		bi_true,	BI_PURE },
+    { "[",		bi_test,	BI_PURE },
+    { "bg",		bi_bg,		0 },
+    { "break",		bi_break,	0 },
+    { "cached",		bi_cached,	BI_OWNIN },
+    { "cd",		bi_cd,		0 },
+    { "continue",	bi_break,	0 },
+    { "echo",		bi_echo,	BI_PURE },
+    { "exit",		bi_exit,	0 },
+    { "export",		bi_export,	0 },
+    { "false",		bi_false,	BI_PURE },
+    { "fg",		bi_fg,		0 },
+    { "hash",		bi_hash,	0 },
+    { "history",	bi_history,	0 },
+    { "jobs",		bi_jobs,	0 },
+    { "parallel",	bi_parallel,	BI_OWNIN },
+    { "pwd",		bi_pwd,		BI_PURE },
+    { "read",		bi_read,	BI_OWNIN },
+    { "return",		bi_return,	0 },
+    { "set",		bi_set,		0 },
+    { "shift",		bi_shift,	0 },
+    { "stats",		bi_stats,	0 },
+    { "test",		bi_test,	BI_PURE },
+    { "true",		bi_true,	BI_PURE },
+    { "unset",		bi_unset,	0 },
+    { "wait",		bi_wait,	0 },
+};
+
+static int cmp_name(const void *key, const void *ent)
+{
+    return strcmp(key, ((const struct builtin *)ent)->name);
+}
+
+const struct builtin *find_builtin(char *name)
+/*
+ * purpose: look name up in the dispatch table
+ * returns: its entry, or NULL if name is not a builtin
+ */
+{
+    if (name == NULL)
+        return NULL;
+    return bsearch(name, table, sizeof table / sizeof table[0],
+                   sizeof table[0], cmp_name);
+}
@@ -0,0 +1,385 @@
+/* cache.c - the "cached" builtin: replay the output of commands run before
+ *
+ *    cached command [arg...]
+ *
+ *    Runs command as the shell would, once; after that the same command
+ *    with the same input is not run at all: its stdout and exit status
+ *    are copied back out of a cache file.  It is meant for expensive,
+ *    deterministic commands such as code generators and data extracts.
+ *
+ *    The key is a hash of the argv, of the program's path, size and
+ *    mtime (so a rebuilt generator misses), of the values of the shell
+ *    variables named in SMSH_CACHEENV (blank-separated; name PWD there
+ *    when relative paths in the arguments matter), and of all of the
+ *    builtin's input when it has any: a < file, heredoc or here-string,
+ *    or the pipe it is the last stage of.  A seekable input is hashed
+ *    where it lies and the command reads it from the same offset; a
+ *    pipe is read into a memfd as it is hashed, and the command reads
+ *    that.  Plain stdin is never read, as the command would be the one
+ *    to read it.
+ *
+ *    An entry is one file named by the key in hex: a header with the
+ *    status, the input length and the key's text, which a hit compares
+ *    to its own so that a hash collision is a miss, then the output.  A
+ *    miss runs the command with its stdout on a temporary file in the
+ *    cache directory, which is renamed into place if the command
+ *    exited (a killed one is not stored) and then copied to stdout; so
+ *    the output appears when the command is done.  stderr is not kept.
+ *
+ *    A hit sets the entry's mtime, and a store that takes the directory
+ *    over its cap removes the entries used longest ago until it fits:
+ *    LRU by mtime, so concurrent shells need no lock or index file.
+ *    Temporary files a day old, whose shell must have died, go too.
+ *
+ *    SMSH_CACHEDIR is the directory (default $XDG_CACHE_HOME/smsh, or
+ *    $HOME/.cache/smsh), SMSH_CACHESIZE the cap in megabytes (default
+ *    100).  With no usable directory the command just runs.  A
+ *    directory or an entry that is not the user's own, or that others
+ *    may write to, is not used: anyone who could write there could
+ *    plant the output and status another user's command replays.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdint.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<dirent.h>
+#include	<time.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	<sys/wait.h>
+#include	"smsh.h"
+
+#define	CC_MAGIC	"smshcc\0\1"
+#define	CC_NAMELEN	16		/* hex digits of a key		*/
+#define	CC_STALE	86400		/* age of a tmp file no one owns */
+
+struct cc_header {
+    char		magic[8];
+    uint64_t		key;
+    uint64_t		inlen;		/* bytes of input hashed	*/
+    uint64_t		keylen;		/* text of the key, after this	*/
+    uint64_t		outlen;		/* output, after the key	*/
+    int64_t		status;		/* as $? shows it		*/
+};
+
+struct keytext {			/* what the key is a hash of	*/
+    char		*buf;
+    size_t		len, cap;
+};
+
+struct entry {				/* one cache file, for eviction	*/
+    char		name[CC_NAMELEN + 1];
+    off_t		size;
+    struct timespec	used;
+};
+
+static uint64_t hash(uint64_t h, const void *p, size_t n)
+{
+    const unsigned char *s = p;
+
+    while (n-- > 0)
+        h = (h ^ *s++) * 1099511628211ull;
+    return h;
+}
+
+static void add(struct keytext *k, const char *s, size_t n)
+/*
+ * purpose: append s, n bytes, and a NUL to the key's text
+ */
+{
+    if (k->len + n + 1 > k->cap) {
+        k->cap = (k->len + n + 1) * 2;
+        k->buf = erealloc(k->buf, k->cap);
+    }
+    memcpy(k->buf + k->len, s, n);
+    k->len += n;
+    k->buf[k->len++] = '\0';
+}
+
+static void key_text(struct keytext *k, char **argv)
+/*
+ * purpose: put argv, the program's identity and the SMSH_CACHEENV
+ *          variables into k
+ */
+{
+    char *path = path_lookup(argv[0]), *names, *v, num[64];
+    struct stat st;
+    size_t n;
+    int i;
+
+    for (i = 0; argv[i] != NULL; i++)
+        add(k, argv[i], strlen(argv[i]));
+    add(k, "", 0);
+    if (path != NULL && stat(path, &st) == 0) {
+        snprintf(num, sizeof num, "%lld %lld.%09ld", (long long)st.st_size,
+                 (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        add(k, path, strlen(path));
+        add(k, num, strlen(num));
+    }
+    add(k, "", 0);
+    if ((names = getenv("SMSH_CACHEENV")) == NULL)
+        return;
+    while (*(names += strspn(names, " \t,")) != '\0') {
+        n = strcspn(names, " \t,");
+        add(k, names, n);
+        if ((v = var_get(names, n)) != NULL)
+            add(k, v, strlen(v));
+        names += n;
+    }
+}
+
+static int hash_input(int fd, uint64_t *hp, uint64_t *lenp)
+/*
+ * purpose: hash all of what fd has left to read
+ * returns: the fd the command is to read it from: fd itself, back at
+ *          its offset, or a memfd holding what a pipe gave; -1 on error
+ */
+{
+    char buf[128 * 1024];
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    ssize_t n;
+    int copy = -1;
+
+    if (pos == -1 && (copy = memfd_create("cached-in", MFD_CLOEXEC)) == -1) {
+        perror("cached: memfd_create");
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof buf)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("cached: read");
+            break;
+        }
+        *hp = hash(*hp, buf, n);
+        *lenp += n;
+        if (copy != -1 && write(copy, buf, n) != n) {
+            perror("cached: write");
+            break;
+        }
+    }
+    if (n != 0) {
+        if (copy != -1)
+            close(copy);
+        return -1;
+    }
+    if (copy == -1) {
+        lseek(fd, pos, SEEK_SET);
+        return fd;
+    }
+    lseek(copy, 0, SEEK_SET);
+    return copy;
+}
+
+static char *cache_dir()
+/*
+ * purpose: find the cache directory, making it if need be
+ * returns: its path (static), or NULL if there is none to be had or
+ *          it is not a directory of the user's own that no one else
+ *          can write to
+ */
+{
+    static char dir[4096];
+    struct stat st;
+    char *s;
+
+    if ((s = getenv("SMSH_CACHEDIR")) != NULL)
+        snprintf(dir, sizeof dir, "%s", s);
+    else if ((s = getenv("XDG_CACHE_HOME")) != NULL && *s == '/')
+        snprintf(dir, sizeof dir, "%s/smsh", s);
+    else if ((s = getenv("HOME")) != NULL) {
+        snprintf(dir, sizeof dir, "%s/.cache", s);
+        mkdir(dir, 0700);
+        strcat(dir, "/smsh");
+    } else
+        return NULL;
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return NULL;
+    if (lstat(dir, &st) == -1 || !S_ISDIR(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+        return NULL;
+    return dir;
+}
+
+static int replay(char *path, struct cc_header *want, char *text)
+/*
+ * purpose: copy the output in entry path to stdout if it is the entry
+ *          for want and text
+ * returns: its status, or -1 for a miss
+ *   notes: an entry not the user's own, or writable by others, misses
+ */
+{
+    struct cc_header h;
+    struct stat st;
+    char *got;
+    int fd, rv = -1;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))
+        || read(fd, &h, sizeof h) != sizeof h || memcmp(h.magic, CC_MAGIC, 8) != 0
+        || h.key != want->key || h.inlen != want->inlen || h.keylen != want->keylen
+        || (uint64_t)st.st_size != sizeof h + h.keylen + h.outlen) {
+        close(fd);
+        return -1;
+    }
+    got = emalloc(h.keylen);
+    if (read(fd, got, h.keylen) == (ssize_t)h.keylen
+        && memcmp(got, text, h.keylen) == 0) {
+        futimens(fd, NULL);		/* used now: last to be evicted	*/
+        fflush(stdout);
+        kcopy(fd, STDOUT_FILENO);
+        rv = h.status;
+    }
+    free(got);
+    close(fd);
+    return rv;
+}
+
+static int older(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+static void evict(char *dir)
+/*
+ * purpose: remove the least recently used entries in dir until they
+ *          fit under SMSH_CACHESIZE
+ */
+{
+    char *s = getenv("SMSH_CACHESIZE");
+    off_t cap = (s != NULL && atoll(s) > 0 ? atoll(s) : 100) << 20, total = 0;
+    struct entry *ents = NULL;
+    int n = 0, cap_n = 0, i, dfd;
+    struct dirent *d;
+    struct stat st;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        return;
+    dfd = dirfd(dp);
+    while ((d = readdir(dp)) != NULL) {
+        if (strncmp(d->d_name, "tmp.", 4) == 0	/* left by a shell killed mid-run */
+            && fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+            && st.st_mtime < time(NULL) - CC_STALE)
+            unlinkat(dfd, d->d_name, 0);
+        if (strlen(d->d_name) != CC_NAMELEN
+            || strspn(d->d_name, "0123456789abcdef") != CC_NAMELEN
+            || fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1
+            || !S_ISREG(st.st_mode))
+            continue;
+        if (n == cap_n) {
+            cap_n = cap_n ? cap_n * 2 : 64;
+            ents = erealloc(ents, cap_n * sizeof(struct entry));
+        }
+        strcpy(ents[n].name, d->d_name);
+        ents[n].size = st.st_size;
+        ents[n].used = st.st_mtim;
+        total += st.st_size;
+        n++;
+    }
+    if (total > cap) {
+        qsort(ents, n, sizeof(struct entry), older);
+        for (i = 0; i < n && total > cap; i++)
+            if (unlinkat(dfd, ents[i].name, 0) == 0)
+                total -= ents[i].size;
+    }
+    free(ents);
+    closedir(dp);
+}
+
+static int run(char **argv, int in, int out)
+/*
+ * purpose: run argv with in (unless -1) as its stdin and out (unless
+ *          -1) as its stdout
+ * returns: its wait status, or -1 if it did not start
+ */
+{
+    struct spawn_plan plan;
+    pid_t pid;
+
+    spawn_init(&plan);
+    plan.ignint = job_async;
+    if (in != -1)
+        spawn_dup2(&plan, in, STDIN_FILENO);
+    if (out != -1)
+        spawn_dup2(&plan, out, STDOUT_FILENO);
+    fflush(stdout);
+    child_hold();
+    if ((pid = spawn_run(&plan, argv)) != -1)
+        child_add(pid, TAG_FG);
+    child_release();
+    spawn_free(&plan);
+    return pid == -1 ? -1 : child_wait(pid);
+}
+
+int builtin_cached(char **argv, int in_fd)
+/*
+ * purpose: run argv[1...] or replay its output, as described above
+ * returns: its exit status
+ */
+{
+    struct keytext text = { NULL, 0, 0 };
+    struct cc_header h;
+    char *dir, path[4200], tmp[4200];
+    int in = -1, out = -1, status, rv;
+
+    if (argv[1] == NULL) {
+        fprintf(stderr, "usage: cached command [arg...]\n");
+        return 2;
+    }
+    key_text(&text, argv + 1);
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, CC_MAGIC, 8);
+    h.key = hash(14695981039346656037ull, text.buf, text.len);
+    h.keylen = text.len;
+    if (in_fd != STDIN_FILENO && (in = hash_input(in_fd, &h.key, &h.inlen)) == -1) {
+        free(text.buf);
+        return 1;
+    }
+
+    if ((dir = cache_dir()) != NULL) {
+        snprintf(path, sizeof path, "%s/%016llx", dir, (unsigned long long)h.key);
+        if ((rv = replay(path, &h, text.buf)) != -1)
+            goto done;
+        snprintf(tmp, sizeof tmp, "%s/tmp.XXXXXX", dir);
+        if ((out = mkostemp(tmp, O_CLOEXEC)) != -1
+            && (write(out, &h, sizeof h) != sizeof h
+                || write(out, text.buf, text.len) != (ssize_t)text.len)) {
+            close(out);
+            unlink(tmp);
+            out = -1;
+        }
+    }
+
+    status = run(argv + 1, in, out);
+    rv = exit_code(status);
+    if (out == -1)
+        goto done;
+    h.outlen = lseek(out, 0, SEEK_END) - sizeof h - text.len;
+    h.status = rv;
+    if (status != -1 && WIFEXITED(status)
+        && pwrite(out, &h, sizeof h, 0) == sizeof h && rename(tmp, path) == 0)
+        evict(dir);
+    else
+        unlink(tmp);
+    lseek(out, sizeof h + text.len, SEEK_SET);
+    fflush(stdout);
+    kcopy(out, STDOUT_FILENO);
+    close(out);
+done:
+    if (in != -1 && in != in_fd)
+        close(in);
+    free(text.buf);
+    return rv;
+}
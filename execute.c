@@ -5,33 +5,31 @@
 #include	<unistd.h>
 #include	<signal.h>
 #include	<sys/wait.h>
+#include	"smsh.h"
 
 int execute(char *argv[])
 /*
  * purpose: run a program passing it arguments
  * returns: status returned via wait, or -1 on error
- *  errors: -1 on fork() or wait() errors
-
+ *  errors: -1 on spawn or wait errors
+ *   notes: launched through spawn_run(), so no fork() on the
+ *          default path
  */
 {
-	int	pid ;
+	struct spawn_plan plan;
+	pid_t	pid ;
 	int	child_info = -1;
 
 	if ( argv[0] == NULL )		/* nothing succeeds	*/
 		return 0;
 
-	if ( (pid = fork())  == -1 )
-		perror("fork");
-	else if ( pid == 0 ){
-		signal(SIGINT, SIG_DFL);
-		signal(SIGQUIT, SIG_DFL);
-		execvp(argv[0], argv);
-		perror("cannot execute command");
-		exit(1);
-	}
-	else {
-		if ( wait(&child_info) == -1 )
-			perror("wait");
-	}
+	spawn_init(&plan);
+	pid = spawn_run(&plan, argv);
+	spawn_free(&plan);
+	if ( pid == -1 )
+		return -1;
+	child_add(pid, TAG_FG);
+	if ( (child_info = child_wait(pid)) == -1 )
+		perror("wait");
 	return child_info;
 }
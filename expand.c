@@ -0,0 +1,320 @@
+/* expand.c - parameter expansion for smsh words
+ *
+ *    int   expand_word(struct arena *a, struct word *w, char ***fieldsp)
+ *    char *expand_string(struct arena *a, struct word *w) - one, unsplit
+ *    char *param_value(struct arena *a, char *name, size_t len)
+ *
+ *    The parser marks each $ expansion in word.exp; here the marks are
+ *    replaced by values when the command runs.  Values from bare
+ *    expansions are split into separate words at blanks and newlines;
+ *    values from inside double quotes are not.  Words without a
+ *    marked expansion never come here.
+ *
+ *    Parameters: $? (last exit status), $$ (shell pid), $! (last
+ *    background job), $PIPESTATUS and ${PIPESTATUS[n]} (status of each
+ *    stage of the last pipeline), $0, $1 ... ${10} ..., $# and $* or $@
+ *    (the script's or function's arguments; "$@" is one word per
+ *    argument), and any other name is a shell variable (vars.c).
+ *    ${name:-word}, ${name:=word}, ${name:+word} and ${name:?word},
+ *    with or without the colon (without it only an unset name counts,
+ *    not an empty one), and ${#name}, the length, work as in sh; word
+ *    is scanned and expanded only when it is used.
+ *
+ *    Command substitution: $(command) and `command` are replaced by
+ *    what the command writes, less its trailing newlines, and split
+ *    like a parameter's value.  command_subst() in smsh4.c runs it.
+ *    <(command) and >(command) are replaced by the /dev/fd path of a
+ *    pipe from or to the command, started by proc_subst(), and are
+ *    never split.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<unistd.h>
+#include	"smsh.h"
+
+#define	is_ifs(c)	((c) == ' ' || (c) == '\t' || (c) == '\n')
+
+static char	*buf;			/* the field being built	*/
+static size_t	blen, bcap;
+
+static void put(const char *s, size_t n)
+{
+    if (blen + n + 1 > bcap) {
+        bcap = (blen + n + 1) * 2;
+        buf = erealloc(buf, bcap);
+    }
+    memcpy(buf + blen, s, n);
+    blen += n;
+}
+
+static char *itoa_arena(struct arena *a, long v)
+{
+    char tmp[24];
+
+    snprintf(tmp, sizeof tmp, "%ld", v);
+    return arena_strndup(a, tmp, strlen(tmp));
+}
+
+static char *pipestatus_value(struct arena *a, char *index)
+/*
+ * purpose: $PIPESTATUS, ${PIPESTATUS[@]} or ${PIPESTATUS[n]}
+ */
+{
+    char *s, *p;
+    int i;
+
+    if (index != NULL && strcmp(index, "[@]") != 0 && strcmp(index, "[*]") != 0) {
+        i = atoi(index + 1);
+        return (i >= 0 && i < npipestatus) ? itoa_arena(a, pipestatus[i]) : NULL;
+    }
+    p = s = arena_alloc(a, npipestatus * 12 + 1);
+    *p = '\0';
+    for (i = 0; i < npipestatus; i++)
+        p += sprintf(p, i ? " %d" : "%d", pipestatus[i]);
+    return s;
+}
+
+static char *positional(char *name, size_t len)
+/*
+ * purpose: $0, $1 ... for name[0..len) all digits
+ */
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        if (!isdigit((unsigned char)name[i]))
+            return NULL;
+        if ((n = n * 10 + name[i] - '0') > (size_t)nparams)
+            return NULL;
+    }
+    return n == 0 ? shell_name : params[n - 1];
+}
+
+static char *join_params(struct arena *a)
+/*
+ * purpose: $* or $@: the positional parameters, joined by spaces
+ */
+{
+    size_t len = 0;
+    char *s, *p;
+    int i;
+
+    for (i = 0; i < nparams; i++)
+        len += strlen(params[i]) + 1;
+    p = s = arena_alloc(a, len + 1);
+    *p = '\0';
+    for (i = 0; i < nparams; i++)
+        p += sprintf(p, i ? " %s" : "%s", params[i]);
+    return s;
+}
+
+static char *lookup(struct arena *a, char *name, size_t len)
+/*
+ * purpose: the value of the plain parameter name[0..len)
+ * returns: its value, or NULL if it is unset
+ */
+{
+    if (len == 1 && *name == '?')
+        return itoa_arena(a, last_status);
+    if (len == 1 && *name == '$')
+        return itoa_arena(a, (long)shell_pid);
+    if (len == 1 && *name == '!')
+        return last_bg ? itoa_arena(a, (long)last_bg) : NULL;
+    if (len == 1 && *name == '#')
+        return itoa_arena(a, nparams);
+    if (len == 1 && (*name == '@' || *name == '*'))
+        return join_params(a);
+    if (isdigit((unsigned char)*name))
+        return positional(name, len);
+    if (len >= 10 && strncmp(name, "PIPESTATUS", 10) == 0
+        && (len == 10 || name[10] == '['))
+        return pipestatus_value(a, len > 10 ? arena_strndup(a, name + 10, len - 10) : NULL);
+    return var_get(name, len);
+}
+
+static size_t name_len(char *s, size_t len)
+/*
+ * purpose: how much of s[0..len) is the parameter's name, in ${...}
+ */
+{
+    size_t n = 0;
+
+    if (len > 0 && strchr("?$!#@*", *s) != NULL)
+        return 1;
+    while (n < len && (isalnum((unsigned char)s[n]) || s[n] == '_'))
+        n++;
+    if (n == 10 && strncmp(s, "PIPESTATUS", 10) == 0 && n < len && s[n] == '[')
+        while (n < len && s[n - 1] != ']')
+            n++;
+    return n;
+}
+
+char *param_value(struct arena *a, char *name, size_t len)
+/*
+ * purpose: the value of the parameter expression name[0..len): a
+ *          name, or what was inside ${...}
+ * returns: its value, or NULL if it is unset
+ *  errors: a malformed expression is reported and has no value;
+ *          ${name?word} of an unset name is reported and, in a
+ *          script, ends it
+ */
+{
+    size_t n = name_len(name, len);
+    char *v, *op, *word;
+    struct word w;
+    int colon, use_word;
+
+    if (len > 1 && *name == '#' && name_len(name + 1, len - 1) == len - 1) {
+        v = lookup(a, name + 1, len - 1);
+        return itoa_arena(a, v ? (long)strlen(v) : 0);
+    }
+    if (n == len)
+        return lookup(a, name, len);
+    op = name + n;
+    colon = *op == ':';
+    if (n == 0 || strchr("-=+?", op[colon]) == NULL || op + colon >= name + len) {
+        fprintf(stderr, "smsh: ${%.*s}: bad substitution\n", (int)len, name);
+        return NULL;
+    }
+    v = lookup(a, name, n);
+    use_word = v == NULL || (colon && *v == '\0');
+    if (op[colon] == '+')
+        use_word = !use_word;
+    if (!use_word)
+        return op[colon] == '+' ? NULL : v;
+    word = op + colon + 1;
+    w = parse_word(a, word, name + len - word);
+    word = expand_string(a, &w);
+    switch (op[colon]) {
+    case '=':
+        if (var_set(name, n, word, 0) == -1) {
+            fprintf(stderr, "smsh: $%.*s: cannot assign in this way\n", (int)n, name);
+            return NULL;
+        }
+        break;
+    case '?':
+        fprintf(stderr, "smsh: %.*s: %s\n", (int)n, name,
+                *word ? word : "parameter null or not set");
+        if (!job_control)
+            exit(1);
+        return NULL;
+    }
+    return word;
+}
+
+static char **push(struct arena *a, char **v, int *n, int *cap, char *s)
+{
+    char **nv;
+
+    if (*n + 1 >= *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        nv = arena_alloc(a, *cap * sizeof(char *));
+        if (*n > 0)
+            memcpy(nv, v, *n * sizeof(char *));
+        v = nv;
+    }
+    v[(*n)++] = s;
+    v[*n] = NULL;
+    return v;
+}
+
+static int expand(struct arena *a, struct word *w, char ***fieldsp, int nosplit)
+/*
+ * purpose: expand_word(), or with nosplit every value kept whole
+ *   notes: builds its fields at the end of buf, after anything an
+ *          outer expansion (one this is the ${x:-word} of) has there
+ */
+{
+    char **fields = NULL, *p, *end, *v;
+    size_t base = blen;
+    int n = 0, cap = 0, have = NO, split, cmd, i;
+
+    for (p = w->exp; *p != '\0'; ) {
+        if (*p != CTLVAR && *p != CTLQVAR && *p != CTLCMD && *p != CTLQCMD && *p != CTLPROC) {
+            put(p++, 1);
+            have = YES;
+            continue;
+        }
+        if (*p == CTLPROC) {
+            end = strchr(p, CTLEND);
+            v = proc_subst(a, p + 1, end - p - 1);
+            put(v, strlen(v));
+            have = YES;
+            p = end + 1;
+            continue;
+        }
+        cmd = *p == CTLCMD || *p == CTLQCMD;
+        split = (*p == CTLVAR || *p == CTLCMD) && !nosplit;
+        end = strchr(++p, CTLEND);
+        if (*p == '@' && end == p + 1 && !cmd && !split && !nosplit) {
+            for (i = 0; i < nparams; i++) {	/* "$@": a word each	*/
+                if (i > 0) {
+                    fields = push(a, fields, &n, &cap, arena_strndup(a, buf + base, blen - base));
+                    blen = base;
+                }
+                put(params[i], strlen(params[i]));
+                have = YES;
+            }
+            p = end + 1;
+            continue;
+        }
+        v = cmd ? command_subst(a, p, end - p) : param_value(a, p, end - p);
+        p = end + 1;
+        if (!split)			/* "$x" is a word even when empty */
+            have = YES;
+        if (v == NULL)
+            continue;
+        if (!split) {
+            put(v, strlen(v));
+            have = YES;
+            continue;
+        }
+        for (; *v != '\0'; v++) {
+            if (!is_ifs(*v)) {
+                put(v, 1);
+                have = YES;
+            } else if (have) {
+                fields = push(a, fields, &n, &cap, arena_strndup(a, buf + base, blen - base));
+                blen = base;
+                have = NO;
+            }
+        }
+    }
+    if (have || nosplit)
+        fields = push(a, fields, &n, &cap, arena_strndup(a, buf + base, blen - base));
+    blen = base;
+    if (fields == NULL) {
+        fields = arena_alloc(a, sizeof(char *));
+        fields[0] = NULL;
+    }
+    *fieldsp = fields;
+    return n;
+}
+
+int expand_word(struct arena *a, struct word *w, char ***fieldsp)
+/*
+ * purpose: expand the parameters in one word
+ * returns: the number of resulting words, stored NULL-terminated in
+ *          *fieldsp (an unquoted empty expansion gives none at all)
+ */
+{
+    return expand(a, w, fieldsp, NO);
+}
+
+char *expand_string(struct arena *a, struct word *w)
+/*
+ * purpose: expand a word that is not split, such as the value in an
+ *          assignment or the word in ${x:-word}
+ * returns: the text, in a
+ */
+{
+    char **fields;
+
+    if (w->exp == NULL)
+        return w->text;
+    expand(a, w, &fields, YES);
+    return fields[0];
+}
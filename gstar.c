@@ -0,0 +1,376 @@
+/* gstar.c - the recursive walks behind ** patterns, on a thread pool
+ *
+ *    char **gstar(struct arena *a, const char *dir, size_t dlen,
+ *                 const char *last, int *np)
+ *
+ *    A recursive pattern over a big source tree touches millions of
+ *    directory entries, and a walk with opendir and a stat per entry spends
+ *    nearly all its time waiting on one system call at a time.  Here
+ *    each directory is one task: a worker opens it with openat()
+ *    relative to the starting directory, reads it in large batches
+ *    with getdents64, uses d_type to tell subdirectories from files
+ *    (a stat only when the filesystem does not say), matches names
+ *    against the last pattern component and queues the
+ *    subdirectories as new tasks.
+ *
+ *    Every worker owns a deque of tasks: it pushes and pops at the
+ *    tail, depth first, and an idle worker steals from the head of
+ *    another's, where the oldest and usually largest subtrees are.
+ *    A shared count of queued and running tasks says when the walk
+ *    is over.  Each worker then sorts its own results, and the sorted
+ *    runs are merged, so the output order does not depend on which
+ *    worker found what.
+ *
+ *    As with bash's globstar, ** does not descend into directories
+ *    whose names begin with '.', nor through symbolic links.
+ *    SMSH_GLOBTHREADS=N sets the number of workers (default: one per
+ *    online CPU, at most GS_MAXTHREADS); 1 walks in the shell alone.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<dirent.h>
+#include	<fcntl.h>
+#include	<pthread.h>
+#include	<sched.h>
+#include	<signal.h>
+#include	<unistd.h>
+#include	<sys/stat.h>
+#include	<sys/syscall.h>
+#include	"smsh.h"
+
+#define	GS_MAXTHREADS	16
+#define	GS_DENTS	(64 * 1024)	/* getdents64 buffer		*/
+#define	GS_CHUNK	(256 * 1024)	/* string pool block		*/
+
+struct linux_dirent64 {			/* what getdents64 returns	*/
+    ino_t		d_ino;
+    off_t		d_off;
+    unsigned short	d_reclen;
+    unsigned char	d_type;
+    char		d_name[];
+};
+
+struct chunk {
+    struct chunk	*next;
+    size_t		used;
+    char		data[GS_CHUNK];
+};
+
+struct task {
+    char		*rel;		/* path from the start, ends '/' */
+    size_t		len;		/* or "" for the start itself	*/
+};
+
+struct worker {
+    pthread_t		tid;
+    struct walk		*w;
+    pthread_mutex_t	mu;		/* guards the deque		*/
+    struct task		*dq;		/* circular: head..tail		*/
+    int			head, tail, cap;
+    char		**out;		/* this worker's results	*/
+    int			nout, capout;
+    struct chunk	*pool;
+};
+
+struct walk {
+    int			root;		/* fd of the starting directory	*/
+    const char		*last;		/* match names, NULL: list dirs	*/
+    int			nworker;
+    struct worker	*ws;
+    long		pending;	/* tasks queued or running	*/
+};
+
+static char *save(struct worker *me, const char *a, size_t alen,
+                  const char *b, size_t blen, int slash)
+/*
+ * purpose: a + b [+ '/'] as a string in the worker's pool
+ */
+{
+    struct chunk *c = me->pool;
+    size_t need = alen + blen + slash + 1;
+    char *s;
+
+    if (c == NULL || c->used + need > GS_CHUNK) {
+        c = emalloc(need > GS_CHUNK ? sizeof(struct chunk) + need : sizeof(struct chunk));
+        c->used = 0;
+        c->next = me->pool;
+        me->pool = c;
+    }
+    s = c->data + c->used;
+    memcpy(s, a, alen);
+    memcpy(s + alen, b, blen);
+    if (slash)
+        s[alen + blen] = '/';
+    s[need - 1] = '\0';
+    c->used += need;
+    return s;
+}
+
+static void result(struct worker *me, char *s)
+{
+    if (me->nout == me->capout) {
+        me->capout = me->capout ? me->capout * 2 : 256;
+        me->out = erealloc(me->out, me->capout * sizeof(char *));
+    }
+    me->out[me->nout++] = s;
+}
+
+/* the deques */
+
+static void push(struct worker *me, char *rel, size_t len)
+{
+    struct task *nd;
+    int i, n, ncap;
+
+    __atomic_add_fetch(&me->w->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&me->mu);
+    if ((n = me->tail - me->head) == me->cap) {
+        ncap = me->cap ? me->cap * 2 : 64;
+        nd = emalloc(ncap * sizeof(struct task));
+        for (i = 0; i < n; i++)
+            nd[i] = me->dq[(me->head + i) % me->cap];
+        free(me->dq);
+        me->dq = nd;
+        me->cap = ncap;
+        me->head = 0;
+        me->tail = n;
+    }
+    me->dq[me->tail % me->cap].rel = rel;
+    me->dq[me->tail++ % me->cap].len = len;
+    pthread_mutex_unlock(&me->mu);
+}
+
+static int take(struct worker *from, struct task *t, int steal)
+/*
+ * purpose: the newest task (the owner) or the oldest (a thief)
+ * returns: YES if there was one
+ */
+{
+    int ok = NO;
+
+    pthread_mutex_lock(&from->mu);
+    if (from->tail > from->head) {
+        *t = steal ? from->dq[from->head++ % from->cap]
+                   : from->dq[--from->tail % from->cap];
+        ok = YES;
+    }
+    pthread_mutex_unlock(&from->mu);
+    return ok;
+}
+
+/* the walk */
+
+static void scan(struct worker *me, struct task *t)
+/*
+ * purpose: read one directory, keep what matches, queue its subdirectories
+ *   notes: unreadable directories are passed over silently, as a
+ *          glob does
+ */
+{
+    struct walk *w = me->w;
+    struct linux_dirent64 *e;
+    struct stat st;
+    char buf[GS_DENTS], *name;
+    long n, off;
+    int fd, type;
+    size_t nlen;
+
+    if (w->last == NULL)
+        result(me, t->rel);
+    fd = openat(w->root, t->len ? t->rel : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    while ((n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0) {
+        for (off = 0; off < n; off += e->d_reclen) {
+            e = (struct linux_dirent64 *)(buf + off);
+            name = e->d_name;
+            if (name[0] == '.' && (name[1] == '\0'
+                || (name[1] == '.' && name[2] == '\0')))
+                continue;
+            type = e->d_type;
+            if (type == DT_UNKNOWN) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+            nlen = strlen(name);
+            if (w->last != NULL && (name[0] != '.' || w->last[0] == '.')
+                && gmatch(w->last, name))
+                result(me, save(me, t->rel, t->len, name, nlen, NO));
+            if (type == DT_DIR && name[0] != '.')
+                push(me, save(me, t->rel, t->len, name, nlen, YES),
+                     t->len + nlen + 1);
+        }
+    }
+    close(fd);
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void *work(void *arg)
+/*
+ * purpose: a worker: run tasks, its own first, then other workers',
+ *          until none are left anywhere; then sort what it found
+ */
+{
+    struct worker *me = arg, *ws = me->w->ws;
+    struct task t;
+    int i, k, nw = me->w->nworker, self = me - ws;
+
+    for (;;) {
+        if (take(me, &t, NO)) {
+            scan(me, &t);
+            __atomic_sub_fetch(&me->w->pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        for (i = 1; i < nw; i++) {
+            k = (self + i) % nw;
+            if (take(&ws[k], &t, YES))
+                break;
+        }
+        if (i < nw) {
+            scan(me, &t);
+            __atomic_sub_fetch(&me->w->pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (__atomic_load_n(&me->w->pending, __ATOMIC_SEQ_CST) == 0)
+            break;
+        sched_yield();			/* someone is still scanning	*/
+    }
+    qsort(me->out, me->nout, sizeof(char *), cmp_str);
+    return NULL;
+}
+
+static int nthreads()
+{
+    static int n;
+    char *s;
+
+    if (n == 0) {
+        if ((s = getenv("SMSH_GLOBTHREADS")) != NULL && atoi(s) > 0)
+            n = atoi(s);
+        else
+            n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1)
+            n = 1;
+        if (n > GS_MAXTHREADS)
+            n = GS_MAXTHREADS;
+    }
+    return n;
+}
+
+static void merge(struct arena *a, struct walk *w, const char *dir, size_t dlen,
+                  char **v)
+/*
+ * purpose: merge the workers' sorted runs into v, each path prefixed
+ *          with dir
+ *   notes: a small binary heap of run heads, smallest on top
+ */
+{
+    int heap[GS_MAXTHREADS], pos[GS_MAXTHREADS], nh = 0, i, c, x, n = 0;
+    struct worker *ws = w->ws;
+    size_t len;
+
+#define	HEAD(k)	(ws[k].out[pos[k]])
+    for (i = 0; i < w->nworker; i++) {
+        pos[i] = 0;
+        if (ws[i].nout == 0)
+            continue;
+        for (c = nh++; c > 0 && strcmp(HEAD(i), HEAD(heap[(c - 1) / 2])) < 0; c = (c - 1) / 2)
+            heap[c] = heap[(c - 1) / 2];
+        heap[c] = i;
+    }
+    while (nh > 0) {
+        x = heap[0];
+        len = strlen(HEAD(x));
+        v[n] = arena_alloc(a, dlen + len + 1);
+        memcpy(v[n], dir, dlen);
+        memcpy(v[n++] + dlen, HEAD(x), len + 1);
+        if (++pos[x] == ws[x].nout)
+            x = heap[--nh];
+        for (i = 0; (c = 2 * i + 1) < nh; i = c) {	/* sift x down	*/
+            if (c + 1 < nh && strcmp(HEAD(heap[c + 1]), HEAD(heap[c])) < 0)
+                c++;
+            if (strcmp(HEAD(heap[c]), HEAD(x)) >= 0)
+                break;
+            heap[i] = heap[c];
+        }
+        if (nh > 0)
+            heap[i] = x;
+    }
+#undef	HEAD
+    v[n] = NULL;
+}
+
+char **gstar(struct arena *a, const char *dir, size_t dlen, const char *last, int *np)
+/*
+ * purpose: walk the tree under dir[0..dlen) ("" is the current
+ *          directory; otherwise it ends in '/')
+ *    args: last is a pattern matched against the names in every
+ *          directory of the tree, dir included; NULL asks for the
+ *          directories themselves instead, dir first
+ * returns: the paths, with dir in front, sorted and NULL-terminated
+ *          in a, and their number in *np; NULL if there are none
+ */
+{
+    struct walk w;
+    struct worker *me;
+    struct chunk *c, *next;
+    sigset_t all, old;
+    char path[dlen + 2], **v = NULL;
+    int i, started, total = 0;
+
+    memcpy(path, dlen ? dir : ".", dlen ? dlen : 1);
+    path[dlen ? dlen : 1] = '\0';
+    *np = 0;
+    if ((w.root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return NULL;
+    w.last = last;
+    w.nworker = nthreads();
+    w.pending = 0;
+    w.ws = emalloc(w.nworker * sizeof(struct worker));
+    memset(w.ws, 0, w.nworker * sizeof(struct worker));
+    for (i = 0; i < w.nworker; i++) {
+        w.ws[i].w = &w;
+        pthread_mutex_init(&w.ws[i].mu, NULL);
+    }
+    push(&w.ws[0], "", 0);
+
+    /* the workers take no signals: the shell's handlers stay in the shell */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (started = 1; started < w.nworker; started++)
+        if (pthread_create(&w.ws[started].tid, NULL, work, &w.ws[started]) != 0)
+            break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    work(&w.ws[0]);
+    for (i = 1; i < started; i++)
+        pthread_join(w.ws[i].tid, NULL);
+
+    for (i = 0; i < w.nworker; i++)
+        total += w.ws[i].nout;
+    if (total > 0) {
+        v = arena_alloc(a, (total + 1) * sizeof(char *));
+        merge(a, &w, dir, dlen, v);
+    }
+    for (i = 0; i < w.nworker; i++) {
+        me = &w.ws[i];
+        for (c = me->pool; c != NULL; c = next) {
+            next = c->next;
+            free(c);
+        }
+        free(me->out);
+        free(me->dq);
+        pthread_mutex_destroy(&me->mu);
+    }
+    free(w.ws);
+    close(w.root);
+    *np = total;
+    return v;
+}
@@ -0,0 +1,586 @@
+/* history.c - command history: an append-only file, mmap'd and indexed
+ *
+ *    void  hist_init()                  - open the history file
+ *    void  hist_add(char *line)         - record a line
+ *    char *hist_expand(char *line)      - !n !-n !! !prefix !?str !$
+ *    int   hist_search(s, n, before)    - newest entry containing s
+ *    char *hist_readline(char *prompt)  - read a line with ^R and arrows
+ *    int   builtin_history(char **argv) - history [N]
+ *
+ *    Every line is appended to $HISTFILE (default ~/.smsh_history) as
+ *    soon as it is entered, with one write() on an O_APPEND descriptor:
+ *    the kernel puts each write whole at the end of the file, so any
+ *    number of sessions can share one file, and nothing is rewritten
+ *    when a shell exits.  A session's history is the file as it was
+ *    when the session started, followed by its own lines.
+ *
+ *    The file is not read until history is first used.  It is then
+ *    mmap'd once and an index of where each entry starts is built with
+ *    memchr, so entry n is one array lookup however long the file is.
+ *    A reverse search runs memmem over the mapping itself, backwards
+ *    a chunk at a time, and only the hit is looked up in the index,
+ *    so recent matches in a million-entry history come back at once.
+ *
+ *    On a terminal, hist_readline() is a small line editor: left and
+ *    right, ^A ^E ^K ^U, up and down through history, and ^R for an
+ *    incremental reverse search (^R again for older matches, Enter to
+ *    run the match, ^G to give up).
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<termios.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+#define	H_CHUNK		(256 * 1024)	/* reverse search window	*/
+
+#define	K_UP		0x101		/* keys that are escape sequences */
+#define	K_DOWN		0x102
+#define	K_RIGHT		0x103
+#define	K_LEFT		0x104
+#define	K_HOME		0x105
+#define	K_END		0x106
+#define	K_DEL		0x107
+#define	K_OTHER		0x108
+
+static int	hfd = -1;		/* O_APPEND, -1 if no file	*/
+static off_t	hsize;			/* file size when we started	*/
+static char	*map;			/* the first hsize bytes, or NULL */
+static int	loaded;
+static char	**fidx;			/* start of each file entry	*/
+static int	nfile;
+static char	**sess;			/* this session's lines, with '\n' */
+static int	nsess, capsess;
+
+void hist_init()
+/*
+ * purpose: open the history file for appending, remembering its size
+ *   notes: history stays in memory only if there is no usable file
+ */
+{
+    char *name = getenv("HISTFILE"), *home, path[4096];
+    struct stat st;
+
+    if (name == NULL) {
+        if ((home = getenv("HOME")) == NULL)
+            return;
+        snprintf(path, sizeof path, "%s/.smsh_history", home);
+        name = path;
+    }
+    if (*name == '\0')			/* HISTFILE= turns it off	*/
+        return;
+    if ((hfd = open(name, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        return;
+    if (fstat(hfd, &st) == 0)
+        hsize = st.st_size;
+}
+
+static void load()
+/*
+ * purpose: map the file as it was at hist_init() and index its entries
+ *   notes: a last line without its '\n' (a writer that died) is still
+ *          an entry; entry() stops at the end of the mapping
+ */
+{
+    char *p, *end, *nl;
+    int cap = 0;
+
+    loaded = YES;
+    if (hfd == -1 || hsize == 0)
+        return;
+    map = mmap(NULL, hsize, PROT_READ, MAP_PRIVATE, hfd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        return;
+    }
+    madvise(map, hsize, MADV_SEQUENTIAL);
+    for (p = map, end = map + hsize; p < end; p = nl + 1) {
+        if (nfile == cap) {
+            cap = cap ? cap * 2 : 1024;
+            fidx = erealloc(fidx, cap * sizeof(char *));
+        }
+        fidx[nfile++] = p;
+        if ((nl = memchr(p, '\n', end - p)) == NULL)
+            break;
+    }
+    madvise(map, hsize, MADV_RANDOM);
+}
+
+static int count()
+{
+    if (!loaded)
+        load();
+    return nfile + nsess;
+}
+
+static char *entry(int i, size_t *lenp)
+/*
+ * purpose: entry i (0 is the oldest), not '\0'-terminated
+ * returns: its start, with its length in *lenp
+ */
+{
+    char *p = i < nfile ? fidx[i] : sess[i - nfile], *nl;
+    char *end = i < nfile ? map + hsize : p + strlen(p);
+
+    nl = memchr(p, '\n', end - p);
+    *lenp = (nl ? nl : end) - p;
+    return p;
+}
+
+void hist_add(char *line)
+/*
+ * purpose: add a line to the session and append it to the file
+ *   notes: blank lines are not kept
+ */
+{
+    size_t n = strlen(line);
+    char *s;
+
+    if (strspn(line, " \t") == n)
+        return;
+    s = emalloc(n + 2);
+    memcpy(s, line, n);
+    s[n] = '\n';
+    s[n + 1] = '\0';
+    if (nsess == capsess) {
+        capsess = capsess ? capsess * 2 : 64;
+        sess = erealloc(sess, capsess * sizeof(char *));
+    }
+    sess[nsess++] = s;
+    if (hfd != -1 && write(hfd, s, n + 1) == -1)
+        perror("smsh: history");
+}
+
+static int at_offset(char *p)
+/*
+ * purpose: the file entry containing the byte at p
+ */
+{
+    int lo = 0, hi = nfile - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (fidx[mid] <= p)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+int hist_search(const char *s, size_t n, int before)
+/*
+ * purpose: find the newest entry before entry number before (0-based)
+ *          that contains s[0..n)
+ * returns: its index, or -1
+ */
+{
+    char *start, *end, *p, *q, *last;
+    size_t len;
+    int i;
+
+    if (before > count())
+        before = count();
+    if (n == 0)				/* everything matches		*/
+        return before - 1;
+    for (i = before - 1; i >= nfile; i--) {
+        p = entry(i, &len);
+        if (memmem(p, len, s, n) != NULL)
+            return i;
+    }
+    if (before <= 0 || nfile == 0)
+        return -1;
+    end = before < nfile ? fidx[before] : map + hsize;
+    while (end > map) {
+        start = end - map > H_CHUNK ? end - H_CHUNK : map;
+        for (last = NULL, p = start;
+             (q = memmem(p, end - p, s, n)) != NULL; p = q + 1)
+            last = q;
+        if (last != NULL)
+            return at_offset(last);
+        if (start == map)
+            break;
+        end = start + n - 1;		/* a match may straddle chunks	*/
+    }
+    return -1;
+}
+
+/* ! expansion */
+
+static char	*xbuf;
+static size_t	xlen, xcap;
+
+static void xput(const char *s, size_t n)
+{
+    if (xlen + n + 1 > xcap) {
+        xcap = (xlen + n + 1) * 2;
+        xbuf = erealloc(xbuf, xcap);
+    }
+    memcpy(xbuf + xlen, s, n);
+    xlen += n;
+    xbuf[xlen] = '\0';
+}
+
+static int event(char *p, char **endp)
+/*
+ * purpose: find the entry a ! event (p just past the '!') names
+ * returns: its index, or -1 (reported) if there is none
+ */
+{
+    int total = count(), i, n;
+    char *q, *e;
+    size_t len, elen;
+
+    if (*p == '!' || *p == '$') {
+        *endp = p + (*p == '!');
+        i = total - 1;
+    } else if (isdigit((unsigned char)*p) || (*p == '-' && isdigit((unsigned char)p[1]))) {
+        n = strtol(p, endp, 10);
+        i = n < 0 ? total + n : n - 1;
+    } else if (*p == '?') {
+        q = p + 1;
+        len = strcspn(q, "?");
+        *endp = q + len + (q[len] == '?');
+        i = hist_search(q, len, total);
+    } else {
+        len = strcspn(p, " \t;|&<>()");
+        *endp = p + len;
+        for (i = total - 1; i >= 0; i--) {
+            e = entry(i, &elen);
+            if (elen >= len && memcmp(e, p, len) == 0)
+                break;
+        }
+    }
+    if (i < 0 || i >= total) {
+        fprintf(stderr, "smsh: !%.*s: event not found\n", (int)(*endp - p), p);
+        return -1;
+    }
+    return i;
+}
+
+char *hist_expand(char *line)
+/*
+ * purpose: replace history references in an interactive line
+ * returns: line itself if there were none, the expanded line (valid
+ *          until the next call, and echoed, as bash does), or NULL if
+ *          an event was not found
+ *   notes: a ! that is quoted with ' or \, follows $, or is followed
+ *          by a blank, = or an operator is left alone; !$ is the last word of
+ *          the previous line
+ */
+{
+    char *p, *start, *end, *e, *w;
+    int i, squote = NO, changed = NO;
+    size_t elen;
+
+    xlen = 0;
+    xput("", 0);
+    for (p = start = line; *p != '\0'; p++) {
+        if (*p == '\'')
+            squote = !squote;
+        if (squote || *p != '!' || (p > line && (p[-1] == '$' || p[-1] == '\\'))
+            || p[1] == '\0' || strchr(" \t\n=();|&<>", p[1]) != NULL)
+            continue;
+        if ((i = event(p + 1, &end)) == -1)
+            return NULL;
+        xput(start, p - start);
+        e = entry(i, &elen);
+        if (p[1] == '$') {		/* the last word only		*/
+            for (w = e + elen; w > e && isspace((unsigned char)w[-1]); w--)
+                ;
+            elen = w - e;
+            while (w > e && !isspace((unsigned char)w[-1]))
+                w--;
+            elen -= w - e;
+            e = w;
+            end = p + 2;
+        }
+        xput(e, elen);
+        start = end;
+        p = end - 1;
+        changed = YES;
+    }
+    if (!changed)
+        return line;
+    xput(start, strlen(start));
+    puts(xbuf);
+    return xbuf;
+}
+
+int builtin_history(char **argv)
+/*
+ * purpose: history [N]: list the last N entries (all by default)
+ */
+{
+    int total = count(), n = total, i;
+    size_t len;
+    char *e;
+
+    if (argv[1] != NULL && (n = atoi(argv[1])) <= 0 && strcmp(argv[1], "0") != 0) {
+        fprintf(stderr, "history: %s: numeric argument required\n", argv[1]);
+        return 1;
+    }
+    for (i = n < total ? total - n : 0; i < total; i++) {
+        e = entry(i, &len);
+        printf("%5d  %.*s\n", i + 1, (int)len, e);
+    }
+    return 0;
+}
+
+/* the line editor */
+
+static char	*lbuf;			/* the line being edited	*/
+static size_t	llen, lcap, lpos;	/* its length, the cursor	*/
+
+static void lset(const char *s, size_t n)
+{
+    if (n + 1 > lcap) {
+        lcap = (n + 1) * 2;
+        lbuf = erealloc(lbuf, lcap);
+    }
+    memmove(lbuf, s, n);
+    llen = lpos = n;
+    lbuf[n] = '\0';
+}
+
+static void out(const char *s, size_t n)
+{
+    ssize_t w;
+
+    while (n > 0 && (w = write(STDOUT_FILENO, s, n)) != 0) {
+        if (w == -1) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        s += w;
+        n -= w;
+    }
+}
+
+static void redraw(char *prompt, char *query, int fail)
+/*
+ * purpose: repaint the line: prompt and text, or the search prompt
+ *          with the match, then put the cursor where it belongs
+ */
+{
+    char tail[32];
+
+    out("\r", 1);
+    if (query != NULL) {
+        out(fail ? "(failed reverse-i-search)`" : "(reverse-i-search)`",
+            fail ? 26 : 19);
+        out(query, strlen(query));
+        out("': ", 3);
+    } else {
+        out(prompt, strlen(prompt));
+    }
+    out(lbuf, llen);
+    out("\x1b[K", 3);
+    if (lpos < llen) {
+        snprintf(tail, sizeof tail, "\x1b[%zuD", llen - lpos);
+        out(tail, strlen(tail));
+    }
+}
+
+static int key()
+/*
+ * returns: the next key: a byte, or one of the K_ codes for an arrow
+ *          or other escape sequence; -1 at end of input
+ */
+{
+    unsigned char c, seq[3];
+    ssize_t n;
+
+    while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR)
+        ;
+    if (n != 1)
+        return -1;
+    if (c != 0x1b)
+        return c;
+    if (read(STDIN_FILENO, seq, 1) != 1 || (seq[0] != '[' && seq[0] != 'O'))
+        return K_OTHER;
+    if (read(STDIN_FILENO, seq + 1, 1) != 1)
+        return K_OTHER;
+    if (isdigit(seq[1])) {
+        if (read(STDIN_FILENO, seq + 2, 1) != 1 || seq[2] != '~')
+            return K_OTHER;
+        return seq[1] == '3' ? K_DEL : seq[1] == '1' || seq[1] == '7' ? K_HOME
+             : seq[1] == '4' || seq[1] == '8' ? K_END : K_OTHER;
+    }
+    switch (seq[1]) {
+    case 'A': return K_UP;
+    case 'B': return K_DOWN;
+    case 'C': return K_RIGHT;
+    case 'D': return K_LEFT;
+    case 'H': return K_HOME;
+    case 'F': return K_END;
+    }
+    return K_OTHER;
+}
+
+static int search(char *prompt)
+/*
+ * purpose: ^R: the incremental reverse search
+ * returns: the key that ended it: '\r' to run the line, 0 to go on
+ *          editing it, or -1 at end of input
+ *  action: leaves the match (or the original line, after ^G) in lbuf
+ */
+{
+    char query[256], *e, *saved = strndup(lbuf, llen);
+    size_t qlen = 0, elen;
+    int at = count(), found, k, fail = NO;
+
+    query[0] = '\0';
+    redraw(prompt, query, NO);
+    for (;;) {
+        k = key();
+        if (k == 0x12) {		/* ^R: an older match		*/
+            if ((found = hist_search(query, qlen, at)) != -1)
+                at = found;
+            fail = found == -1;
+        } else if (k == 0x7f || k == 0x08) {
+            if (qlen > 0)
+                query[--qlen] = '\0';
+            at = count();
+            found = hist_search(query, qlen, at);
+            fail = found == -1;
+            if (found != -1)
+                at = found;
+        } else if (k >= ' ' && k < 0x7f && qlen + 1 < sizeof query) {
+            query[qlen++] = k;
+            query[qlen] = '\0';
+            found = hist_search(query, qlen, at < count() ? at + 1 : at);
+            fail = found == -1;
+            if (found != -1)
+                at = found;
+        } else {
+            if (k == 0x07 || k == 0x03)	/* ^G, ^C: back as it was	*/
+                lset(saved, strlen(saved));
+            free(saved);
+            redraw(prompt, NULL, NO);
+            return k == '\r' || k == '\n' ? '\r' : k == -1 ? -1 : 0;
+        }
+        if (!fail && at < count()) {
+            e = entry(at, &elen);
+            lset(e, elen);
+        }
+        redraw(prompt, query, fail);
+    }
+}
+
+char *hist_readline(char *prompt)
+/*
+ * purpose: read one line from the terminal, with editing and history
+ * returns: the line (valid until the next call), or NULL at EOF
+ *   notes: the terminal is put in raw mode only while the line is
+ *          being read, and back as it was before anything runs
+ */
+{
+    struct termios cooked, raw;
+    int k, at = count();
+    char *e, *draft = NULL;
+    size_t elen;
+
+    fflush(stdout);
+    if (tcgetattr(STDIN_FILENO, &cooked) == -1)
+        return NULL;
+    raw = cooked;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    lset("", 0);
+    redraw(prompt, NULL, NO);
+    for (;;) {
+        k = key();
+        if (k == 0x12)
+            k = search(prompt);
+        if (k == -1 || (k == 0x04 && llen == 0)) {
+            free(draft);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+            out("\r\n", 2);
+            return NULL;
+        }
+        switch (k) {
+        case '\r':
+        case '\n':
+            free(draft);
+            out("\r\n", 2);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+            return lbuf;
+        case 0x03:			/* ^C: abandon the line		*/
+            out("^C\r\n", 4);
+            lset("", 0);
+            break;
+        case 0x7f:
+        case 0x08:
+            if (lpos == 0)
+                break;
+            lpos--;
+            /* fall through */
+        case K_DEL:
+        case 0x04:
+            if (lpos < llen) {
+                memmove(lbuf + lpos, lbuf + lpos + 1, llen - lpos);
+                llen--;
+            }
+            break;
+        case K_LEFT:  case 0x02: if (lpos > 0) lpos--; break;
+        case K_RIGHT: case 0x06: if (lpos < llen) lpos++; break;
+        case K_HOME:  case 0x01: lpos = 0; break;
+        case K_END:   case 0x05: lpos = llen; break;
+        case 0x0b:			/* ^K: kill to the end		*/
+            llen = lpos;
+            lbuf[llen] = '\0';
+            break;
+        case 0x15:			/* ^U: kill to the start	*/
+            memmove(lbuf, lbuf + lpos, llen - lpos + 1);
+            llen -= lpos;
+            lpos = 0;
+            break;
+        case K_UP:
+        case K_DOWN:
+            if (at == count() && k == K_UP) {
+                free(draft);		/* keep what was being typed	*/
+                draft = strndup(lbuf, llen);
+            }
+            if (k == K_UP && at > 0)
+                at--;
+            else if (k == K_DOWN && at < count())
+                at++;
+            else
+                break;
+            if (at == count()) {
+                lset(draft ? draft : "", draft ? strlen(draft) : 0);
+            } else {
+                e = entry(at, &elen);
+                lset(e, elen);
+            }
+            break;
+        case 0:				/* leaving a search: edit it	*/
+        case K_OTHER:
+            break;
+        default:
+            if (k < ' ' || k > 0xff)
+                break;
+            if (llen + 2 > lcap) {
+                lcap = (llen + 2) * 2;
+                lbuf = erealloc(lbuf, lcap);
+            }
+            memmove(lbuf + lpos + 1, lbuf + lpos, llen - lpos + 1);
+            lbuf[lpos++] = k;
+            llen++;
+        }
+        redraw(prompt, NULL, NO);
+    }
+}
@@ -0,0 +1,672 @@
+/* jobs.c - background jobs and job control for smsh
+ *
+ *    void  job_init(int fd)             - take the terminal on fd
+ *    void  job_subshell(int bg)         - reset in a forked copy of smsh
+ *    int   job_add(pids, codes, n, cmd, stopped) - enter a job
+ *    int   job_wait(pids, codes, n)     - wait for one in the foreground
+ *    void  job_terminal()               - give the terminal back to smsh
+ *    void  job_notify()                 - report finished/stopped jobs
+ *    void  job_hangup()                 - hang up stopped jobs on exit
+ *    int   builtin_jobs(), builtin_fg(), builtin_bg(), builtin_wait()
+ *
+ *    A job is one pipeline (or a list run in a subshell) started with
+ *    & or stopped with ^Z.  With job control (an interactive shell on
+ *    a terminal) each job is its own process group and only the
+ *    foreground group owns the terminal, so ^C, ^\ and ^Z reach that
+ *    job and nothing else; smsh itself ignores them.  Without job
+ *    control, jobs stay in the shell's group and a background job
+ *    starts with SIGINT and SIGQUIT ignored, as POSIX asks.
+ *
+ *    Children are reaped by the SIGCHLD handler in reap.c; the table
+ *    here only polls them, so the prompt never waits on a job.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<signal.h>
+#include	<termios.h>
+#include	<unistd.h>
+#include	<sys/wait.h>
+#include	"smsh.h"
+
+#define	J_RUNNING	0
+#define	J_STOPPED	1
+#define	J_DONE		2
+
+#define	JOB_RECALL	128		/* statuses kept for wait pid	*/
+
+struct job {
+    int			id;
+    pid_t		pgid;		/* -1 without job control	*/
+    int			n;
+    pid_t		*pids;		/* each stage, -1 if not started */
+    pid_t		*left;		/* the same, -1 once reaped	*/
+    int			*codes;		/* exit status of each stage	*/
+    int			state;		/* J_*				*/
+    int			told;		/* state last reported		*/
+    char		*cmd;		/* for listings			*/
+    struct termios	tmodes;		/* terminal modes when stopped	*/
+    struct job		*next;		/* in id order			*/
+};
+
+int	job_control;			/* process groups and terminal	*/
+int	job_async;			/* inside a no-job-control & list */
+int	shell_tty = -1;
+pid_t	last_bg;			/* $!				*/
+
+static struct job	*jobs;
+static struct job	*tail;		/* the last job, for new ids	*/
+static struct {				/* jobs dropped unannounced	*/
+    pid_t		pid;
+    int			code;
+} recalled[JOB_RECALL];
+static int		nrecalled;	/* entries ever made		*/
+static pid_t		shell_pgid;
+static struct termios	shell_modes;
+
+void job_init(int fd)
+/*
+ * purpose: make smsh the foreground process group of terminal fd
+ *  action: waits to be foregrounded if started in the background,
+ *          then ignores the keyboard signals (each job gets its own)
+ */
+{
+    pid_t pgid;
+
+    while (tcgetpgrp(fd) != (pgid = getpgrp()))
+        kill(-pgid, SIGTTIN);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    shell_pgid = getpid();
+    if (pgid != shell_pgid && setpgid(0, shell_pgid) == -1) {
+        perror("setpgid");
+        return;
+    }
+    tcsetpgrp(fd, shell_pgid);
+    tcgetattr(fd, &shell_modes);
+    shell_tty = fd;
+    job_control = YES;
+}
+
+static void drop(struct job *j)
+{
+    struct job **pp, *prev = NULL;
+
+    for (pp = &jobs; *pp != NULL; prev = *pp, pp = &(*pp)->next)
+        if (*pp == j) {
+            *pp = j->next;
+            if (tail == j)
+                tail = prev;
+            break;
+        }
+    free(j->cmd);
+    free(j->pids);
+    free(j);
+}
+
+void job_subshell(int bg)
+/*
+ * purpose: called in a forked copy of smsh; it runs commands but
+ *          does no job control and owns none of the parent's jobs
+ */
+{
+    if (bg && !job_control)
+        job_async = YES;
+    job_control = NO;
+    shell_tty = -1;
+    while (jobs != NULL)
+        drop(jobs);
+    nrecalled = 0;			/* none of those are its children */
+    signal(SIGINT, job_async ? SIG_IGN : SIG_DFL);
+    signal(SIGQUIT, job_async ? SIG_IGN : SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+}
+
+void job_terminal()
+{
+    if (!job_control)
+        return;
+    tcsetpgrp(shell_tty, shell_pgid);
+    tcsetattr(shell_tty, TCSADRAIN, &shell_modes);
+}
+
+/* command text for listings */
+static char	*tbuf;
+static size_t	tlen, tcap;
+
+static void tput(const char *s)
+{
+    size_t n = strlen(s);
+
+    if (tlen + n + 1 > tcap) {
+        tcap = (tlen + n + 1) * 2;
+        tbuf = erealloc(tbuf, tcap);
+    }
+    memcpy(tbuf + tlen, s, n + 1);
+    tlen += n;
+}
+
+static void text_of(struct node *n)
+{
+    struct redir *r;
+    char num[12];
+    int i, k;
+
+    switch (n->type) {
+    case N_PIPE:
+        for (i = 0; i < n->pl->nstages; i++) {
+            if (i > 0)
+                tput(" | ");
+            if (n->pl->stages[i].body != NULL)
+                text_of(n->pl->stages[i].body);
+            for (k = 0; k < n->pl->stages[i].nassign; k++) {
+                tput(n->pl->stages[i].assigns[k].text);
+                tput(" ");
+            }
+            for (k = 0; k < n->pl->stages[i].argc; k++) {
+                if (k > 0)
+                    tput(" ");
+                tput(n->pl->stages[i].argv[k]);
+            }
+            for (r = n->pl->stages[i].redirs; r != NULL; r = r->next) {
+                tput(" ");
+                if (r->fd != (r->op == R_IN || r->op >= R_HEREDOC ? 0 : 1)) {
+                    snprintf(num, sizeof num, "%d", r->fd);
+                    tput(num);
+                }
+                tput(redir_op(r));
+                if (r->op != R_DUP)
+                    tput(" ");
+                tput(r->op == R_HEREDOC ? "..." : r->target.text);
+            }
+        }
+        for (i = 0; i < n->pl->nfan; i++) {
+            tput(i == 0 ? " |{ " : "; ");
+            text_of(n->pl->fan[i]);
+        }
+        if (n->pl->nfan > 0)
+            tput(" }");
+        break;
+    case N_AND:
+    case N_OR:
+    case N_SEQ:
+        text_of(n->left);
+        tput(n->type == N_AND ? " && " : n->type == N_OR ? " || " : "; ");
+        text_of(n->right);
+        break;
+    case N_BG:
+        text_of(n->left);
+        tput(" &");
+        break;
+    case N_IF:
+        tput("if ");
+        text_of(n->left);
+        tput("; then ");
+        text_of(n->right);
+        if (n->other != NULL) {
+            tput("; else ");
+            text_of(n->other);
+        }
+        tput("; fi");
+        break;
+    case N_WHILE:
+    case N_UNTIL:
+        tput(n->type == N_WHILE ? "while " : "until ");
+        text_of(n->left);
+        tput("; do ");
+        text_of(n->right);
+        tput("; done");
+        break;
+    case N_FOR:
+        tput("for ");
+        tput(n->name);
+        for (k = 0; n->pl != NULL && k < n->pl->stages[0].argc; k++) {
+            tput(k == 0 ? " in " : " ");
+            tput(n->pl->stages[0].argv[k]);
+        }
+        tput("; do ");
+        text_of(n->left);
+        tput("; done");
+        break;
+    case N_GROUP:
+    case N_SUBSHELL:
+        tput(n->type == N_GROUP ? "{ " : "(");
+        text_of(n->left);
+        tput(n->type == N_GROUP ? "; }" : ")");
+        break;
+    case N_FUNC:
+        tput(n->name);
+        tput("() ");
+        text_of(n->left);
+        break;
+    }
+}
+
+static char mark(struct job *j)
+{
+    if (j->next == NULL)
+        return '+';
+    return j->next->next == NULL ? '-' : ' ';
+}
+
+static void show(FILE *fp, struct job *j, int pids)
+{
+    char state[32];
+    int i, code = j->codes[j->n - 1];
+
+    if (j->state == J_RUNNING)
+        strcpy(state, "Running");
+    else if (j->state == J_STOPPED)
+        strcpy(state, "Stopped");
+    else if (code == 0)
+        strcpy(state, "Done");
+    else
+        sprintf(state, "Exit %d", code);
+    fprintf(fp, "[%d]%c  ", j->id, mark(j));
+    if (pids)
+        for (i = 0; i < j->n; i++)
+            if (j->pids[i] != -1)
+                fprintf(fp, "%d ", (int)j->pids[i]);
+    fprintf(fp, "%-24s%s%s\n", state, j->cmd,
+            j->state == J_RUNNING ? " &" : "");
+}
+
+static void forget_done();
+
+int job_add(pid_t *pids, int *codes, int n, struct node *cmd, int stopped)
+/*
+ * purpose: enter a started pipeline or list in the job table
+ * returns: the new job number
+ *  action: announces it ("[1] pid" for &, or the Stopped line)
+ */
+{
+    struct job *j;
+    int i, id;
+
+    if (!job_control)
+        forget_done();
+    j = emalloc(sizeof(struct job));
+    id = tail != NULL ? tail->id + 1 : 1;
+    j->id = id;
+    j->n = n;
+    j->pids = emalloc(n * (2 * sizeof(pid_t) + sizeof(int)));
+    j->left = j->pids + n;
+    j->codes = (int *)(j->left + n);
+    memcpy(j->pids, pids, n * sizeof(pid_t));
+    memcpy(j->left, pids, n * sizeof(pid_t));
+    memcpy(j->codes, codes, n * sizeof(int));
+    j->pgid = -1;
+    for (i = 0; job_control && i < n; i++)
+        if (pids[i] != -1) {		/* the first one started leads	*/
+            j->pgid = pids[i];
+            break;
+        }
+    j->state = j->told = stopped ? J_STOPPED : J_RUNNING;
+    tlen = 0;
+    tput("");
+    text_of(cmd);
+    j->cmd = strcpy(emalloc(tlen + 1), tbuf);
+    j->next = NULL;
+    if (tail != NULL)
+        tail->next = j;
+    else
+        jobs = j;
+    tail = j;
+
+    if (stopped) {
+        if (job_control)
+            tcgetattr(shell_tty, &j->tmodes);
+        fputc('\n', stderr);
+        show(stderr, j, NO);
+        return id;
+    }
+    for (i = n - 1; i >= 0; i--)
+        if (pids[i] != -1) {
+            last_bg = pids[i];
+            break;
+        }
+    if (job_control)
+        fprintf(stderr, "[%d] %d\n", id, (int)last_bg);
+    return id;
+}
+
+int job_wait(pid_t *pids, int *codes, int n)
+/*
+ * purpose: wait in the foreground for the processes of one job
+ * returns: YES if the job stopped rather than finished
+ *  action: codes[i] gets stage i's status; reaped pids become -1
+ */
+{
+    int i, status, stopped = NO;
+
+    for (i = 0; i < n; i++) {
+        if (pids[i] == -1)
+            continue;
+        status = child_wait(pids[i]);
+        codes[i] = exit_code(status);
+        if (status != -1 && WIFSTOPPED(status))
+            stopped = YES;
+        else
+            pids[i] = -1;
+    }
+    return stopped;
+}
+
+static void update(struct job *j)
+{
+    int i, status, running = NO, stopped = NO;
+
+    for (i = 0; i < j->n; i++) {
+        if (j->left[i] == -1)
+            continue;
+        switch (child_poll(j->left[i], &status)) {
+        case -1:
+            j->left[i] = -1;
+            break;
+        case 0:
+            running = YES;
+            break;
+        default:
+            j->codes[i] = exit_code(status);
+            if (WIFSTOPPED(status))
+                stopped = YES;
+            else
+                j->left[i] = -1;
+        }
+    }
+    j->state = running ? J_RUNNING : stopped ? J_STOPPED : J_DONE;
+}
+
+static void forget_done()
+/*
+ * purpose: without job control no Done line is ever shown, so drop
+ *          finished jobs as soon as a new one starts, keeping what
+ *          each of their processes returned for wait pid
+ *   notes: so a script starting thousands of jobs holds only those
+ *          still running, here and in the child table
+ */
+{
+    struct job *j, *next;
+    int i;
+
+    for (j = jobs; j != NULL; j = next) {
+        next = j->next;
+        update(j);
+        if (j->state != J_DONE)
+            continue;
+        for (i = 0; i < j->n; i++)
+            if (j->pids[i] != -1) {
+                recalled[nrecalled % JOB_RECALL].pid = j->pids[i];
+                recalled[nrecalled++ % JOB_RECALL].code = j->codes[i];
+            }
+        drop(j);
+    }
+}
+
+static int recall(char *spec)
+/*
+ * purpose: the status of a process named by pid whose job was
+ *          dropped by forget_done(); it is forgotten once asked for
+ * returns: it, or -1 if spec is no such pid or a job still has it
+ */
+{
+    struct job *j;
+    pid_t pid;
+    int i, k;
+
+    if (!isdigit((unsigned char)spec[0]))
+        return -1;
+    pid = atoi(spec);
+    for (j = jobs; j != NULL; j = j->next)
+        for (i = 0; i < j->n; i++)
+            if (j->pids[i] == pid)
+                return -1;
+    for (k = nrecalled - 1; k >= 0 && k >= nrecalled - JOB_RECALL; k--) {
+        i = k % JOB_RECALL;
+        if (recalled[i].pid == pid) {
+            recalled[i].pid = 0;
+            return recalled[i].code;
+        }
+    }
+    return -1;
+}
+
+void job_notify()
+/*
+ * purpose: before a prompt, report jobs that finished or stopped
+ *          since the last one, and forget the finished ones
+ */
+{
+    struct job *j, *next;
+
+    for (j = jobs; j != NULL; j = next) {
+        next = j->next;
+        update(j);
+        if (j->state != j->told) {
+            show(stderr, j, NO);
+            j->told = j->state;
+        }
+        if (j->state == J_DONE)
+            drop(j);
+    }
+}
+
+void job_hangup()
+/*
+ * purpose: on exit, stopped jobs would wait forever: hang them up
+ */
+{
+    struct job *j;
+
+    for (j = jobs; j != NULL; j = j->next)
+        if (j->state == J_STOPPED && j->pgid != -1) {
+            kill(-j->pgid, SIGHUP);
+            kill(-j->pgid, SIGCONT);
+        }
+}
+
+static struct job *find(char *spec, char *who)
+/*
+ * purpose: resolve %n, %%, %+, %-, %prefix or a pid to a job
+ * returns: the job, or NULL after reporting that there is none
+ */
+{
+    struct job *j, *cur = NULL, *prev = NULL;
+    pid_t pid;
+    int i;
+
+    for (j = jobs; j != NULL; j = j->next) {
+        prev = cur;
+        cur = j;
+    }
+    if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0
+        || strcmp(spec, "%+") == 0)
+        j = cur;
+    else if (strcmp(spec, "%-") == 0)
+        j = prev;
+    else if (spec[0] == '%' && isdigit((unsigned char)spec[1])) {
+        for (j = jobs; j != NULL && j->id != atoi(spec + 1); j = j->next)
+            ;
+    } else if (spec[0] == '%') {
+        for (j = jobs; j != NULL; j = j->next)
+            if (strncmp(j->cmd, spec + 1, strlen(spec + 1)) == 0)
+                break;
+    } else if (isdigit((unsigned char)spec[0])) {
+        pid = atoi(spec);
+        for (j = jobs; j != NULL; j = j->next) {
+            for (i = 0; i < j->n && j->pids[i] != pid; i++)
+                ;
+            if (i < j->n)
+                break;
+        }
+        if (j == NULL) {
+            fprintf(stderr, "%s: pid %s is not a child of this shell\n",
+                    who, spec);
+            return NULL;
+        }
+    } else {
+        fprintf(stderr, "%s: %s: no such job\n", who, spec);
+        return NULL;
+    }
+    if (j == NULL)
+        fprintf(stderr, "%s: %s: no such job\n", who,
+                spec ? spec : "current");
+    return j;
+}
+
+static int resume(struct job *j, int fg)
+/*
+ * purpose: continue a job, in the foreground or the background
+ * returns: the job's status once it finishes or stops (fg), else 0
+ */
+{
+    int i, stopped;
+
+    if (fg) {
+        tcsetpgrp(shell_tty, j->pgid);
+        if (j->state == J_STOPPED)
+            tcsetattr(shell_tty, TCSADRAIN, &j->tmodes);
+    }
+    if (j->state == J_STOPPED) {
+        for (i = 0; i < j->n; i++)	/* before the kill: it may stop again */
+            if (j->left[i] != -1)
+                child_cont(j->left[i]);
+        kill(-j->pgid, SIGCONT);
+    }
+    j->state = j->told = J_RUNNING;
+    if (!fg) {
+        fprintf(stderr, "[%d]%c %s &\n", j->id, mark(j), j->cmd);
+        return 0;
+    }
+    stopped = job_wait(j->left, j->codes, j->n);
+    if (stopped) {
+        tcgetattr(shell_tty, &j->tmodes);
+        j->state = j->told = J_STOPPED;
+        fputc('\n', stderr);
+        show(stderr, j, NO);
+    }
+    job_terminal();
+    set_pipestatus(j->codes, j->n);
+    if (!stopped)
+        drop(j);
+    return last_status;
+}
+
+int builtin_jobs(char **argv)
+/*
+ * purpose: jobs [-l | -p]: list the job table
+ */
+{
+    struct job *j, *next;
+    int pids = NO, only = NO, i;
+
+    for (i = 1; argv[i] != NULL; i++) {
+        if (strcmp(argv[i], "-l") == 0)
+            pids = YES;
+        else if (strcmp(argv[i], "-p") == 0)
+            only = YES;
+        else {
+            fprintf(stderr, "usage: jobs [-l | -p]\n");
+            return 2;
+        }
+    }
+    for (j = jobs; j != NULL; j = next) {
+        next = j->next;
+        update(j);
+        if (only)
+            printf("%d\n", (int)(j->pgid != -1 ? j->pgid : j->pids[0]));
+        else
+            show(stdout, j, pids);
+        j->told = j->state;
+        if (j->state == J_DONE)
+            drop(j);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int builtin_fg(char **argv)
+{
+    struct job *j;
+
+    if (!job_control) {
+        fprintf(stderr, "fg: no job control\n");
+        return 1;
+    }
+    if ((j = find(argv[1], "fg")) == NULL)
+        return 1;
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    return resume(j, YES);
+}
+
+int builtin_bg(char **argv)
+{
+    struct job *j;
+    int i, rv = 0;
+
+    if (!job_control) {
+        fprintf(stderr, "bg: no job control\n");
+        return 1;
+    }
+    for (i = 1; i == 1 || argv[i] != NULL; i++) {	/* none: current job */
+        if ((j = find(argv[i], "bg")) == NULL)
+            rv = 1;
+        else if (j->state == J_RUNNING)
+            fprintf(stderr, "bg: job %d already in background\n", j->id);
+        else
+            resume(j, NO);
+        if (argv[i] == NULL)
+            break;
+    }
+    return rv;
+}
+
+int builtin_wait(char **argv)
+/*
+ * purpose: wait [%job | pid ...]: wait for the named jobs, or for
+ *          every running job
+ * returns: the last named job's status, 127 if it was not a job
+ */
+{
+    struct job *j, *next;
+    int i, rv = 0, code;
+
+    if (argv[1] == NULL) {
+        for (j = jobs; j != NULL; j = next) {
+            next = j->next;
+            update(j);
+            if (j->state == J_STOPPED)
+                continue;
+            job_wait(j->left, j->codes, j->n);
+            drop(j);
+        }
+        return 0;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if ((code = recall(argv[i])) != -1) {
+            rv = code;
+            continue;
+        }
+        if ((j = find(argv[i], "wait")) == NULL) {
+            rv = 127;
+            continue;
+        }
+        if (job_wait(j->left, j->codes, j->n)) {
+            j->state = J_STOPPED;
+            rv = j->codes[j->n - 1];
+            continue;
+        }
+        rv = j->codes[j->n - 1];
+        drop(j);
+    }
+    return rv;
+}
@@ -0,0 +1,194 @@
+/* parallel.c - the "parallel" builtin: run command lines N at a time
+ *
+ *    parallel [-j N] [file]
+ *
+ *    Reads one command line per line from file, or from the builtin's
+ *    stdin, and keeps up to N of them running through
+ *    launch_pipeline().  Children are reaped through the child table
+ *    (child_reap) so a slot is refilled as soon as any job finishes.
+ *    Each job's stdout and stderr go to their own memfd and are copied
+ *    out in one piece when the job is done, so output from different
+ *    jobs never interleaves.  N defaults to the number of online CPUs.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/sendfile.h>
+#include	<sys/wait.h>
+#include	"smsh.h"
+
+struct job {
+    pid_t		*pids;		/* one per stage, -1 if not started */
+    int			npids;
+    int			left;		/* started but not yet reaped	*/
+    int			failed;
+    int			out, err;	/* memfds holding its output	*/
+    struct arena	arena;
+};
+
+static void copy_out(int from, int to)
+/*
+ * purpose: write everything a job left in a memfd to fd to
+ */
+{
+    off_t off = 0, size = lseek(from, 0, SEEK_END);
+    ssize_t n;
+    char buf[8192];
+
+    while (off < size) {
+        n = sendfile(to, from, &off, size - off);
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        break;				/* sendfile refused: copy by hand */
+    }
+    lseek(from, off, SEEK_SET);
+    while ((n = read(from, buf, sizeof buf)) > 0)
+        if (write(to, buf, n) != n)
+            break;
+}
+
+static void finish(struct job *j)
+{
+    copy_out(j->out, STDOUT_FILENO);
+    copy_out(j->err, STDERR_FILENO);
+    close(j->out);
+    close(j->err);
+    j->left = 0;
+}
+
+static int start(struct job *j, char *line, int *rvp)
+/*
+ * purpose: parse line and launch it into slot j
+ * returns: YES if at least one process is now running
+ *  errors: a job that could not start at all sets *rvp
+ */
+{
+    struct node *n;
+
+    arena_reset(&j->arena);
+    prof_mark();
+    if ((n = parse_line(&j->arena, line)) == NULL)
+        return NO;
+    j->out = memfd_create("parallel-out", MFD_CLOEXEC);
+    j->err = memfd_create("parallel-err", MFD_CLOEXEC);
+    if (j->out == -1 || j->err == -1) {
+        perror("memfd_create");
+        exit(1);
+    }
+    if (n->type == N_PIPE && n->pl->nfan == 0) {
+        j->npids = n->pl->nstages;
+        j->pids = arena_alloc(&j->arena, j->npids * sizeof(pid_t));
+        j->left = launch_pipeline(&j->arena, n->pl, -1, j->out, j->err, j->pids,
+                                  NULL, TAG_PARALLEL, LP_NONE);
+    } else {		/* a list or fan-out: run it in a subshell */
+        j->npids = 1;
+        j->pids = arena_alloc(&j->arena, sizeof(pid_t));
+        j->pids[0] = fork_subshell(&j->arena, n, -1, j->out, j->err, TAG_PARALLEL,
+                                   LP_NONE);
+        j->left = j->pids[0] != -1;
+    }
+    j->failed = j->left < j->npids;
+    if (j->left == 0) {
+        *rvp = 1;
+        finish(j);
+    }
+    return j->left > 0;
+}
+
+static struct job *owner(struct job *jobs, int njobs, pid_t pid)
+{
+    int i, k;
+
+    for (i = 0; i < njobs; i++)
+        for (k = 0; jobs[i].left > 0 && k < jobs[i].npids; k++)
+            if (jobs[i].pids[k] == pid)
+                return &jobs[i];
+    return NULL;
+}
+
+int builtin_parallel(char **argv, int in_fd)
+/*
+ * purpose: run the command lines read from in_fd (or a named file)
+ *          with at most N in flight
+ * returns: 0 if every job succeeded, 1 otherwise
+ */
+{
+    struct reader *rd;
+    struct job *jobs, *j;
+    char *line = "";
+    int njobs = sysconf(_SC_NPROCESSORS_ONLN), running = 0, rv = 0;
+    int i, status, fd = -1;
+    pid_t pid;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-j") == 0 && argv[i + 1] != NULL)
+            njobs = atoi(argv[++i]);
+        else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0')
+            njobs = atoi(argv[i] + 2);
+        else {
+            fprintf(stderr, "usage: parallel [-j N] [file]\n");
+            return 2;
+        }
+    }
+    if (argv[i] != NULL) {
+        if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) == -1) {
+            perror(argv[i]);
+            return 1;
+        }
+        in_fd = fd;
+    }
+    if (njobs < 1)
+        njobs = 1;
+
+    jobs = emalloc(njobs * sizeof(struct job));
+    for (i = 0; i < njobs; i++) {
+        jobs[i].left = 0;
+        arena_init(&jobs[i].arena);
+    }
+    fflush(stdout);			/* nothing of ours inside a group */
+    rd = rd_open(in_fd);
+
+    for (;;) {
+        /* fill every free slot */
+        for (i = 0; i < njobs && line != NULL; i++) {
+            if (jobs[i].left > 0)
+                continue;
+            while ((line = rd_line(rd, NULL)) != NULL && !start(&jobs[i], line, &rv))
+                ;
+            if (line != NULL)
+                running++;
+        }
+        if (running == 0)
+            break;
+
+        /* reap one child; a job is done when all its stages are */
+        if ((pid = child_reap(TAG_PARALLEL, &status)) == -1)
+            break;
+        if ((j = owner(jobs, njobs, pid)) == NULL)
+            continue;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            j->failed = YES;
+        if (--j->left == 0) {
+            if (j->failed)
+                rv = 1;
+            finish(j);
+            running--;
+        }
+    }
+
+    rd_close(rd);
+    for (i = 0; i < njobs; i++)
+        arena_free(&jobs[i].arena);
+    free(jobs);
+    if (fd != -1)
+        close(fd);
+    return rv;
+}
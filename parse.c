@@ -0,0 +1,1291 @@
+/* parse.c - single-pass lexer and parser for smsh command lines
+ *
+ *    struct node *parse_line(struct arena *a, char *line)
+ *    struct node *parse_lines(a, char *line, struct reader *rd, char *prompt)
+ *    int   parse_heredocs(struct arena *a, struct reader *rd, char *prompt)
+ *    struct word parse_word(struct arena *a, char *s, size_t len)
+ *    int   parse_quiet, parse_errors        - count syntax errors silently
+ *
+ *    The lexer walks the line once.  Quotes and backslashes are removed
+ *    as words are scanned, operators are matched longest-first from a
+ *    table, and the parser builds the command tree (lists joined by ;
+ *    & && and ||, pipelines, stages, argv, redirections) directly in the
+ *    caller's arena, so the whole tree is released by one arena_reset().
+ *
+ *    Quoting: '...' is literal; "..." is literal except that \ escapes
+ *    \ " $ and `; outside quotes \ escapes any character.  A word that
+ *    starts with # begins a comment.  Wildcards that were quoted do
+ *    not glob: such a word also gets a pattern with them escaped.
+ *    $name, ${name} and $? style parameters, bare or in double quotes,
+ *    are marked up in a third form of the word, expanded when the
+ *    command runs (expand.c).  So are $(command) and `command`, whose
+ *    text is kept as it is, to be parsed and run when the word is
+ *    expanded (command_subst() in smsh4.c); and so are <(command) and
+ *    >(command), unquoted, which become a /dev/fd path to a pipe from
+ *    or to the command (proc_subst()).  Words of the form NAME=value
+ *    before the command name are assignments, kept apart from its argv.
+ *
+ *    Redirections: [n]< [n]> [n]>| [n]>> [n]<& [n]>& &> &>> << <<- and
+ *    <<<, each into a struct redir on the stage (carried out by
+ *    redir.c).  A heredoc's body is on the lines after the command;
+ *    the caller reads it with parse_heredocs() before running the line.
+ *
+ *    Compound commands: if/then/elif/else/fi, while and until/do/done,
+ *    for name [in word...]/do/done, { list; }, ( list ) and function
+ *    definitions, name() compound or function name compound.  Their
+ *    reserved words count only unquoted and where a command name could
+ *    be.  A compound command is the body of a stage, so it can be piped
+ *    and redirected like any command.  Inside one, and after | && or
+ *    ||, a newline separates commands rather than ending the input:
+ *    given a reader, parse_lines() goes on to the lines after it (and
+ *    reads any heredoc bodies on the way) until the command is whole.
+ *
+ *    Fan-out: a pipeline may end in |{ list ; list ... }, the and-or
+ *    lists each to read all of what the stages before write.  They go
+ *    in the pipeline's fan[], and the shell copies the stream to them
+ *    (zcopy_tee()).  Inside one a bare } ends the command before it,
+ *    so the last list needs no ;.
+ *
+ *    Braces: a word with an unquoted {a,b,...} or {x..y} becomes one
+ *    word per alternative, before anything else is done to it, so a
+ *    pattern in braces globs once per alternative.  The expansion is
+ *    done on the word's source text and each result is scanned again
+ *    as a word of its own, which keeps its quoting intact.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	"smsh.h"
+
+enum {
+    T_EOF, T_WORD, T_PIPE, T_OROR, T_AMP, T_ANDAND, T_SEMI,
+    T_LT, T_GT, T_APPEND, T_LPAREN, T_RPAREN, T_ERROR,
+    T_CLOBBER, T_DUPIN, T_DUPOUT, T_HEREDOC, T_HEREDASH, T_HERESTR,
+    T_ANDGT, T_ANDAPPEND, T_NEWLINE, T_FANOUT
+};
+
+static struct op {
+    char	*str;
+    int		tok;
+} ops[] = {				/* longest operators first	*/
+    { "<<<", T_HERESTR }, { "<<-", T_HEREDASH }, { "&>>", T_ANDAPPEND },
+    { "||", T_OROR },  { "&&", T_ANDAND }, { ">>", T_APPEND },
+    { ">|", T_CLOBBER }, { ">&", T_DUPOUT }, { "<&", T_DUPIN },
+    { "<<", T_HEREDOC }, { "&>", T_ANDGT }, { "|{", T_FANOUT },
+    { "|",  T_PIPE },  { "&",  T_AMP },    { ";",  T_SEMI },
+    { "<",  T_LT },    { ">",  T_GT },
+    { "(",  T_LPAREN }, { ")", T_RPAREN },
+    { NULL, 0 }
+};
+
+struct lexer {
+    struct arena	*arena;
+    char		*p;		/* next unread character	*/
+    int			tok;		/* current token		*/
+    char		*tokstr;	/* its text, for messages	*/
+    struct word		word;		/* value when tok == T_WORD	*/
+    char		*raw;		/* its source text		*/
+    size_t		rawlen;
+    int			brace;		/* it has an unquoted '{'	*/
+    char		*unclosed;	/* T_ERROR at this ${ or $(	*/
+    int			iofd;		/* n of n> before an operator, or -1 */
+    int			span;		/* blanks and operators are text */
+    struct reader	*rd;		/* more lines, or NULL		*/
+    char		*prompt;	/* for them, on a terminal	*/
+    int			depth;		/* compound commands open	*/
+    int			eol;		/* T_NEWLINE given: read a line	*/
+    int			fan;		/* |{ open: a bare } ends a command */
+};
+
+static struct heredoc {			/* << seen, body not yet read	*/
+    struct redir	*r;
+    char		*delim;
+    int			strip;		/* <<-: leading tabs removed	*/
+    int			quoted;		/* delimiter quoted: no $	*/
+} *pending;
+static int	npending, maxpending;
+
+#define	is_space(c)	((c) == ' ' || (c) == '\t')
+#define	is_meta(c)	((c) != '\0' && strchr("|&;<>()", (c)) != NULL)
+#define	is_glob(c)	((c) == '*' || (c) == '?' || (c) == '[')
+#define	is_procsub(p)	((*(p) == '<' || *(p) == '>') && (p)[1] == '(')
+
+static char	*textbuf, *patbuf, *expbuf;	/* scratch for one word	*/
+static size_t	scratch;
+
+#define	is_name(c)	(isalnum((unsigned char)(c)) || (c) == '_')
+
+static struct node *parse_list(struct lexer *);
+static struct node *parse_compound(struct lexer *);
+
+static void need_scratch(size_t len)
+/*
+ * purpose: make the scratch buffers big enough for a word of len
+ */
+{
+    if (len + 1 <= scratch)
+        return;
+    scratch = len + 1;
+    free(textbuf);
+    free(patbuf);
+    free(expbuf);
+    textbuf = emalloc(scratch);
+    patbuf = emalloc(2 * scratch);
+    expbuf = emalloc(2 * scratch);
+}
+
+static char *group_end(char *s)
+/*
+ * purpose: find the } or ) that closes the ${ or $( whose { or ( s
+ *          points at, past any quotes and nested pairs inside
+ * returns: a pointer to it, or NULL if there is none
+ */
+{
+    char open = *s, close = open == '{' ? '}' : ')';
+    int depth = 0;
+
+    for (; *s != '\0'; s++) {
+        if (*s == '\\' && s[1] != '\0')
+            s++;
+        else if (*s == '\'') {
+            if ((s = strchr(s + 1, '\'')) == NULL)
+                return NULL;
+        } else if (*s == '"') {
+            for (s++; *s != '"'; s++) {
+                if (*s == '\0')
+                    return NULL;
+                if (*s == '\\' && s[1] != '\0')
+                    s++;
+            }
+        } else if (*s == open)
+            depth++;
+        else if (*s == close && --depth == 0)
+            return s;
+    }
+    return NULL;
+}
+
+static char *lex_param(char *p, char **tp, char **ep, int quoted)
+/*
+ * purpose: scan a $ expansion; p points at the '$'
+ * returns: pointer just past it, or NULL if this '$' is an ordinary
+ *          character
+ *  action: appends the raw text to *tp and the marked-up form
+ *          CTLVAR name CTLEND (CTLQVAR inside double quotes) to *ep;
+ *          $(command) is CTLCMD command CTLEND (or CTLQCMD)
+ */
+{
+    char *s = p + 1, *name, *after;
+    char mark = quoted ? CTLQVAR : CTLVAR;
+    size_t n;
+
+    if (*s == '(') {
+        if ((after = group_end(s)) == NULL)
+            return NULL;
+        name = s + 1;
+        n = after++ - name;
+        mark = quoted ? CTLQCMD : CTLCMD;
+    } else if (*s == '{') {
+        if ((after = group_end(s)) == NULL)
+            return NULL;
+        name = s + 1;
+        n = after++ - name;
+    } else if (*s == '?' || *s == '$' || *s == '#' || *s == '!'
+               || *s == '@' || *s == '*' || isdigit((unsigned char)*s)) {
+        name = s;
+        n = 1;
+        after = s + 1;
+    } else if (is_name(*s) && !isdigit((unsigned char)*s)) {
+        for (name = after = s; is_name(*after); after++)
+            ;
+        n = after - name;
+    } else {
+        return NULL;
+    }
+    memcpy(*tp, p, after - p);
+    *tp += after - p;
+    *(*ep)++ = mark;
+    memcpy(*ep, name, n);
+    *ep += n;
+    *(*ep)++ = CTLEND;
+    return after;
+}
+
+static char *lex_backquote(char *p, char **tp, char **ep, int quoted)
+/*
+ * purpose: scan a `command` substitution; p points at the first `
+ * returns: pointer just past the closing `, or NULL if there is none
+ *  action: as lex_param(), marking up the command's text, in which a
+ *          \ before $ ` or \ (and " inside double quotes) is dropped
+ */
+{
+    char *s, *e = *ep;
+
+    for (s = p + 1; *s != '`'; s++) {
+        if (*s == '\0')
+            return NULL;
+        if (*s == '\\' && s[1] != '\0')
+            s++;
+    }
+    memcpy(*tp, p, s + 1 - p);
+    *tp += s + 1 - p;
+    *e++ = quoted ? CTLQCMD : CTLCMD;
+    for (p++; p < s; p++) {
+        if (*p == '\\' && (strchr("$`\\", p[1]) || (quoted && p[1] == '"')))
+            p++;
+        *e++ = *p;
+    }
+    *e++ = CTLEND;
+    *ep = e;
+    return s + 1;
+}
+
+static char *lex_procsub(char *p, char **tp, char **ep)
+/*
+ * purpose: scan a <(command) or >(command); p points at the < or >
+ * returns: pointer just past it, or NULL if the ( is never closed
+ *  action: as lex_param(), marking it up CTLPROC < command CTLEND
+ *          (or >), to become a /dev/fd path that is never split
+ */
+{
+    char *after = group_end(p + 1);
+
+    if (after == NULL)
+        return NULL;
+    after++;
+    memcpy(*tp, p, after - p);
+    *tp += after - p;
+    *(*ep)++ = CTLPROC;
+    *(*ep)++ = *p;
+    memcpy(*ep, p + 2, after - p - 3);
+    *ep += after - p - 3;
+    *(*ep)++ = CTLEND;
+    return after;
+}
+
+static int lex_word(struct lexer *lx)
+/*
+ * purpose: scan one word starting at lx->p
+ * returns: T_WORD, or T_ERROR for an unterminated quote, ${ or $(
+ *          (lx->unclosed is then the $)
+ *  action: writes the unquoted text and, alongside it, the same text
+ *          with quoted wildcards backslash-escaped and the text with
+ *          $ expansions marked up; only the forms that are needed are
+ *          copied into the arena
+ */
+{
+    char *p = lx->p, *t = textbuf, *g = patbuf, *e = expbuf, *q, c;
+    int unquoted_glob = NO, quoted_special = NO, has_param = NO, quoted;
+
+    lx->raw = p;
+    lx->brace = NO;
+    lx->unclosed = NULL;
+    while ((c = *p) != '\0' && (lx->span || (!is_space(c) && !is_meta(c)) || is_procsub(p))) {
+        quoted = YES;
+        if (is_procsub(p) && (q = lex_procsub(p, &t, &e)) != NULL) {
+            has_param = YES;
+            p = q;
+            continue;
+        }
+        if (c == '\'') {
+            for (p++; *p != '\''; p++) {
+                if (*p == '\0')
+                    return T_ERROR;
+                if (is_glob(*p) || *p == '\\') {
+                    quoted_special = YES;
+                    *g++ = '\\';
+                }
+                *t++ = *g++ = *e++ = *p;
+            }
+            p++;
+            continue;
+        }
+        if (c == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0')
+                    return T_ERROR;
+                if (*p == '$' && (q = lex_param(p, &t, &e, YES)) != NULL) {
+                    has_param = YES;
+                    p = q - 1;
+                    continue;
+                }
+                if (*p == '$' && (p[1] == '{' || p[1] == '(')) {
+                    lx->unclosed = p;
+                    return T_ERROR;
+                }
+                if (*p == '`') {
+                    if ((q = lex_backquote(p, &t, &e, YES)) == NULL)
+                        return T_ERROR;
+                    has_param = YES;
+                    p = q - 1;
+                    continue;
+                }
+                if (*p == '\\' && p[1] != '\0' && strchr("\\\"$`", p[1]))
+                    p++;
+                if (is_glob(*p) || *p == '\\') {
+                    quoted_special = YES;
+                    *g++ = '\\';
+                }
+                *t++ = *g++ = *e++ = *p;
+            }
+            p++;
+            continue;
+        }
+        if (c == '$' && (q = lex_param(p, &t, &e, NO)) != NULL) {
+            has_param = YES;
+            p = q;
+            continue;
+        }
+        if (c == '$' && (p[1] == '{' || p[1] == '(')) {
+            lx->unclosed = p;		/* no } or ) closes it		*/
+            return T_ERROR;
+        }
+        if (c == '`') {
+            if ((q = lex_backquote(p, &t, &e, NO)) == NULL)
+                return T_ERROR;
+            has_param = YES;
+            p = q;
+            continue;
+        }
+        if (c == '\\') {
+            if (*++p == '\0')		/* trailing backslash: drop it	*/
+                break;
+            c = *p;
+        } else {
+            quoted = NO;
+            if (is_glob(c))
+                unquoted_glob = YES;
+            else if (c == '{')
+                lx->brace = YES;
+        }
+        if (quoted && (is_glob(c) || c == '\\')) {
+            quoted_special = YES;
+            *g++ = '\\';
+        }
+        *t++ = *g++ = *e++ = c;
+        p++;
+    }
+
+    lx->word.text = arena_strndup(lx->arena, textbuf, t - textbuf);
+    if (!unquoted_glob)
+        lx->word.pat = NULL;
+    else if (!quoted_special)
+        lx->word.pat = lx->word.text;	/* pattern is the text itself	*/
+    else
+        lx->word.pat = arena_strndup(lx->arena, patbuf, g - patbuf);
+    lx->word.exp = has_param ? arena_strndup(lx->arena, expbuf, e - expbuf) : NULL;
+    lx->rawlen = p - lx->raw;
+    lx->p = p;
+    return T_WORD;
+}
+
+static int next_line(struct lexer *lx)
+/*
+ * purpose: move on to the line after the current one, past the bodies
+ *          of any heredocs the current one started
+ * returns: 0, or -1 at the end of the input
+ */
+{
+    char *line;
+
+    lx->eol = NO;
+    parse_heredocs(lx->arena, lx->rd, lx->prompt);
+    if ((line = rd_line(lx->rd, lx->prompt)) == NULL)
+        return -1;
+    need_scratch(strlen(line));
+    lx->p = line;
+    return 0;
+}
+
+static int next(struct lexer *lx)
+/*
+ * purpose: advance to the next token
+ * returns: the token, also left in lx->tok
+ *   notes: the end of a line is T_NEWLINE inside a compound command
+ *          when there are more lines to read, else T_EOF
+ */
+{
+    struct op *o;
+    char *q;
+
+    if (lx->eol && next_line(lx) == -1)
+        return lx->tok = T_EOF;
+    while (is_space(*lx->p))
+        lx->p++;
+    lx->tokstr = lx->p;
+    if (*lx->p == '\0' || *lx->p == '#') {
+        if (lx->depth > 0 && lx->rd != NULL) {
+            lx->eol = YES;
+            return lx->tok = T_NEWLINE;
+        }
+        return lx->tok = T_EOF;
+    }
+    lx->iofd = -1;
+    for (q = lx->p; isdigit((unsigned char)*q); q++)
+        ;
+    if (q > lx->p && q - lx->p < 5 && (*q == '<' || *q == '>') && !is_procsub(q)) {
+        lx->iofd = atoi(lx->p);		/* 2> and the like		*/
+        lx->p = q;
+    }
+    if (is_procsub(lx->p))		/* <(cmd) is a word, not a <	*/
+        return lx->tok = lex_word(lx);
+    for (o = ops; o->str != NULL; o++) {
+        if (strncmp(lx->p, o->str, strlen(o->str)) == 0) {
+            lx->p += strlen(o->str);
+            return lx->tok = o->tok;
+        }
+    }
+    return lx->tok = lex_word(lx);
+}
+
+int parse_quiet;			/* count errors, report nothing	*/
+int parse_errors;
+
+static int syntax_error(struct lexer *lx)
+/*
+ * purpose: report the token the parser could not accept
+ * returns: -1; $? becomes 2, as in other shells
+ */
+{
+    struct op *o;
+
+    parse_errors++;
+    if (parse_quiet)
+        return -1;
+    last_status = 2;
+
+    if (lx->tok == T_ERROR && lx->unclosed != NULL)
+        fprintf(stderr, "smsh: syntax error: unterminated %.2s\n", lx->unclosed);
+    else if (lx->tok == T_ERROR)
+        fprintf(stderr, "smsh: syntax error: unterminated quote\n");
+    else if (lx->tok == T_EOF)
+        fprintf(stderr, "smsh: syntax error: unexpected end of line\n");
+    else if (lx->tok == T_NEWLINE)
+        fprintf(stderr, "smsh: syntax error near unexpected newline\n");
+    else {
+        for (o = ops; o->str != NULL && o->tok != lx->tok; o++)
+            ;
+        fprintf(stderr, "smsh: syntax error near unexpected token '%s'\n",
+                o->str ? o->str : lx->tokstr);
+    }
+    return -1;
+}
+
+static void *grow(struct arena *a, void *v, int n, int *cap, size_t size)
+/*
+ * purpose: make room for element n of an arena-backed vector
+ * returns: the vector, moved to a larger arena block if it was full
+ */
+{
+    void *nv;
+
+    if (n < *cap)
+        return v;
+    *cap = *cap ? *cap * 2 : 8;
+    nv = arena_alloc(a, *cap * size);
+    if (n > 0)
+        memcpy(nv, v, n * size);
+    return nv;
+}
+
+/* brace expansion */
+
+static char *skip(char *p)
+/*
+ * purpose: step over one character of word source, or all of a
+ *          quoted string, \x, ${...}, $(...), <(...) or `...`, none of
+ *          which braces act in
+ */
+{
+    char *q;
+
+    if (*p == '\\' && p[1] != '\0')
+        return p + 2;
+    if (*p == '$' && (p[1] == '{' || p[1] == '(') && (q = group_end(p + 1)) != NULL)
+        return q + 1;
+    if (is_procsub(p) && (q = group_end(p + 1)) != NULL)
+        return q + 1;
+    if (*p == '\'' && (q = strchr(p + 1, '\'')) != NULL)
+        return q + 1;
+    if (*p == '"' || *p == '`')
+        for (q = p + 1; *q != '\0'; q++) {
+            if (*q == '\\' && q[1] != '\0')
+                q++;
+            else if (*q == *p)
+                return q + 1;
+        }
+    return p + 1;
+}
+
+static int range(char *s, char *end, long *lo, long *hi, int *chars)
+/*
+ * purpose: is s[0..end) x..y, with x and y both integers or both
+ *          single characters?
+ * returns: YES with the bounds in *lo and *hi, or NO
+ */
+{
+    char *dots, *r;
+
+    for (dots = s; dots + 1 < end && !(dots[0] == '.' && dots[1] == '.'); dots++)
+        ;
+    if (dots + 1 >= end || dots == s || dots + 2 == end)
+        return NO;
+    if (dots == s + 1 && dots + 3 == end && isalpha((unsigned char)*s)
+        && isalpha((unsigned char)dots[2])) {
+        *chars = YES;
+        *lo = (unsigned char)*s;
+        *hi = (unsigned char)dots[2];
+        return YES;
+    }
+    *chars = NO;
+    *lo = strtol(s, &r, 10);
+    if (r != dots || !(isdigit((unsigned char)*s) || *s == '-'))
+        return NO;
+    *hi = strtol(dots + 2, &r, 10);
+    return r == end && (isdigit((unsigned char)dots[2]) || dots[2] == '-');
+}
+
+static char **brace(struct arena *a, char *s, char **v, int *n, int *cap)
+/*
+ * purpose: append the brace expansions of word source s to v
+ * returns: v, perhaps moved; the first {...} that has a comma or is a
+ *          range is expanded and each result expanded again, so later
+ *          and nested braces multiply out left to right
+ */
+{
+    char *p, *q, *alt, *word, num[24];
+    size_t pre, suf;
+    long lo, hi, i;
+    int depth, commas, chars;
+
+    for (p = s; *p != '\0'; p = skip(p)) {
+        if (*p != '{')
+            continue;
+        depth = commas = 0;
+        for (q = p + 1; *q != '\0'; q = skip(q)) {
+            if (*q == '{')
+                depth++;
+            else if (*q == '}' && depth-- == 0)
+                break;
+            else if (*q == ',' && depth == 0)
+                commas++;
+        }
+        if (*q != '}' || (commas == 0 && !range(p + 1, q, &lo, &hi, &chars)))
+            continue;			/* not a brace expression	*/
+        pre = p - s;
+        suf = strlen(q + 1);
+        if (commas == 0) {
+            for (i = lo; ; i += lo <= hi ? 1 : -1) {
+                if (chars)
+                    snprintf(num, sizeof num, "%c", (int)i);
+                else
+                    snprintf(num, sizeof num, "%ld", i);
+                word = arena_alloc(a, pre + strlen(num) + suf + 1);
+                sprintf(word, "%.*s%s%s", (int)pre, s, num, q + 1);
+                v = brace(a, word, v, n, cap);
+                if (i == hi)
+                    break;
+            }
+            return v;
+        }
+        for (alt = p + 1; alt <= q; alt = p + 1) {
+            for (p = alt, depth = 0; p < q; p = skip(p)) {
+                if (*p == '{')
+                    depth++;
+                else if (*p == '}')
+                    depth--;
+                else if (*p == ',' && depth == 0)
+                    break;
+            }
+            word = arena_alloc(a, pre + (p - alt) + suf + 1);
+            sprintf(word, "%.*s%.*s%s", (int)pre, s, (int)(p - alt), alt, q + 1);
+            v = brace(a, word, v, n, cap);
+        }
+        return v;
+    }
+    if (*s == '\0')			/* {,x}: an empty result vanishes */
+        return v;
+    v = grow(a, v, *n, cap, sizeof(char *));
+    v[(*n)++] = s;
+    return v;
+}
+
+static void add_braced(struct lexer *lx, struct stage *st, int *cap)
+/*
+ * purpose: add the words the current word's braces expand to
+ */
+{
+    struct lexer sub;
+    char **v, *raw = arena_strndup(lx->arena, lx->raw, lx->rawlen);
+    int n = 0, vcap = 0, i;
+
+    v = brace(lx->arena, raw, NULL, &n, &vcap);
+    for (i = 0; i < n; i++) {
+        sub.arena = lx->arena;
+        sub.span = NO;
+        sub.p = v[i];
+        if (v[i] != raw)		/* unexpanded: it is scanned	*/
+            lex_word(&sub);
+        st->words = grow(lx->arena, st->words, st->argc, cap,
+                         sizeof(struct word));
+        st->words[st->argc++] = v[i] != raw ? sub.word : lx->word;
+        if (st->words[st->argc - 1].pat != NULL || st->words[st->argc - 1].exp != NULL)
+            st->nglob++;
+    }
+}
+
+/* redirections */
+
+static const struct {
+    int		tok, op, fd;		/* fd when no n is written	*/
+} redirs[] = {
+    { T_LT, R_IN, 0 },		{ T_GT, R_OUT, 1 },
+    { T_CLOBBER, R_OUT, 1 },	{ T_APPEND, R_APPEND, 1 },
+    { T_DUPIN, R_DUP, 0 },	{ T_DUPOUT, R_DUP, 1 },
+    { T_HEREDOC, R_HEREDOC, 0 },	{ T_HEREDASH, R_HEREDOC, 0 },
+    { T_HERESTR, R_HERESTR, 0 },
+    { T_ANDGT, R_OUT, 1 },	{ T_ANDAPPEND, R_APPEND, 1 },
+    { -1, 0, 0 }
+};
+
+static struct redir *add_redir(struct lexer *lx, struct redir ***tailp,
+                               int op, int fd, struct word *target)
+{
+    struct redir *r = arena_alloc(lx->arena, sizeof(struct redir));
+
+    r->op = op;
+    r->fd = fd;
+    r->target = *target;
+    r->next = NULL;
+    **tailp = r;
+    *tailp = &r->next;
+    return r;
+}
+
+static void add_heredoc(struct lexer *lx, struct redir *r, int strip)
+/*
+ * purpose: note a << whose body is to come from the lines after this
+ *          one; until parse_heredocs() reads it the body is empty
+ */
+{
+    static struct word empty = { "", NULL, NULL };
+
+    if (npending == maxpending) {
+        maxpending = maxpending ? maxpending * 2 : 4;
+        pending = erealloc(pending, maxpending * sizeof(struct heredoc));
+    }
+    pending[npending].r = r;
+    pending[npending].delim = r->target.text;
+    pending[npending].strip = strip;
+    pending[npending].quoted = strcspn(lx->raw, "'\"\\") < lx->rawlen;
+    npending++;
+    r->target = empty;
+}
+
+static int parse_redir(struct lexer *lx, struct redir ***tailp)
+/*
+ * purpose: [n]op word, with lx->tok a redirection operator
+ * returns: 0, or -1 after reporting a syntax error
+ *   notes: &> word and >& word (a word that is not a descriptor)
+ *          become > word 2>&1
+ */
+{
+    static struct word one = { "1", NULL, NULL };
+    struct redir *r;
+    int i, tok = lx->tok, fd = lx->iofd, both;
+
+    for (i = 0; redirs[i].tok != tok; i++)
+        ;
+    if (next(lx) != T_WORD)
+        return syntax_error(lx);
+    r = add_redir(lx, tailp, redirs[i].op, fd != -1 ? fd : redirs[i].fd, &lx->word);
+    both = tok == T_ANDGT || tok == T_ANDAPPEND;
+    if (tok == T_DUPOUT && r->fd == 1 && lx->word.exp == NULL
+        && strcmp(lx->word.text, "-") != 0
+        && strspn(lx->word.text, "0123456789") != strlen(lx->word.text)) {
+        r->op = R_OUT;
+        both = YES;
+    }
+    if (both)
+        add_redir(lx, tailp, R_DUP, 2, &one);
+    if (r->op == R_HEREDOC)
+        add_heredoc(lx, r, tok == T_HEREDASH);
+    return 0;
+}
+
+static int is_redir(int tok)
+{
+    int i;
+
+    for (i = 0; redirs[i].tok != -1; i++)
+        if (redirs[i].tok == tok)
+            return YES;
+    return NO;
+}
+
+static int is_assign(struct lexer *lx)
+/*
+ * purpose: is the current word NAME=value, NAME unquoted?
+ */
+{
+    char *eq;
+
+    if (lx->tok != T_WORD)
+        return NO;
+    eq = memchr(lx->raw, '=', lx->rawlen);
+    return eq != NULL && var_isname(lx->raw, eq - lx->raw);
+}
+
+static struct node *mknode(struct arena *a, int type, struct node *l, struct node *r)
+{
+    struct node *n = arena_alloc(a, sizeof(struct node));
+
+    n->type = type;
+    n->pl = NULL;
+    n->left = l;
+    n->right = r;
+    n->other = NULL;
+    n->name = NULL;
+    return n;
+}
+
+static int keyword(struct lexer *lx, char *kw)
+/*
+ * purpose: is the current token the reserved word kw, unquoted?
+ */
+{
+    return lx->tok == T_WORD && lx->rawlen == strlen(kw)
+           && strncmp(lx->raw, kw, lx->rawlen) == 0;
+}
+
+static int at_list_end(struct lexer *lx)
+/*
+ * purpose: does the current token, where a command could start, end
+ *          the list it would be in?
+ */
+{
+    static char *enders[] = { "then", "elif", "else", "fi", "do", "done", "}", NULL };
+    int i;
+
+    if (lx->tok == T_EOF || lx->tok == T_RPAREN)
+        return YES;
+    for (i = 0; enders[i] != NULL; i++)
+        if (keyword(lx, enders[i]))
+            return YES;
+    return NO;
+}
+
+static int next_linebreak(struct lexer *lx)
+/*
+ * purpose: advance past an operator that a command must follow, and
+ *          past any newlines after it
+ */
+{
+    lx->depth++;
+    while (next(lx) == T_NEWLINE)
+        ;
+    lx->depth--;
+    return lx->tok;
+}
+
+static void add_word(struct lexer *lx, struct stage *st, int *cap)
+{
+    st->words = grow(lx->arena, st->words, st->argc, cap, sizeof(struct word));
+    st->words[st->argc++] = lx->word;
+    if (lx->word.pat != NULL || lx->word.exp != NULL)
+        st->nglob++;
+}
+
+static void end_stage(struct arena *a, struct stage *st)
+/*
+ * purpose: make the stage's argv of its words' texts
+ */
+{
+    int i;
+
+    st->argv = arena_alloc(a, (st->argc + 1) * sizeof(char *));
+    for (i = 0; i < st->argc; i++)
+        st->argv[i] = st->words[i].text;
+    st->argv[i] = NULL;
+}
+
+static int is_compound(struct lexer *lx)
+{
+    return lx->tok == T_LPAREN || keyword(lx, "if") || keyword(lx, "while")
+           || keyword(lx, "until") || keyword(lx, "for") || keyword(lx, "{")
+           || keyword(lx, "function");
+}
+
+static int parse_funcdef(struct lexer *lx, struct stage *st)
+/*
+ * purpose: finish name() compound, with lx->tok the '(' after the name
+ * returns: 0, or -1 after reporting a syntax error
+ */
+{
+    struct node *n;
+
+    if (next(lx) != T_RPAREN)
+        return syntax_error(lx);
+    next_linebreak(lx);
+    if (!is_compound(lx))
+        return syntax_error(lx);
+    n = mknode(lx->arena, N_FUNC, NULL, NULL);
+    n->name = st->argv[0];
+    if ((n->left = parse_compound(lx)) == NULL)
+        return -1;
+    st->body = n;
+    st->argc = st->nglob = 0;
+    st->words = NULL;
+    return 0;
+}
+
+static int parse_stage(struct lexer *lx, struct stage *st)
+/*
+ * purpose: read assignments, words and redirections up to the next
+ *          operator, or a compound command and its redirections
+ * returns: 0, or -1 after reporting a syntax error
+ */
+{
+    struct redir **tail = &st->redirs;
+    int cap = 0, acap = 0;
+
+    st->argc = 0;
+    st->words = NULL;
+    st->nglob = 0;
+    st->redirs = NULL;
+    st->nassign = 0;
+    st->assigns = NULL;
+    st->body = NULL;
+    if (is_compound(lx)) {
+        if ((st->body = parse_compound(lx)) == NULL)
+            return -1;
+        if (lx->tok == T_WORD)		/* only redirections may follow */
+            return syntax_error(lx);
+    }
+    for (;;) {
+        if (lx->fan > 0 && keyword(lx, "}")) {
+            break;			/* the end of a |{ ... }	*/
+        } else if (st->argc == 0 && st->body == NULL && is_assign(lx)) {
+            st->assigns = grow(lx->arena, st->assigns, st->nassign, &acap,
+                               sizeof(struct word));
+            st->assigns[st->nassign++] = lx->word;
+        } else if (st->body != NULL && lx->tok == T_WORD) {
+            return syntax_error(lx);
+        } else if (lx->tok == T_WORD && lx->brace) {
+            add_braced(lx, st, &cap);
+        } else if (lx->tok == T_WORD) {
+            add_word(lx, st, &cap);
+        } else if (is_redir(lx->tok)) {
+            if (parse_redir(lx, &tail) == -1)
+                return -1;
+        } else if (lx->tok == T_LPAREN && st->argc == 1 && st->nassign == 0
+                   && st->redirs == NULL && st->nglob == 0) {
+            end_stage(lx->arena, st);
+            if (parse_funcdef(lx, st) == -1)
+                return -1;
+            continue;
+        } else {
+            break;
+        }
+        next(lx);
+    }
+    if (st->argc == 0 && st->redirs == NULL && st->nassign == 0 && st->body == NULL)
+        return syntax_error(lx);
+
+    end_stage(lx->arena, st);
+    return 0;
+}
+
+static struct node *parse_andor(struct lexer *);
+
+static int parse_fanout(struct lexer *lx, struct pipeline *pl)
+/*
+ * purpose: the lists of |{ list ; list ... }, with lx->tok the |{
+ * returns: 0, or -1 after reporting a syntax error
+ */
+{
+    struct node *item;
+    int cap = 0;
+
+    lx->depth++;
+    lx->fan++;
+    next(lx);
+    for (;;) {
+        while (lx->tok == T_NEWLINE)
+            next(lx);
+        if (keyword(lx, "}"))
+            break;
+        if ((item = parse_andor(lx)) == NULL)
+            return -1;
+        pl->fan = grow(lx->arena, pl->fan, pl->nfan, &cap, sizeof(struct node *));
+        pl->fan[pl->nfan++] = item;
+        if (lx->tok != T_SEMI && lx->tok != T_NEWLINE)
+            break;
+        next(lx);
+    }
+    lx->fan--;
+    if (pl->nfan == 0 || !keyword(lx, "}"))
+        return syntax_error(lx);
+    lx->depth--;
+    next(lx);
+    return 0;
+}
+
+static struct node *parse_pipeline(struct lexer *lx)
+/*
+ * purpose: stage { | stage } [ |{ list ; list ... } ]
+ * returns: an N_PIPE node, or NULL after a syntax error
+ */
+{
+    struct pipeline *pl = arena_alloc(lx->arena, sizeof(struct pipeline));
+    struct node *n;
+    int cap = 0;
+
+    pl->nstages = 0;
+    pl->stages = NULL;
+    pl->nfan = 0;
+    pl->fan = NULL;
+    for (;;) {
+        pl->stages = grow(lx->arena, pl->stages, pl->nstages, &cap,
+                          sizeof(struct stage));
+        if (parse_stage(lx, &pl->stages[pl->nstages]) == -1)
+            return NULL;
+        pl->nstages++;
+        if (lx->tok == T_FANOUT) {	/* it ends the pipeline		*/
+            if (parse_fanout(lx, pl) == -1)
+                return NULL;
+            break;
+        }
+        if (lx->tok != T_PIPE)
+            break;
+        next_linebreak(lx);
+    }
+    n = mknode(lx->arena, N_PIPE, NULL, NULL);
+    n->pl = pl;
+    return n;
+}
+
+static struct node *parse_andor(struct lexer *lx)
+/*
+ * purpose: pipeline { && pipeline | || pipeline }, left to right
+ */
+{
+    struct node *n, *r;
+    int type;
+
+    if ((n = parse_pipeline(lx)) == NULL)
+        return NULL;
+    while (lx->tok == T_ANDAND || lx->tok == T_OROR) {
+        type = lx->tok == T_ANDAND ? N_AND : N_OR;
+        next_linebreak(lx);
+        if ((r = parse_pipeline(lx)) == NULL)
+            return NULL;
+        n = mknode(lx->arena, type, n, r);
+    }
+    return n;
+}
+
+static struct node *parse_list(struct lexer *lx)
+/*
+ * purpose: and-or { ; & or newline and-or } [ ; & or newline ], up to
+ *          the end of the input or a word that ends a compound command
+ * returns: the list, or NULL after a syntax error (an empty list is one)
+ *   notes: an and-or followed by & is wrapped in an N_BG node
+ */
+{
+    struct node *n = NULL, *item;
+
+    for (;;) {
+        while (lx->tok == T_NEWLINE)
+            next(lx);
+        if (at_list_end(lx))
+            break;
+        if ((item = parse_andor(lx)) == NULL)
+            return NULL;
+        if (lx->tok == T_AMP)
+            item = mknode(lx->arena, N_BG, item, NULL);
+        n = n ? mknode(lx->arena, N_SEQ, n, item) : item;
+        if (lx->tok != T_SEMI && lx->tok != T_AMP && lx->tok != T_NEWLINE)
+            break;
+        next(lx);
+    }
+    if (n == NULL)
+        syntax_error(lx);
+    return n;
+}
+
+static struct node *bad(struct lexer *lx)
+{
+    syntax_error(lx);
+    return NULL;
+}
+
+static int expect(struct lexer *lx, char *kw)
+/*
+ * purpose: insist on the reserved word kw, and move past it
+ * returns: 0, or -1 after reporting a syntax error
+ */
+{
+    if (!keyword(lx, kw))
+        return syntax_error(lx);
+    next(lx);
+    return 0;
+}
+
+static struct node *parse_if(struct lexer *lx)
+/*
+ * purpose: the rest of an if or elif, up to the fi, which is left as
+ *          the current token
+ */
+{
+    struct node *n = mknode(lx->arena, N_IF, NULL, NULL);
+
+    next(lx);
+    if ((n->left = parse_list(lx)) == NULL || expect(lx, "then") == -1
+        || (n->right = parse_list(lx)) == NULL)
+        return NULL;
+    if (keyword(lx, "elif"))
+        return (n->other = parse_if(lx)) ? n : NULL;
+    if (keyword(lx, "else")) {
+        next(lx);
+        if ((n->other = parse_list(lx)) == NULL)
+            return NULL;
+    }
+    return keyword(lx, "fi") ? n : bad(lx);
+}
+
+static struct pipeline *parse_for_words(struct lexer *lx)
+/*
+ * purpose: the words after "for name in", up to ; or a newline
+ * returns: a pipeline of one stage holding them
+ */
+{
+    struct pipeline *pl = arena_alloc(lx->arena, sizeof(struct pipeline));
+    struct stage *st = arena_alloc(lx->arena, sizeof(struct stage));
+    int cap = 0;
+
+    memset(st, 0, sizeof *st);
+    while (next(lx) == T_WORD) {
+        if (lx->brace)
+            add_braced(lx, st, &cap);
+        else
+            add_word(lx, st, &cap);
+    }
+    end_stage(lx->arena, st);
+    pl->nstages = 1;
+    pl->stages = st;
+    pl->nfan = 0;
+    pl->fan = NULL;
+    return pl;
+}
+
+static struct node *parse_compound(struct lexer *lx)
+/*
+ * purpose: one compound command, with lx->tok its first word
+ * returns: the tree, or NULL after a syntax error
+ */
+{
+    struct node *n;
+    int type;
+
+    if (keyword(lx, "function")) {
+        if (next(lx) != T_WORD)
+            return bad(lx);
+        n = mknode(lx->arena, N_FUNC, NULL, NULL);
+        n->name = lx->word.text;
+        lx->depth++;			/* the body may be on the next line */
+        if (next(lx) == T_LPAREN && next(lx) != T_RPAREN)
+            return bad(lx);
+        if (lx->tok == T_RPAREN)
+            next(lx);
+        while (lx->tok == T_NEWLINE)
+            next(lx);
+        lx->depth--;
+        if (!is_compound(lx))
+            return bad(lx);
+        return (n->left = parse_compound(lx)) ? n : NULL;
+    }
+    lx->depth++;
+    if (lx->tok == T_LPAREN || keyword(lx, "{")) {
+        type = lx->tok == T_LPAREN ? N_SUBSHELL : N_GROUP;
+        next(lx);
+        n = mknode(lx->arena, type, parse_list(lx), NULL);
+        if (n->left == NULL)
+            return NULL;
+        if (type == N_SUBSHELL ? lx->tok != T_RPAREN : !keyword(lx, "}"))
+            return bad(lx);
+    } else if (keyword(lx, "if")) {
+        if ((n = parse_if(lx)) == NULL)
+            return NULL;
+    } else if (keyword(lx, "for")) {
+        n = mknode(lx->arena, N_FOR, NULL, NULL);
+        if (next(lx) != T_WORD || !var_isname(lx->raw, lx->rawlen))
+            return bad(lx);
+        n->name = lx->word.text;
+        while (next(lx) == T_NEWLINE)
+            ;
+        if (keyword(lx, "in"))
+            n->pl = parse_for_words(lx);
+        if (lx->tok == T_SEMI || lx->tok == T_NEWLINE)
+            next(lx);
+        while (lx->tok == T_NEWLINE)
+            next(lx);
+        if (expect(lx, "do") == -1 || (n->left = parse_list(lx)) == NULL)
+            return NULL;
+        if (!keyword(lx, "done"))
+            return bad(lx);
+    } else {				/* while or until		*/
+        n = mknode(lx->arena, keyword(lx, "while") ? N_WHILE : N_UNTIL, NULL, NULL);
+        next(lx);
+        if ((n->left = parse_list(lx)) == NULL || expect(lx, "do") == -1
+            || (n->right = parse_list(lx)) == NULL)
+            return NULL;
+        if (!keyword(lx, "done"))
+            return bad(lx);
+    }
+    lx->depth--;			/* a newline after it ends it	*/
+    next(lx);
+    return n;
+}
+
+struct node *parse_lines(struct arena *a, char *line, struct reader *rd, char *prompt)
+/*
+ * purpose: parse one command, which may go on past line to the lines
+ *          after it in rd (given prompt on a terminal)
+ * returns: the command tree, allocated in a; NULL for a blank line
+ *          or after a syntax error (reported on stderr)
+ */
+{
+    struct lexer lx;
+    struct node *n;
+
+    need_scratch(strlen(line));		/* words are never longer	*/
+    npending = 0;
+    lx.arena = a;
+    lx.span = NO;
+    lx.p = line;
+    lx.rd = rd;
+    lx.prompt = prompt;
+    lx.depth = 0;
+    lx.eol = NO;
+    lx.fan = 0;
+    if (next(&lx) == T_EOF)
+        return NULL;
+    if ((n = parse_list(&lx)) == NULL)
+        return NULL;
+    if (lx.tok != T_EOF) {
+        syntax_error(&lx);
+        return NULL;
+    }
+    return n;
+}
+
+struct node *parse_line(struct arena *a, char *line)
+/*
+ * purpose: parse one command line, all on that line
+ */
+{
+    return parse_lines(a, line, NULL, NULL);
+}
+
+struct word parse_word(struct arena *a, char *s, size_t len)
+/*
+ * purpose: scan s[0..len) as one word in which blanks and operators
+ *          are ordinary characters, as the word in ${x:-word} is
+ * returns: the word, in a
+ */
+{
+    struct lexer lx;
+
+    need_scratch(len);
+    lx.arena = a;
+    lx.span = YES;
+    lx.p = arena_strndup(a, s, len);
+    if (lex_word(&lx) == T_ERROR) {	/* an open quote: take it as text */
+        lx.word.text = lx.p;
+        lx.word.pat = lx.word.exp = NULL;
+    }
+    return lx.word;
+}
+
+static struct word here_word(struct arena *a, char *body, size_t len, int quoted)
+/*
+ * purpose: make a heredoc body into a word to expand when it is used
+ *   notes: as in double quotes, $ expansions are not split, and \
+ *          escapes only \ $ and `; a quoted delimiter turns all of that off
+ */
+{
+    struct word w;
+    char *t, *e, *tstart, *estart, *p, *q;
+    int has_param = NO;
+
+    w.pat = NULL;
+    w.exp = NULL;
+    if (quoted) {
+        w.text = arena_strndup(a, body, len);
+        return w;
+    }
+    tstart = t = arena_alloc(a, len + 1);
+    estart = e = arena_alloc(a, 2 * len + 1);
+    for (p = body; p < body + len; ) {
+        if (*p == '\\' && p + 1 < body + len && strchr("\\$`", p[1]))
+            p++;
+        else if ((*p == '$' && (q = lex_param(p, &t, &e, YES)) != NULL)
+                 || (*p == '`' && (q = lex_backquote(p, &t, &e, YES)) != NULL)) {
+            has_param = YES;
+            p = q;
+            continue;
+        }
+        *t++ = *e++ = *p++;
+    }
+    *t = *e = '\0';
+    w.text = tstart;
+    if (has_param)
+        w.exp = estart;
+    return w;
+}
+
+int parse_heredocs(struct arena *a, struct reader *rd, char *prompt)
+/*
+ * purpose: read the bodies of the heredocs in the line parse_line()
+ *          last parsed, from the lines that follow it in rd
+ * returns: 0, or -1 if the input ended before a delimiter (that body
+ *          then holds what there was, as in other shells); with no rd
+ *          there are no lines, as in a $(command)
+ */
+{
+    static char *buf;
+    static size_t cap;
+    size_t len, n;
+    char *line = NULL;
+    int i, rv = 0;
+
+    for (i = 0; i < npending; i++) {
+        len = 0;
+        while (rd != NULL && (line = rd_line(rd, prompt)) != NULL) {
+            if (pending[i].strip)
+                line += strspn(line, "\t");
+            if (strcmp(line, pending[i].delim) == 0)
+                break;
+            n = strlen(line);
+            if (len + n + 2 > cap) {
+                cap = (len + n + 2) * 2;
+                buf = erealloc(buf, cap);
+            }
+            memcpy(buf + len, line, n);
+            buf[len + n] = '\n';
+            len += n + 1;
+        }
+        if (line == NULL) {
+            if (!parse_quiet)
+                fprintf(stderr, "smsh: warning: here-document ended by end of file (wanted '%s')\n",
+                        pending[i].delim);
+            rv = -1;
+        }
+        pending[i].r->target = here_word(a, buf ? buf : "", len, pending[i].quoted);
+    }
+    npending = 0;
+    return rv;
+}
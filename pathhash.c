@@ -0,0 +1,229 @@
+/* pathhash.c - command name to absolute path cache for smsh
+ *
+ *    char *path_lookup(char *name)   - resolve name, using the cache
+ *    void  path_forget(char *name)   - drop one entry (stale path)
+ *    void  path_clear()              - drop everything
+ *    int   builtin_hash(char **argv) - the "hash" builtin
+ *
+ *    Entries are filled the first time a command is run and reused
+ *    until $PATH changes or an exec of the cached path fails with
+ *    ENOENT, so each command name walks $PATH once instead of once
+ *    per launch.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<unistd.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+#define	DFL_PATH	"/bin:/usr/bin"
+
+struct pathent {
+    char		*name;
+    char		*path;
+    int			hits;
+    struct pathent	*next;
+};
+
+static struct pathent	**table;	/* buckets, power of two	*/
+static int		nbucket;
+static int		nent;
+static char		*seen_path;	/* $PATH the table was built for */
+
+static unsigned hash_name(const char *s)
+{
+    unsigned h = 2166136261u;		/* FNV-1a			*/
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+void path_clear()
+{
+    struct pathent *e, *next;
+    int i;
+
+    for (i = 0; i < nbucket; i++) {
+        for (e = table[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        table[i] = NULL;
+    }
+    nent = 0;
+}
+
+static void check_path_var()
+/*
+ * purpose: flush the table if $PATH is not what it was built for
+ */
+{
+    char *p = getenv("PATH");
+
+    if (p == NULL)
+        p = DFL_PATH;
+    if (seen_path != NULL && strcmp(seen_path, p) == 0)
+        return;
+    path_clear();
+    free(seen_path);
+    seen_path = strcpy(emalloc(strlen(p) + 1), p);
+}
+
+static void grow()
+{
+    struct pathent **old = table, *e, *next;
+    int oldn = nbucket, i;
+    unsigned b;
+
+    nbucket = nbucket ? nbucket * 2 : 64;
+    table = emalloc(nbucket * sizeof(struct pathent *));
+    memset(table, 0, nbucket * sizeof(struct pathent *));
+    for (i = 0; i < oldn; i++) {
+        for (e = old[i]; e != NULL; e = next) {
+            next = e->next;
+            b = hash_name(e->name) & (nbucket - 1);
+            e->next = table[b];
+            table[b] = e;
+        }
+    }
+    free(old);
+}
+
+static char *search_path(const char *name)
+/*
+ * purpose: walk $PATH for an executable regular file called name
+ * returns: malloc'd absolute path, or NULL if not found
+ */
+{
+    const char *dir = seen_path, *end;
+    struct stat st;
+    size_t dlen, nlen = strlen(name);
+    char *buf;
+
+    for (;;) {
+        end = strchr(dir, ':');
+        dlen = end ? (size_t)(end - dir) : strlen(dir);
+        buf = emalloc(dlen + nlen + 3);
+        if (dlen == 0)				/* empty entry means "."	*/
+            strcpy(buf, ".");
+        else {
+            memcpy(buf, dir, dlen);
+            buf[dlen] = '\0';
+        }
+        strcat(buf, "/");
+        strcat(buf, name);
+        if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+            return buf;
+        free(buf);
+        if (end == NULL)
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+static struct pathent *find(const char *name)
+{
+    struct pathent *e;
+
+    if (nbucket == 0)
+        return NULL;
+    for (e = table[hash_name(name) & (nbucket - 1)]; e != NULL; e = e->next)
+        if (strcmp(e->name, name) == 0)
+            return e;
+    return NULL;
+}
+
+char *path_lookup(char *name)
+/*
+ * purpose: map a command name to the file that would be executed
+ * returns: name itself if it contains a '/', else the cached or
+ *          newly found absolute path; NULL if not on $PATH
+ *    note: the returned string belongs to the cache
+ */
+{
+    struct pathent *e;
+    char *path;
+    unsigned b;
+
+    if (strchr(name, '/') != NULL)
+        return name;
+    check_path_var();
+    if ((e = find(name)) != NULL) {
+        e->hits++;
+        return e->path;
+    }
+    if ((path = search_path(name)) == NULL)
+        return NULL;
+
+    if (nent >= nbucket)
+        grow();
+    e = emalloc(sizeof(struct pathent));
+    e->name = strcpy(emalloc(strlen(name) + 1), name);
+    e->path = path;
+    e->hits = 1;
+    b = hash_name(name) & (nbucket - 1);
+    e->next = table[b];
+    table[b] = e;
+    nent++;
+    return path;
+}
+
+void path_forget(char *name)
+{
+    struct pathent **pp, *e;
+
+    if (nbucket == 0)
+        return;
+    for (pp = &table[hash_name(name) & (nbucket - 1)]; (e = *pp) != NULL; pp = &e->next) {
+        if (strcmp(e->name, name) == 0) {
+            *pp = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            nent--;
+            return;
+        }
+    }
+}
+
+int builtin_hash(char **argv)
+/*
+ * purpose: hash          - list cached commands with hit counts
+ *          hash -r       - forget every cached path
+ *          hash name ... - look names up now and cache them
+ * returns: 0, or 1 if a name could not be found
+ */
+{
+    struct pathent *e;
+    int i, rv = 0;
+
+    if (argv[1] == NULL) {
+        if (nent == 0) {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (i = 0; i < nbucket; i++)
+            for (e = table[i]; e != NULL; e = e->next)
+                printf("%4d\t%s\n", e->hits, e->path);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        path_clear();
+        return 0;
+    }
+    for (i = 1; argv[i] != NULL; i++) {
+        if (path_lookup(argv[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            rv = 1;
+        } else if ((e = find(argv[i])) != NULL) {
+            e->hits = 0;
+        }
+    }
+    return rv;
+}
@@ -0,0 +1,575 @@
+/* prof.c - opt-in profiler: spawn latency, wall time and rusage per stage
+ *
+ *    void  prof_init()                      - read SMSH_PROF
+ *    long long prof_now()                   - monotonic clock, in ns
+ *    void  prof_mark()                      - a parse begins
+ *    long long prof_start()                 - a foreground pipeline begins
+ *    void  prof_spawned(pid_t pid, char *name, long long t0) - stage exec'd
+ *    void  prof_builtin(char *name, long long t0, int status) - one ran
+ *    void  prof_pipeline(long long t0)      - the pipeline has finished
+ *    int   builtin_stats(char **argv)       - stats [-j] [-r] [on|off]
+ *
+ *    SMSH_PROF in the environment turns the profiler on.  "on" only
+ *    collects, for the stats builtin to show; any other value names a
+ *    file the figures are written to, as JSON, when the shell exits
+ *    ("-" is stderr).  While it is off the whole cost is one test of
+ *    prof_on per stage.
+ *
+ *    For each stage the shell starts it records the lead from the
+ *    beginning of the parse to the exec (for the second and later
+ *    pipelines of a line, from the beginning of that pipeline), how
+ *    long the spawn call took (posix_spawn returns once the child has
+ *    exec'd), the wall time until the child was reaped, and its user
+ *    and system CPU and peak RSS as wait4() reports them.  Builtins run
+ *    in the shell get their wall time only.
+ *
+ *    Every figure goes into a histogram with log-linear buckets in the
+ *    HDR manner: 16 buckets to each power of two, so a value is known to
+ *    within 1/16 at every scale from nanoseconds to days, and one
+ *    histogram is under 8K.  Stage wall times are also kept per command
+ *    name, so the commands a script spends its time in stand out.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<time.h>
+#include	<unistd.h>
+#include	<sys/resource.h>
+#include	"smsh.h"
+
+#define	SUB_BITS	5		/* 2^(SUB_BITS-1) buckets/octave */
+#define	NBUCKET		((64 - SUB_BITS + 1) << (SUB_BITS - 1))
+#define	NCHAIN		64		/* per-command hash chains	*/
+
+struct hdr {
+    unsigned long long	n, sum, min, max;
+    unsigned long long	*b;		/* NBUCKET counts, on first use	*/
+};
+
+enum { M_LEAD, M_SPAWN, M_WALL, M_USER, M_SYS, M_RSS, M_PIPE, M_BUILTIN, NMETRIC };
+
+static char *mname[NMETRIC] = {
+    "parse_to_exec_ns", "spawn_ns", "stage_wall_ns", "user_ns", "sys_ns",
+    "maxrss_kb", "pipeline_wall_ns", "builtin_ns"
+};
+
+struct cmd {
+    char		*name;
+    unsigned long long	fail;		/* stages with a nonzero status	*/
+    unsigned long long	user, sys;	/* CPU, ns			*/
+    long		maxrss;		/* KB				*/
+    struct hdr		wall;
+    struct cmd		*next;
+};
+
+struct pend {				/* a stage not yet reaped	*/
+    pid_t		pid;		/* 0 for a free slot		*/
+    long long		t0;		/* when its spawn began		*/
+    struct cmd		*c;
+};
+
+int	prof_on;			/* collecting			*/
+
+static struct hdr	metric[NMETRIC];
+static struct cmd	*chain[NCHAIN];
+static int		ncmd;
+static struct pend	*ptab;		/* open addressing, power of 2	*/
+static int		psize, pused;
+static long long	mark;		/* start of this pipeline's parse */
+static long long	since;		/* when collecting began	*/
+static char		*dumpfile;
+static pid_t		dump_pid;
+
+static void done(pid_t, int, const struct rusage *, long long);
+
+long long prof_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * histograms
+ */
+
+static int bucket(unsigned long long v)
+{
+    int shift;
+
+    if (v < (1 << SUB_BITS))
+        return (int)v;
+    shift = 63 - __builtin_clzll(v) - (SUB_BITS - 1);
+    return (shift << (SUB_BITS - 1)) + (int)(v >> shift);
+}
+
+static unsigned long long bucket_top(int i)
+/*
+ * purpose: the largest value that falls in bucket i
+ */
+{
+    int shift;
+
+    if (i < (1 << SUB_BITS))
+        return i;
+    shift = (i >> (SUB_BITS - 1)) - 1;
+    return ((unsigned long long)((i & ((1 << (SUB_BITS - 1)) - 1))
+            + (1 << (SUB_BITS - 1))) << shift) + (1ULL << shift) - 1;
+}
+
+static void hdr_add(struct hdr *h, long long v)
+{
+    if (v < 0)
+        v = 0;
+    if (h->b == NULL) {
+        h->b = emalloc(NBUCKET * sizeof(unsigned long long));
+        memset(h->b, 0, NBUCKET * sizeof(unsigned long long));
+    }
+    h->b[bucket(v)]++;
+    if (h->n == 0 || (unsigned long long)v < h->min)
+        h->min = v;
+    if ((unsigned long long)v > h->max)
+        h->max = v;
+    h->n++;
+    h->sum += v;
+}
+
+static unsigned long long hdr_pct(struct hdr *h, double p)
+/*
+ * purpose: the value p percent of the recorded values are at or below
+ * returns: the top of the bucket it is in, kept within min and max
+ */
+{
+    unsigned long long want, seen = 0, v;
+    int i;
+
+    if (h->n == 0)
+        return 0;
+    want = (unsigned long long)(p / 100 * h->n + 0.999999);
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < NBUCKET; i++)
+        if ((seen += h->b[i]) >= want)
+            break;
+    v = bucket_top(i < NBUCKET ? i : NBUCKET - 1);
+    return v < h->min ? h->min : v > h->max ? h->max : v;
+}
+
+static void hdr_clear(struct hdr *h)
+{
+    free(h->b);
+    memset(h, 0, sizeof *h);
+}
+
+/*
+ * commands and stages in flight
+ */
+
+static struct cmd *cmd_of(char *name)
+{
+    struct cmd *c;
+    char *s;
+    unsigned h = 2166136261u;
+
+    if ((s = strrchr(name, '/')) != NULL && s[1] != '\0')
+        name = s + 1;
+    for (s = name; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    for (c = chain[h % NCHAIN]; c != NULL; c = c->next)
+        if (strcmp(c->name, name) == 0)
+            return c;
+    c = emalloc(sizeof *c);
+    memset(c, 0, sizeof *c);
+    c->name = emalloc(strlen(name) + 1);
+    strcpy(c->name, name);
+    c->next = chain[h % NCHAIN];
+    chain[h % NCHAIN] = c;
+    ncmd++;
+    return c;
+}
+
+static int home(pid_t pid)
+{
+    return (unsigned)pid * 2654435761u & (psize - 1);
+}
+
+static struct pend *pend_find(pid_t pid)
+{
+    int i;
+
+    if (psize == 0)
+        return NULL;
+    for (i = home(pid); ptab[i].pid != 0; i = (i + 1) & (psize - 1))
+        if (ptab[i].pid == pid)
+            return &ptab[i];
+    return NULL;
+}
+
+static void pend_add(pid_t pid, long long t0, struct cmd *c)
+{
+    struct pend *old = ptab;
+    int i, n = psize;
+
+    if (2 * (pused + 1) > psize) {	/* keep it at most half full	*/
+        psize = psize ? 2 * psize : 64;
+        ptab = emalloc(psize * sizeof *ptab);
+        memset(ptab, 0, psize * sizeof *ptab);
+        pused = 0;
+        for (i = 0; i < n; i++)
+            if (old[i].pid != 0)
+                pend_add(old[i].pid, old[i].t0, old[i].c);
+        free(old);
+    }
+    for (i = home(pid); ptab[i].pid != 0; i = (i + 1) & (psize - 1))
+        ;
+    ptab[i].pid = pid;
+    ptab[i].t0 = t0;
+    ptab[i].c = c;
+    pused++;
+}
+
+static void pend_del(struct pend *p)
+/*
+ * purpose: empty a slot, moving later entries of its run back into it
+ *          so no lookup ever needs a tombstone
+ */
+{
+    int i = p - ptab, j = i, k;
+
+    pused--;
+    for (;;) {
+        ptab[i].pid = 0;
+        for (;;) {
+            j = (j + 1) & (psize - 1);
+            if (ptab[j].pid == 0)
+                return;
+            k = home(ptab[j].pid);
+            if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;		/* already as near home as it can be */
+            break;
+        }
+        ptab[i] = ptab[j];
+        i = j;
+    }
+}
+
+/*
+ * recording
+ */
+
+static void reset()
+{
+    struct cmd *c, *next;
+    int i;
+
+    for (i = 0; i < NMETRIC; i++)
+        hdr_clear(&metric[i]);
+    for (i = 0; i < NCHAIN; i++) {
+        for (c = chain[i]; c != NULL; c = next) {
+            next = c->next;
+            hdr_clear(&c->wall);
+            free(c->name);
+            free(c);
+        }
+        chain[i] = NULL;
+    }
+    ncmd = 0;
+    since = prof_now();
+}
+
+static void start(int on)
+{
+    prof_on = on;
+    child_done = on ? done : NULL;
+    if (on && since == 0)
+        since = prof_now();
+}
+
+void prof_mark()
+{
+    if (prof_on)
+        mark = prof_now();
+}
+
+long long prof_start()
+/*
+ * purpose: note that a foreground pipeline begins
+ * returns: the time, for prof_pipeline()
+ *   notes: the first pipeline of a line keeps the parse's mark
+ */
+{
+    long long t = prof_now();
+
+    if (mark == 0)
+        mark = t;
+    return t;
+}
+
+void prof_pipeline(long long t0)
+{
+    hdr_add(&metric[M_PIPE], prof_now() - t0);
+    mark = 0;
+}
+
+void prof_spawned(pid_t pid, char *name, long long t0)
+/*
+ * purpose: record a stage whose spawn, begun at t0, has just returned
+ *   notes: the rest is filled in by done() when it is reaped
+ */
+{
+    long long t = prof_now();
+
+    hdr_add(&metric[M_SPAWN], t - t0);
+    if (mark != 0)
+        hdr_add(&metric[M_LEAD], t - mark);
+    pend_add(pid, t0, cmd_of(name));
+}
+
+void prof_builtin(char *name, long long t0, int status)
+{
+    struct cmd *c = cmd_of(name);
+    long long t = prof_now() - t0;
+
+    hdr_add(&metric[M_BUILTIN], t);
+    hdr_add(&c->wall, t);
+    if (status != 0)
+        c->fail++;
+}
+
+static long long ns(struct timeval tv)
+{
+    return tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
+}
+
+static void done(pid_t pid, int status, const struct rusage *ru, long long end)
+/*
+ * purpose: the child table's hook for a child that has been reaped
+ *   notes: runs with SIGCHLD held, never from the handler itself
+ */
+{
+    struct pend *p;
+    struct cmd *c;
+
+    if ((p = pend_find(pid)) == NULL)
+        return;
+    c = p->c;
+    hdr_add(&metric[M_WALL], end - p->t0);
+    hdr_add(&metric[M_USER], ns(ru->ru_utime));
+    hdr_add(&metric[M_SYS], ns(ru->ru_stime));
+    hdr_add(&metric[M_RSS], ru->ru_maxrss);
+    hdr_add(&c->wall, end - p->t0);
+    c->user += ns(ru->ru_utime);
+    c->sys += ns(ru->ru_stime);
+    if (ru->ru_maxrss > c->maxrss)
+        c->maxrss = ru->ru_maxrss;
+    if (exit_code(status) != 0)
+        c->fail++;
+    pend_del(p);
+}
+
+/*
+ * reports
+ */
+
+static double pcts[] = { 50, 90, 99, 99.9 };
+#define	NPCT	(int)(sizeof pcts / sizeof pcts[0])
+
+static int by_total(const void *a, const void *b)
+{
+    const struct cmd *x = *(struct cmd **)a, *y = *(struct cmd **)b;
+
+    return x->wall.sum < y->wall.sum ? 1 : x->wall.sum > y->wall.sum ? -1
+           : strcmp(x->name, y->name);
+}
+
+static struct cmd **sorted()
+/*
+ * purpose: every command, most total wall time first
+ * returns: a malloc'd array of ncmd entries
+ */
+{
+    struct cmd **v = emalloc((ncmd + 1) * sizeof *v), *c;
+    int i, n = 0;
+
+    for (i = 0; i < NCHAIN; i++)
+        for (c = chain[i]; c != NULL; c = c->next)
+            v[n++] = c;
+    qsort(v, n, sizeof *v, by_total);
+    return v;
+}
+
+static void json_str(FILE *fp, char *s)
+{
+    putc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < ' ')
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else
+            putc(*s, fp);
+    }
+    putc('"', fp);
+}
+
+static void json_hdr(FILE *fp, struct hdr *h)
+/*
+ * purpose: a histogram as its summary and its nonempty buckets, each
+ *          [top value, count], so dumps can be merged
+ */
+{
+    int i, first = YES;
+
+    fprintf(fp, "{\"count\": %llu, \"min\": %llu, \"max\": %llu, \"mean\": %llu",
+            h->n, h->min, h->max, h->n ? h->sum / h->n : 0);
+    for (i = 0; i < NPCT; i++)
+        fprintf(fp, ", \"p%g\": %llu", pcts[i], hdr_pct(h, pcts[i]));
+    fprintf(fp, ", \"buckets\": [");
+    for (i = 0; h->b != NULL && i < NBUCKET; i++)
+        if (h->b[i] != 0) {
+            fprintf(fp, "%s[%llu, %llu]", first ? "" : ", ", bucket_top(i), h->b[i]);
+            first = NO;
+        }
+    fprintf(fp, "]}");
+}
+
+static void json(FILE *fp)
+{
+    struct cmd **v = sorted();
+    int i;
+
+    fprintf(fp, "{\"pid\": %d, \"elapsed_ns\": %lld, \"metrics\": {",
+            (int)getpid(), since ? prof_now() - since : 0);
+    for (i = 0; i < NMETRIC; i++) {
+        fprintf(fp, "%s\n  \"%s\": ", i ? "," : "", mname[i]);
+        json_hdr(fp, &metric[i]);
+    }
+    fprintf(fp, "\n}, \"commands\": [");
+    for (i = 0; i < ncmd; i++) {
+        fprintf(fp, "%s\n  {\"name\": ", i ? "," : "");
+        json_str(fp, v[i]->name);
+        fprintf(fp, ", \"failed\": %llu, \"user_ns\": %llu, \"sys_ns\": %llu,"
+                " \"maxrss_kb\": %ld, \"wall_ns\": ", v[i]->fail, v[i]->user,
+                v[i]->sys, v[i]->maxrss);
+        json_hdr(fp, &v[i]->wall);
+        putc('}', fp);
+    }
+    fprintf(fp, "\n]}\n");
+    free(v);
+}
+
+static char *show(char *buf, unsigned long long v, int kb)
+/*
+ * purpose: a duration in ns (or a size in KB) in a few characters
+ */
+{
+    if (kb)
+        sprintf(buf, v < 10240 ? "%.0fK" : "%.1fM", v < 10240 ? (double)v : v / 1024.0);
+    else if (v < 1000)
+        sprintf(buf, "%lluns", v);
+    else if (v < 1000000)
+        sprintf(buf, "%.1fus", v / 1e3);
+    else if (v < 1000000000)
+        sprintf(buf, "%.1fms", v / 1e6);
+    else
+        sprintf(buf, "%.2fs", v / 1e9);
+    return buf;
+}
+
+static void table()
+{
+    struct cmd **v = sorted();
+    char b[8][32];
+    struct hdr *h;
+    int i, j, kb;
+
+    printf("%-16s %8s %9s %9s %9s %9s %9s %9s\n", "metric", "count",
+           "min", "p50", "p90", "p99", "max", "mean");
+    for (i = 0; i < NMETRIC; i++) {
+        h = &metric[i];
+        if (h->n == 0)
+            continue;
+        kb = i == M_RSS;
+        printf("%-16.*s %8llu %9s", (int)(strrchr(mname[i], '_') - mname[i]),
+               mname[i], h->n, show(b[0], h->min, kb));
+        for (j = 0; j < 3; j++)
+            printf(" %9s", show(b[j + 1], hdr_pct(h, pcts[j]), kb));
+        printf(" %9s %9s\n", show(b[4], h->max, kb), show(b[5], h->sum / h->n, kb));
+    }
+    if (ncmd > 0)
+        printf("\n%-16s %8s %6s %9s %9s %9s %9s %9s %9s\n", "command", "count",
+               "failed", "total", "p50", "p99", "user", "sys", "maxrss");
+    for (i = 0; i < ncmd; i++) {
+        h = &v[i]->wall;
+        printf("%-16s %8llu %6llu %9s %9s %9s %9s %9s %9s\n", v[i]->name, h->n,
+               v[i]->fail, show(b[0], h->sum, NO), show(b[1], hdr_pct(h, 50), NO),
+               show(b[2], hdr_pct(h, 99), NO), show(b[3], v[i]->user, NO),
+               show(b[4], v[i]->sys, NO), show(b[5], v[i]->maxrss, YES));
+    }
+    free(v);
+}
+
+static void dump()
+/*
+ * purpose: write the JSON report to SMSH_PROF at exit
+ *   notes: forked copies of the shell that exit() do not write it
+ */
+{
+    FILE *fp;
+
+    if (getpid() != dump_pid)
+        return;
+    if (strcmp(dumpfile, "-") == 0)
+        fp = stderr;
+    else if ((fp = fopen(dumpfile, "w")) == NULL) {
+        perror(dumpfile);
+        return;
+    }
+    json(fp);
+    if (fp != stderr)
+        fclose(fp);
+}
+
+void prof_init()
+{
+    char *s = getenv("SMSH_PROF");
+
+    if (s == NULL || *s == '\0' || strcmp(s, "off") == 0)
+        return;
+    start(YES);
+    if (strcmp(s, "on") != 0) {
+        dumpfile = s;
+        dump_pid = getpid();
+        atexit(dump);
+    }
+}
+
+int builtin_stats(char **argv)
+/*
+ * purpose: stats: show what has been collected; -j as JSON, -r to
+ *          start again, on/off to start or stop collecting
+ */
+{
+    char *a = argv[1];
+
+    if (a == NULL) {
+        if (!prof_on && since == 0) {
+            fprintf(stderr, "stats: profiling is off (stats on, or SMSH_PROF=on)\n");
+            return 1;
+        }
+        table();
+    } else if (strcmp(a, "-j") == 0)
+        json(stdout);
+    else if (strcmp(a, "-r") == 0)
+        reset();
+    else if (strcmp(a, "on") == 0 || strcmp(a, "off") == 0)
+        start(strcmp(a, "on") == 0);
+    else {
+        fprintf(stderr, "usage: stats [-j | -r | on | off]\n");
+        return 2;
+    }
+    return 0;
+}
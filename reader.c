@@ -0,0 +1,208 @@
+/* reader.c - block-buffered command line reader for smsh
+ *
+ *    struct reader *rd_open(int fd)          - start reading fd
+ *    struct reader *rd_string(char *s)       - read lines of a string
+ *    char *rd_line(struct reader *, prompt)  - next line, or NULL at EOF
+ *    void  rd_close(struct reader *)         - release the reader
+ *
+ *    Lines are handed out as views into the reader's buffer: the '\n'
+ *    is overwritten with '\0' and a pointer to the line is returned.
+ *    A view stays valid until the next rd_line() call.  A regular file
+ *    is mmap'd whole; anything else is read() in RD_BLOCK chunks.
+ *    Newlines are found with memchr, never a byte at a time.
+ *
+ *    Only a reader on fd 0 keeps the file offset in step with the
+ *    lines consumed, since only there do commands share the input;
+ *    a script opened by smsh itself costs no system calls per line.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+#define	RD_BLOCK	65536
+
+static int map_file(struct reader *rd)
+/*
+ * purpose: mmap a regular file from the current offset to its end
+ * returns: YES if mapped, NO to fall back to read()
+ */
+{
+    struct stat st;
+    off_t off;
+    void *p;
+
+    if (fstat(rd->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NO;
+    if ((off = lseek(rd->fd, 0, SEEK_CUR)) == -1 || off >= st.st_size)
+        return NO;
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, rd->fd, 0);
+    if (p == MAP_FAILED)
+        return NO;
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    rd->buf = p;
+    rd->cap = st.st_size;
+    rd->len = st.st_size;
+    rd->pos = rd->scan = off;
+    rd->mapped = YES;
+    rd->eof = YES;
+    return YES;
+}
+
+static struct reader *rd_new(int fd)
+{
+    struct reader *rd = emalloc(sizeof(struct reader));
+
+    rd->fd = fd;
+    rd->tty = NO;
+    rd->share = (fd == STDIN_FILENO);
+    rd->tail = NULL;
+    rd->mapped = NO;
+    rd->borrowed = NO;
+    rd->eof = NO;
+    return rd;
+}
+
+struct reader *rd_open(int fd)
+{
+    struct reader *rd = rd_new(fd);
+
+    rd->tty = isatty(fd);
+    if (!rd->tty && map_file(rd))
+        return rd;
+    rd->cap = RD_BLOCK;
+    rd->buf = emalloc(rd->cap);
+    rd->len = rd->pos = rd->scan = 0;
+    return rd;
+}
+
+struct reader *rd_string(char *s)
+/*
+ * purpose: read the lines of a string, as for smsh -c
+ *    note: s is used in place and must stay alive
+ */
+{
+    struct reader *rd = rd_new(-1);
+
+    rd->buf = s;
+    rd->len = rd->cap = strlen(s);
+    rd->pos = rd->scan = 0;
+    rd->borrowed = YES;
+    rd->eof = YES;
+    return rd;
+}
+
+void rd_close(struct reader *rd)
+{
+    if (rd->mapped)
+        munmap(rd->buf, rd->cap);
+    else if (!rd->borrowed)
+        free(rd->buf);
+    free(rd->tail);
+    free(rd);
+}
+
+static char *take(struct reader *rd, size_t end, size_t next)
+/*
+ * purpose: hand out buf[pos..end) as a string and advance to next
+ *    note: for a mapped stdin the fd offset follows the lines handed
+ *          out, so commands that read stdin start where smsh stopped
+ */
+{
+    char *line = rd->buf + rd->pos;
+
+    rd->buf[end] = '\0';
+    rd->pos = rd->scan = next;
+    if (rd->mapped && rd->share)
+        lseek(rd->fd, next, SEEK_SET);
+    return line;
+}
+
+static char *last_line(struct reader *rd)
+/*
+ * purpose: return an unterminated final line
+ *    note: a mapping has no spare byte for the '\0', so that one
+ *          line is copied
+ */
+{
+    size_t n = rd->len - rd->pos;
+
+    if (!rd->mapped)
+        return take(rd, rd->len, rd->len);
+    free(rd->tail);
+    rd->tail = emalloc(n + 1);
+    memcpy(rd->tail, rd->buf + rd->pos, n);
+    rd->tail[n] = '\0';
+    rd->pos = rd->scan = rd->len;
+    if (rd->share)
+        lseek(rd->fd, rd->len, SEEK_SET);
+    return rd->tail;
+}
+
+static void resync(struct reader *rd)
+/*
+ * purpose: pick up where a command that read our stdin left the offset
+ */
+{
+    off_t off = lseek(rd->fd, 0, SEEK_CUR);
+
+    if (off != -1 && (size_t)off != rd->pos && (size_t)off <= rd->len)
+        rd->pos = rd->scan = off;
+}
+
+char *rd_line(struct reader *rd, char *prompt)
+/*
+ * purpose: get the next line of input
+ * returns: the line without its '\n', valid until the next call;
+ *          NULL at EOF
+ *  action: prints prompt first, but only when reading a terminal
+ */
+{
+    char *nl;
+    ssize_t n;
+
+    if (rd->tty && prompt != NULL) {
+        fputs(prompt, stdout);
+        fflush(stdout);
+    }
+    if (rd->mapped && rd->share)
+        resync(rd);
+    for (;;) {
+        if (rd->scan < rd->len) {
+            nl = memchr(rd->buf + rd->scan, '\n', rd->len - rd->scan);
+            if (nl != NULL)
+                return take(rd, nl - rd->buf, nl - rd->buf + 1);
+            rd->scan = rd->len;
+        }
+        if (rd->eof) {
+            if (rd->pos < rd->len)
+                return last_line(rd);
+            return NULL;
+        }
+
+        /* partial line: slide it down, grow if one line fills the buffer */
+        if (rd->pos > 0) {
+            memmove(rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+            rd->len -= rd->pos;
+            rd->scan -= rd->pos;
+            rd->pos = 0;
+        }
+        if (rd->len + 1 >= rd->cap) {
+            rd->cap *= 2;
+            rd->buf = erealloc(rd->buf, rd->cap);
+        }
+        n = read(rd->fd, rd->buf + rd->len, rd->cap - rd->len - 1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            rd->eof = YES;
+        else
+            rd->len += n;
+    }
+}
@@ -0,0 +1,371 @@
+/* reap.c - child process table and exit statuses for smsh
+ *
+ *    void  child_init()                      - reap from a SIGCHLD handler
+ *    void  child_hold(), child_release()     - block/unblock that handler
+ *    void  child_add(pid_t pid, int tag)     - remember a launched child
+ *    int   child_wait(pid_t pid)             - wait for one child
+ *    int   child_poll(pid_t pid, int *statusp) - check without waiting
+ *    void  child_cont(pid_t pid)             - a stopped child was resumed
+ *    pid_t child_reap(int tag, int *statusp) - wait for any child of tag
+ *    int   exit_code(int status)             - wait status to $? value
+ *    void  set_pipestatus(int *codes, int n) - record a pipeline's codes
+ *
+ *    Every child smsh waits for is entered here, keyed by pid, and all
+ *    reaping goes through waitpid(-1).  A status collected for some
+ *    other child than the one being waited for is kept in its slot
+ *    until its owner asks, so nothing is reaped and then lost.  The
+ *    tag says who owns a child (TAG_FG for the foreground pipeline;
+ *    background jobs and builtins such as parallel use their own).
+ *    Nobody waits for a TAG_PROC child (a <(command) or >(command)), so
+ *    its slot is freed as soon as it is reaped.
+ *
+ *    After child_init() the reaping is done by a SIGCHLD handler, so
+ *    background jobs never linger as zombies while the shell sits at
+ *    the prompt; stops are recorded too, for job control.  The handler
+ *    touches the table, so everything else that does runs with SIGCHLD
+ *    blocked, and a launcher holds it from spawn until child_add() so
+ *    a fast child is never reaped before it has a slot.
+ *
+ *    Children are reaped with wait4(), and when child_done is set (the
+ *    profiler sets it) it is called as each finished child leaves the
+ *    table, with its resource usage and the time it was reaped.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<signal.h>
+#include	<time.h>
+#include	<sys/resource.h>
+#include	<sys/wait.h>
+#include	"smsh.h"
+
+#define	C_FREE		0
+#define	C_RUNNING	1
+#define	C_DONE		2
+#define	C_DELETED	3		/* tombstone for linear probing	*/
+#define	C_STOPPED	4		/* stopped, status says by what	*/
+
+struct child {
+    pid_t	pid;
+    int		state;
+    int		tag;
+    int		status;			/* wait status once C_DONE/STOPPED */
+    long long	end;			/* when reaped, ns; for child_done */
+    struct rusage	ru;
+};
+
+static struct child	*table;		/* open addressing, power of 2	*/
+static int		tsize;
+static int		tused;		/* slots not C_FREE		*/
+static int		async;		/* SIGCHLD handler installed	*/
+static int		holds;		/* nesting of child_hold()	*/
+static sigset_t		chldset;
+
+int	last_status;			/* $?				*/
+int	*pipestatus;			/* PIPESTATUS			*/
+int	npipestatus;
+void	(*child_done)(pid_t, int, const struct rusage *, long long);
+
+static struct child *slot(pid_t pid, int insert)
+/*
+ * purpose: find pid's slot, or with insert the slot it should take
+ * returns: the slot, or NULL if pid is not present
+ */
+{
+    struct child *c, *tomb = NULL;
+    unsigned i;
+
+    if (tsize == 0)
+        return NULL;
+    for (i = (unsigned)pid * 2654435761u & (tsize - 1); ; i = (i + 1) & (tsize - 1)) {
+        c = &table[i];
+        if (c->state == C_FREE)
+            return insert ? (tomb ? tomb : c) : NULL;
+        if (c->state == C_DELETED) {
+            if (tomb == NULL)
+                tomb = c;
+        } else if (c->pid == pid) {
+            return c;
+        }
+    }
+}
+
+static void grow()
+{
+    struct child *old = table, *c;
+    int oldn = tsize, i;
+
+    tsize = tsize ? tsize * 2 : 64;
+    table = emalloc(tsize * sizeof(struct child));
+    memset(table, 0, tsize * sizeof(struct child));
+    tused = 0;
+    for (i = 0; i < oldn; i++) {
+        if (old[i].state != C_FREE && old[i].state != C_DELETED) {
+            c = slot(old[i].pid, YES);
+            *c = old[i];
+            tused++;
+        }
+    }
+    free(old);
+}
+
+void child_hold()
+/*
+ * purpose: keep the SIGCHLD handler away from the table
+ *    note: nests; only the outermost child_release() unblocks
+ */
+{
+    if (holds++ == 0 && async)
+        sigprocmask(SIG_BLOCK, &chldset, NULL);
+}
+
+void child_release()
+{
+    if (--holds == 0 && async)
+        sigprocmask(SIG_UNBLOCK, &chldset, NULL);
+}
+
+void child_add(pid_t pid, int tag)
+{
+    struct child *c;
+
+    child_hold();
+    if ((tused + 1) * 2 > tsize)
+        grow();
+    c = slot(pid, YES);
+    if (c->state == C_FREE)
+        tused++;
+    c->pid = pid;
+    c->state = C_RUNNING;
+    c->tag = tag;
+    c->status = 0;
+    child_release();
+}
+
+static int collect(int flags)
+/*
+ * purpose: reap one child with wait4(-1) and file its status
+ * returns: the pid reaped, 0 if none was ready, -1 if no children
+ *    note: called from the SIGCHLD handler, so no stdio or malloc
+ */
+{
+    struct child *c;
+    struct rusage ru;
+    struct timespec ts;
+    pid_t pid;
+    int status;
+
+    while ((pid = wait4(-1, &status, flags, &ru)) == -1 && errno == EINTR)
+        ;
+    if (pid <= 0 || (c = slot(pid, NO)) == NULL || c->state == C_DONE)
+        return pid;
+    if (WIFSTOPPED(status)) {
+        c->state = C_STOPPED;
+        c->status = status;
+    } else if (WIFCONTINUED(status)) {
+        c->state = C_RUNNING;
+    } else if (c->tag == TAG_PROC) {
+        c->state = C_DELETED;		/* nobody will ask for it	*/
+    } else {
+        c->state = C_DONE;
+        c->status = status;
+        if (child_done != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            c->end = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            c->ru = ru;
+        }
+    }
+    return pid;
+}
+
+static void on_sigchld(int sig)
+{
+    int saved = errno;
+
+    while (collect(WNOHANG | WUNTRACED | WCONTINUED) > 0)
+        ;
+    errno = saved;
+}
+
+void child_init()
+/*
+ * purpose: reap children asynchronously from now on
+ */
+{
+    struct sigaction sa;
+
+    sigemptyset(&chldset);
+    sigaddset(&chldset, SIGCHLD);
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    async = YES;
+    if (holds > 0)
+        sigprocmask(SIG_BLOCK, &chldset, NULL);
+}
+
+static int await()
+/*
+ * purpose: sleep until some child changes state; SIGCHLD is held
+ * returns: NO if there are no children left to wait for
+ */
+{
+    sigset_t mask;
+    pid_t pid;
+
+    if (!async)
+        return collect(0) != -1;
+    if ((pid = collect(WNOHANG | WUNTRACED | WCONTINUED)) != 0)
+        return pid != -1;
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    sigsuspend(&mask);			/* the handler does the reaping	*/
+    return YES;
+}
+
+static int take(struct child *c)
+{
+    if (child_done != NULL && c->state == C_DONE)
+        child_done(c->pid, c->status, &c->ru, c->end);
+    c->state = C_DELETED;
+    return c->status;
+}
+
+int child_wait(pid_t pid)
+/*
+ * purpose: wait for one registered child to finish or stop
+ * returns: its wait status, or -1 if smsh has no such child
+ *    note: a stopped child stays in the table (see child_cont)
+ */
+{
+    struct child *c;
+    int status;
+
+    child_hold();
+    for (;;) {
+        if ((c = slot(pid, NO)) == NULL) {
+            status = -1;
+            break;
+        }
+        if (c->state == C_DONE) {
+            status = take(c);
+            break;
+        }
+        if (c->state == C_STOPPED) {
+            status = c->status;
+            break;
+        }
+        if (!await()) {			/* lost it: nothing to wait for	*/
+            take(c);
+            status = -1;
+            break;
+        }
+    }
+    child_release();
+    return status;
+}
+
+int child_poll(pid_t pid, int *statusp)
+/*
+ * purpose: see whether a child has finished or stopped, without waiting
+ * returns: 1 with the wait status in *statusp if it has (a finished
+ *          child leaves the table), 0 if it is still running, -1 if
+ *          smsh has no such child
+ */
+{
+    struct child *c;
+    int rv = -1;
+
+    child_hold();
+    if (!async)
+        while (collect(WNOHANG) > 0)
+            ;
+    if ((c = slot(pid, NO)) != NULL) {
+        rv = c->state != C_RUNNING;
+        if (c->state == C_DONE)
+            *statusp = take(c);
+        else if (c->state == C_STOPPED)
+            *statusp = c->status;
+    }
+    child_release();
+    return rv;
+}
+
+void child_cont(pid_t pid)
+/*
+ * purpose: note that a stopped child was sent SIGCONT
+ */
+{
+    struct child *c;
+
+    child_hold();
+    if ((c = slot(pid, NO)) != NULL && c->state == C_STOPPED)
+        c->state = C_RUNNING;
+    child_release();
+}
+
+pid_t child_reap(int tag, int *statusp)
+/*
+ * purpose: wait until any child carrying tag finishes
+ * returns: its pid with the wait status in *statusp, or -1 when no
+ *          child with that tag is left
+ */
+{
+    int i, running;
+    pid_t pid = -1;
+
+    child_hold();
+    for (;;) {
+        running = NO;
+        for (i = 0; i < tsize; i++) {
+            if (table[i].tag != tag)
+                continue;
+            if (table[i].state == C_DONE) {
+                *statusp = take(&table[i]);
+                pid = table[i].pid;
+                break;
+            }
+            if (table[i].state == C_RUNNING || table[i].state == C_STOPPED)
+                running = YES;
+        }
+        if (pid != -1 || !running || !await())
+            break;
+    }
+    child_release();
+    return pid;
+}
+
+int exit_code(int status)
+/*
+ * purpose: turn a wait status into the number $? shows
+ * returns: the exit status, 128+signal for a killed child, or 127
+ *          when there was no child at all
+ */
+{
+    if (status == -1)
+        return 127;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 1;
+}
+
+void set_pipestatus(int *codes, int n)
+{
+    static int cap;
+
+    if (n > cap) {
+        cap = n;
+        pipestatus = erealloc(pipestatus, cap * sizeof(int));
+    }
+    memcpy(pipestatus, codes, n * sizeof(int));
+    npipestatus = n;
+    last_status = n > 0 ? codes[n - 1] : 0;
+}
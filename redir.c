@@ -0,0 +1,207 @@
+/* redir.c - the redirections of one stage: files, fd copies, heredocs
+ *
+ *    char *redir_target(struct arena *a, struct redir *r) - file name
+ *    int   redir_open(struct arena *a, struct redir *r)   - fd to use
+ *    int   redir_dupfd(a, r, struct spawn_plan *sp)       - n>&m's m
+ *    int   redir_plan(a, struct spawn_plan *sp, r)        - for a child
+ *    char *redir_op(struct redir *r)                      - for listings
+ *
+ *    Redirections are carried out in the order written, after the
+ *    pipes, so "> log 2>&1" sends both streams to log and "2>&1 > log"
+ *    only stdout.  > truncates; >> opens with O_APPEND, so writers
+ *    appending to the same log at once never overwrite each other;
+ *    &> and >& file are > file 2>&1 (the parser writes them so).
+ *
+ *    The text of a heredoc or here-string goes into a memfd, rewound,
+ *    which the command reads as its input: nothing is written to disk
+ *    or left to remove, the shell never blocks filling a pipe nobody
+ *    reads yet, and as a regular file it can be handed to the in-shell
+ *    cat (zcopy.c) for "cat <<EOF >> log".  Where memfd_create is
+ *    missing an unnamed O_TMPFILE file in /tmp is used instead.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	"smsh.h"
+
+static int open_flags(int op)
+{
+    if (op == R_IN)
+        return O_RDONLY;
+    if (op == R_APPEND)
+        return O_WRONLY | O_CREAT | O_APPEND;
+    return O_WRONLY | O_CREAT | O_TRUNC;
+}
+
+char *redir_target(struct arena *a, struct redir *r)
+/*
+ * purpose: the target word of r, with its parameters expanded
+ * returns: the text, or NULL (reported) if it is not exactly one word
+ */
+{
+    char **fields;
+
+    if (r->target.exp == NULL)
+        return r->target.text;
+    if (expand_word(a, &r->target, &fields) != 1) {
+        fprintf(stderr, "smsh: %s: ambiguous redirect\n", r->target.text);
+        return NULL;
+    }
+    return fields[0];
+}
+
+static int write_all(int fd, const char *s, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, s, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        s += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int here_fd(struct arena *a, struct redir *r)
+/*
+ * purpose: put a heredoc body or here-string in a memfd
+ * returns: the fd, close-on-exec and at offset 0, or -1 (reported)
+ *   notes: a here-string gets the newline a heredoc line ends with;
+ *          its expansion is one word, never split or globbed
+ */
+{
+    char *text = expand_string(a, &r->target);
+    int fd;
+
+    if ((fd = memfd_create("smsh-heredoc", MFD_CLOEXEC)) == -1
+        && (fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1) {
+        perror("smsh: heredoc");
+        return -1;
+    }
+    if (write_all(fd, text, strlen(text)) == -1)
+        goto fail;
+    if ((r->op == R_HERESTR && write_all(fd, "\n", 1) == -1)
+        || lseek(fd, 0, SEEK_SET) == -1)
+        goto fail;
+    return fd;
+fail:
+    perror("smsh: heredoc");
+    close(fd);
+    return -1;
+}
+
+int redir_open(struct arena *a, struct redir *r)
+/*
+ * purpose: open what a file, heredoc or here-string redirection reads
+ *          or writes
+ * returns: a new close-on-exec fd, or -1 (reported)
+ */
+{
+    char *path;
+    int fd;
+
+    if (r->op == R_HEREDOC || r->op == R_HERESTR)
+        return here_fd(a, r);
+    if ((path = redir_target(a, r)) == NULL)
+        return -1;
+    if ((fd = open(path, open_flags(r->op) | O_CLOEXEC, 0666)) == -1)
+        fprintf(stderr, "smsh: %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+int redir_dupfd(struct arena *a, struct redir *r, struct spawn_plan *sp)
+/*
+ * purpose: the descriptor an n>&m or n<&m copies
+ * returns: m, -1 for "-" (close n), or -2 (reported) if the target
+ *          is neither
+ *   notes: m must be open where the copy is made: in the child sp
+ *          plans for, or, with sp NULL, in the shell as its own
+ *          redirections have left it.  The shell's private fds are
+ *          close-on-exec and never count.
+ */
+{
+    char *s = redir_target(a, r), *end;
+    long m;
+    int flags;
+
+    if (s == NULL)
+        return -2;
+    if (strcmp(s, "-") == 0)
+        return -1;
+    m = strtol(s, &end, 10);
+    if (!isdigit((unsigned char)*s) || *end != '\0' || m > 1023
+        || (sp != NULL ? !spawn_hasfd(sp, (int)m)
+            : (flags = fcntl((int)m, F_GETFD)) == -1 || (flags & FD_CLOEXEC))) {
+        fprintf(stderr, "smsh: %s: bad file descriptor\n", s);
+        return -2;
+    }
+    return (int)m;
+}
+
+int redir_plan(struct arena *a, struct spawn_plan *sp, struct redir *r)
+/*
+ * purpose: add a stage's redirections to its launch plan, in order
+ * returns: 0, or -1 (reported) if one cannot be done; the stage must
+ *          then not be started
+ *   notes: files are opened here (spawn_open) and heredoc memfds are
+ *          made here, so a bad target is reported against its name and
+ *          not against the exec; spawn_free() closes them again
+ */
+{
+    char *path;
+    int fd;
+
+    for (; r != NULL; r = r->next) {
+        switch (r->op) {
+        case R_DUP:
+            if ((fd = redir_dupfd(a, r, sp)) == -2)
+                return -1;
+            if (fd == -1)
+                spawn_close(sp, r->fd);
+            else if (fd != r->fd)
+                spawn_dup2(sp, fd, r->fd);
+            break;
+        case R_HEREDOC:
+        case R_HERESTR:
+            if ((fd = here_fd(a, r)) == -1)
+                return -1;
+            if ((fd = spawn_owned(sp, fd)) == -1) {
+                perror("smsh: heredoc");
+                return -1;
+            }
+            spawn_dup2(sp, fd, r->fd);
+            break;
+        default:
+            if ((path = redir_target(a, r)) == NULL)
+                return -1;
+            if (spawn_open(sp, r->fd, path, open_flags(r->op), 0666) == -1) {
+                fprintf(stderr, "smsh: %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+char *redir_op(struct redir *r)
+/*
+ * purpose: the operator of r as it would be written (with no fd)
+ */
+{
+    static char *ops[] = { "<", ">", ">>", ">&", "<<", "<<<" };
+
+    if (r->op == R_DUP && r->fd == STDIN_FILENO)
+        return "<&";
+    return ops[r->op];
+}
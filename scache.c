@@ -0,0 +1,549 @@
+/* scache.c - compiled scripts: parse once, keep the trees on disk
+ *
+ *    struct script *script_open(char *path, int fd) - compiled form
+ *    void  script_run(struct script *, struct arena *) - run it
+ *    struct node *script_keep(struct node *n)      - a lasting copy of n
+ *
+ *    A script file is parsed whole before any of it runs, line by line
+ *    as usual (heredoc bodies included), and each line's command tree
+ *    is copied into one flat image in which pointers are offsets from
+ *    its start.  The image is written next to the script as
+ *    .name.smshc, under a header holding a hash of the script's text
+ *    mixed with the build of smsh that wrote it.  The next run of the
+ *    same text maps that file, turns the offsets back into pointers in
+ *    one walk of the trees, and runs them: the script is not read line
+ *    by line, split or parsed at all.
+ *
+ *    The same flattening, done in memory, is how a function's body
+ *    outlives the line (and arena) that defined it: script_keep().
+ *
+ *    Parsing never depends on what earlier lines did, so running the
+ *    trees in order is the same as reading and running line by line.
+ *    A script with a syntax error, or a heredoc cut off by the end of
+ *    the file, is not compiled; it runs the old way, with its error
+ *    reported when that line is reached.  An unwritable directory just
+ *    means no cache file: the trees are still run from memory.
+ *
+ *    A cache file is only used if it belongs to the user running the
+ *    script and nobody else can write it, and every offset and count
+ *    in it is checked against its size as it is loaded; one that fails
+ *    is compiled over, as if it were not there.
+ *
+ *    SMSH_SCRIPTCACHE=off in the environment turns this off, and
+ *    SMSH_SCRIPTCACHE=cold ignores any cache file and compiles the
+ *    script again (rewriting the file), so that cold and warm starts
+ *    can be timed against each other and against no cache.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdint.h>
+#include	<limits.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+#define	SC_MAGIC	"smshc\0\0\1"
+#define	SC_ALIGN	8
+
+struct sc_header {
+    char		magic[8];
+    uint64_t		key;		/* text and build hash		*/
+    uint64_t		srclen;
+    uint64_t		size;		/* of the whole image		*/
+    uint64_t		ntrees;
+    uint64_t		roots;		/* offset of the tree array	*/
+};
+
+struct script {
+    char		*image;		/* header, then everything else	*/
+    size_t		size;
+    int			ntrees;
+    struct node		**trees;	/* one per non-blank line	*/
+};
+
+struct image {				/* an image being built		*/
+    char		*buf;
+    size_t		len, cap;
+};
+
+/*
+ * keys
+ */
+
+static uint64_t hash(uint64_t h, const void *p, size_t n)
+{
+    const unsigned char *s = p;
+
+    while (n-- > 0)
+        h = (h ^ *s++) * 1099511628211ull;
+    return h;
+}
+
+static uint64_t script_key(const char *src, size_t len)
+/*
+ * purpose: the key a cache file for this text must carry
+ *   notes: the build time and the sizes of the tree structures go in
+ *          too, so a rebuilt smsh never trusts an older one's trees
+ */
+{
+    static const char build[] = __DATE__ " " __TIME__;
+    size_t sizes[] = { sizeof(struct node), sizeof(struct pipeline),
+                       sizeof(struct stage), sizeof(struct word),
+                       sizeof(struct redir) };
+    uint64_t h = 14695981039346656037ull;
+
+    h = hash(h, build, sizeof build);
+    h = hash(h, sizes, sizeof sizes);
+    return hash(h, src, len);
+}
+
+static int cache_name(char *buf, size_t size, const char *path)
+/*
+ * purpose: dir/name to dir/.name.smshc
+ * returns: 0, or -1 if that does not fit in buf
+ */
+{
+    const char *base = strrchr(path, '/');
+    int dirlen = base ? base - path + 1 : 0;
+    int n;
+
+    base = base ? base + 1 : path;
+    n = snprintf(buf, size, "%.*s.%s.smshc", dirlen, path, base);
+    return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+/*
+ * writing: each object is appended after what it points to, with its
+ * pointers replaced by offsets (0 stands for NULL, as the header is
+ * at offset 0)
+ */
+
+#define	OFF(o)	((void *)(uintptr_t)(o))
+
+static size_t put(struct image *im, const void *p, size_t n)
+/*
+ * purpose: append n bytes (or n zero bytes if p is NULL), aligned
+ * returns: their offset
+ */
+{
+    size_t off = (im->len + SC_ALIGN - 1) & ~(size_t)(SC_ALIGN - 1);
+
+    if (off + n > im->cap) {
+        im->cap = (off + n) * 2;
+        im->buf = erealloc(im->buf, im->cap);
+    }
+    memset(im->buf + im->len, 0, off - im->len);
+    if (p != NULL)
+        memcpy(im->buf + off, p, n);
+    else
+        memset(im->buf + off, 0, n);
+    im->len = off + n;
+    return off;
+}
+
+static size_t put_str(struct image *im, const char *s)
+{
+    return s ? put(im, s, strlen(s) + 1) : 0;
+}
+
+static size_t put_words(struct image *im, struct word *w, int n)
+{
+    struct word c;
+    size_t off;
+    int i;
+
+    if (w == NULL)
+        return 0;
+    off = put(im, NULL, n * sizeof c);
+    for (i = 0; i < n; i++) {
+        c.text = OFF(put_str(im, w[i].text));
+        c.pat = OFF(put_str(im, w[i].pat));
+        c.exp = OFF(put_str(im, w[i].exp));
+        memcpy(im->buf + off + i * sizeof c, &c, sizeof c);
+    }
+    return off;
+}
+
+static size_t put_redirs(struct image *im, struct redir *r)
+{
+    struct redir c;
+
+    if (r == NULL)
+        return 0;
+    c = *r;
+    c.next = OFF(put_redirs(im, r->next));
+    c.target.text = OFF(put_str(im, r->target.text));
+    c.target.pat = OFF(put_str(im, r->target.pat));
+    c.target.exp = OFF(put_str(im, r->target.exp));
+    return put(im, &c, sizeof c);
+}
+
+static size_t put_node(struct image *, struct node *);
+
+static void put_stage(struct image *im, struct stage *st, size_t at)
+/*
+ * purpose: fill in the stage at offset at
+ *   notes: argv shares its strings with words, as in the parser's tree
+ */
+{
+    struct stage c = *st;
+    struct word *w;
+    char **argv;
+    size_t av;
+    int i;
+
+    c.body = OFF(put_node(im, st->body));
+    c.words = OFF(put_words(im, st->words, st->argc));
+    c.assigns = OFF(put_words(im, st->assigns, st->nassign));
+    c.redirs = OFF(put_redirs(im, st->redirs));
+    av = put(im, NULL, (st->argc + 1) * sizeof(char *));
+    w = (struct word *)(im->buf + (uintptr_t)c.words);
+    argv = (char **)(im->buf + av);
+    for (i = 0; i < st->argc; i++)
+        argv[i] = w[i].text;
+    c.argv = OFF(av);
+    memcpy(im->buf + at, &c, sizeof c);
+}
+
+static size_t put_node(struct image *im, struct node *n)
+{
+    struct pipeline pl;
+    struct node c;
+    size_t st, fan;
+    void *f;
+    int i;
+
+    if (n == NULL)
+        return 0;
+    c = *n;
+    c.left = OFF(put_node(im, n->left));
+    c.right = OFF(put_node(im, n->right));
+    c.other = OFF(put_node(im, n->other));
+    c.name = OFF(put_str(im, n->name));
+    if (n->pl != NULL) {
+        pl = *n->pl;
+        st = put(im, NULL, pl.nstages * sizeof(struct stage));
+        for (i = 0; i < pl.nstages; i++)
+            put_stage(im, &n->pl->stages[i], st + i * sizeof(struct stage));
+        pl.stages = OFF(st);
+        if (pl.nfan > 0) {
+            fan = put(im, NULL, pl.nfan * sizeof(struct node *));
+            for (i = 0; i < pl.nfan; i++) {
+                f = OFF(put_node(im, n->pl->fan[i]));
+                memcpy(im->buf + fan + i * sizeof f, &f, sizeof f);
+            }
+            pl.fan = OFF(fan);
+        }
+        c.pl = OFF(put(im, &pl, sizeof pl));
+    }
+    return put(im, &c, sizeof c);
+}
+
+/*
+ * loading: offsets back to pointers, each checked against the image
+ */
+
+static int fix(struct script *sc, void *pp, size_t n)
+/*
+ * purpose: turn the offset in the pointer at pp into a pointer to n
+ *          bytes (a string's n is 1: the image ends in a NUL)
+ * returns: 0, or -1 if they are not all inside the image or the offset
+ *          is not one put() could have made
+ */
+{
+    void **p = pp;
+    uintptr_t off = (uintptr_t)*p;
+
+    if (off == 0)
+        return 0;
+    if (off % SC_ALIGN != 0 || off >= sc->size || n > sc->size - off)
+        return -1;
+    *p = sc->image + off;
+    return 0;
+}
+
+static int fix_array(struct script *sc, void *pp, long count, size_t each)
+/*
+ * purpose: fix the pointer at pp to count objects of each bytes
+ * returns: 0, or -1 if count is negative, or there are some but no
+ *          array, or the array does not fit in the image
+ */
+{
+    if (count < 0 || (count > 0 && (*(void **)pp == NULL
+                                    || (size_t)count > sc->size / each)))
+        return -1;
+    return fix(sc, pp, count * each);
+}
+
+static int fix_words(struct script *sc, struct word *w, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (fix(sc, &w[i].text, 1) || fix(sc, &w[i].pat, 1) || fix(sc, &w[i].exp, 1)
+            || w[i].text == NULL)
+            return -1;
+    return 0;
+}
+
+static int fix_node(struct script *sc, struct node *n)
+/*
+ * purpose: fix every pointer in the tree at n
+ * returns: 0, or -1 if any is bad
+ *   notes: a pointer already fixed is no offset into the image, so a
+ *          damaged image that shares or loops back to an object fails
+ *          here rather than running forever
+ */
+{
+    struct pipeline *pl;
+    struct stage *st;
+    struct redir *r;
+    int i, j;
+
+    if (n->type < N_PIPE || n->type > N_FUNC
+        || fix(sc, &n->left, sizeof(struct node)) || fix(sc, &n->right, sizeof(struct node))
+        || fix(sc, &n->other, sizeof(struct node)) || fix(sc, &n->name, 1)
+        || fix(sc, &n->pl, sizeof(struct pipeline)))
+        return -1;
+    if ((n->left && fix_node(sc, n->left)) || (n->right && fix_node(sc, n->right))
+        || (n->other && fix_node(sc, n->other)))
+        return -1;
+    if ((pl = n->pl) == NULL)
+        return 0;
+    if (pl->nstages < 1 || fix_array(sc, &pl->stages, pl->nstages, sizeof(struct stage))
+        || fix_array(sc, &pl->fan, pl->nfan, sizeof(struct node *)))
+        return -1;
+    for (i = 0; i < pl->nfan; i++)
+        if (pl->fan[i] == NULL || fix(sc, &pl->fan[i], sizeof(struct node))
+            || fix_node(sc, pl->fan[i]))
+            return -1;
+    for (i = 0; i < pl->nstages; i++) {
+        st = &pl->stages[i];
+        if (st->argc < 0 || st->argv == NULL
+            || fix_array(sc, &st->words, st->argc, sizeof(struct word))
+            || fix_array(sc, &st->assigns, st->nassign, sizeof(struct word))
+            || fix_array(sc, &st->argv, st->argc + 1L, sizeof(char *))
+            || fix(sc, &st->redirs, sizeof(struct redir))
+            || fix(sc, &st->body, sizeof(struct node)))
+            return -1;
+        if (st->body && fix_node(sc, st->body))
+            return -1;
+        if (fix_words(sc, st->words, st->argc) || fix_words(sc, st->assigns, st->nassign))
+            return -1;
+        for (j = 0; j < st->argc; j++)
+            st->argv[j] = st->words[j].text;
+        st->argv[st->argc] = NULL;
+        for (r = st->redirs; r != NULL; r = r->next)
+            if (r->op < R_IN || r->op > R_HERESTR || r->fd < 0
+                || fix(sc, &r->next, sizeof(struct redir)) || fix_words(sc, &r->target, 1))
+                return -1;
+    }
+    return 0;
+}
+
+static struct script *relocate(char *image, size_t size)
+/*
+ * purpose: make a script of an image, in place
+ * returns: it, or NULL if the image is damaged
+ */
+{
+    struct sc_header *h = (struct sc_header *)image;
+    struct script *sc = emalloc(sizeof(struct script));
+    uint64_t i;
+
+    sc->image = image;
+    sc->size = size;
+    sc->ntrees = h->ntrees;
+    sc->trees = (struct node **)(uintptr_t)h->roots;
+    if (image[size - 1] != '\0' || h->ntrees > INT_MAX
+        || fix_array(sc, &sc->trees, h->ntrees, sizeof(struct node *))) {
+        free(sc);
+        return NULL;
+    }
+    for (i = 0; i < h->ntrees; i++)
+        if (sc->trees[i] == NULL || fix(sc, &sc->trees[i], sizeof(struct node))
+            || fix_node(sc, sc->trees[i])) {
+            free(sc);
+            return NULL;
+        }
+    return sc;
+}
+
+static struct script *load(char *cpath, uint64_t key, size_t srclen)
+/*
+ * purpose: map the cache file cpath if it holds this script
+ * returns: the script, or NULL if there is no usable cache
+ */
+{
+    struct sc_header *h;
+    struct script *sc;
+    struct stat st;
+    void *p;
+    int fd;
+
+    if ((fd = open(cpath, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof *h
+        || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        close(fd);			/* trees from someone else: no	*/
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    h = p;
+    if (memcmp(h->magic, SC_MAGIC, 8) != 0 || h->key != key
+        || h->srclen != srclen || h->size != (uint64_t)st.st_size
+        || (sc = relocate(p, st.st_size)) == NULL) {
+        munmap(p, st.st_size);
+        return NULL;
+    }
+    return sc;
+}
+
+static void save(char *cpath, struct image *im)
+/*
+ * purpose: write the image to cpath, replacing any old one whole
+ *   notes: failure is silent; the script just runs uncached
+ */
+{
+    char tmp[4096];
+    int fd, ok;
+
+    if (snprintf(tmp, sizeof tmp, "%s.%d", cpath, (int)getpid()) >= (int)sizeof tmp)
+        return;
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1)
+        return;
+    ok = write(fd, im->buf, im->len) == (ssize_t)im->len;
+    if (close(fd) == -1 || !ok || rename(tmp, cpath) == -1)
+        unlink(tmp);
+}
+
+static struct script *compile(int fd, uint64_t key, size_t srclen, char *cpath)
+/*
+ * purpose: parse the whole script on fd into an image, save it, and
+ *          make a script of it
+ * returns: the script, or NULL if some line does not parse
+ */
+{
+    struct image im = { NULL, 0, 0 };
+    struct sc_header h;
+    struct reader *rd;
+    struct arena a;
+    struct node *tree;
+    size_t *roots = NULL;
+    int n = 0, cap = 0, bad = NO;
+    char *line;
+
+    if ((rd = rd_open(fd)) == NULL)
+        return NULL;
+    arena_init(&a);
+    put(&im, NULL, sizeof h);
+    parse_quiet = YES;
+    parse_errors = 0;
+    while (!bad && (line = rd_line(rd, NULL)) != NULL) {
+        tree = parse_lines(&a, line, rd, NULL);
+        bad = parse_errors > 0 || parse_heredocs(&a, rd, NULL) == -1;
+        if (tree != NULL && !bad) {
+            if (n == cap) {
+                cap = cap ? 2 * cap : 64;
+                roots = erealloc(roots, cap * sizeof *roots);
+            }
+            roots[n++] = put_node(&im, tree);
+        }
+        arena_reset(&a);
+    }
+    parse_quiet = NO;
+    arena_free(&a);
+    rd_close(rd);
+    lseek(fd, 0, SEEK_SET);		/* in case it was read, not mapped */
+    if (bad) {
+        free(roots);
+        free(im.buf);
+        return NULL;
+    }
+    memcpy(h.magic, SC_MAGIC, 8);
+    h.key = key;
+    h.srclen = srclen;
+    h.ntrees = n;
+    h.roots = put(&im, roots, n * sizeof *roots);
+    put(&im, "", 1);			/* strings all end in the image	*/
+    h.size = im.len;
+    memcpy(im.buf, &h, sizeof h);
+    free(roots);
+    if (cpath != NULL)
+        save(cpath, &im);
+    return relocate(im.buf, im.len);
+}
+
+struct script *script_open(char *path, int fd)
+/*
+ * purpose: the compiled form of the script open on fd, loaded from
+ *          its cache file or made (and saved) now
+ * returns: it, or NULL to read the script line by line instead
+ *   notes: fd is left at its offset; the script's text is mapped
+ *          only long enough to hash it
+ */
+{
+    char *mode = getenv("SMSH_SCRIPTCACHE"), cpath[4096], *src;
+    struct script *sc = NULL;
+    struct stat st;
+    uint64_t key;
+
+    if (mode != NULL && strcmp(mode, "off") == 0)
+        return NULL;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || lseek(fd, 0, SEEK_CUR) != 0)
+        return NULL;
+    src = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src == MAP_FAILED)
+        return NULL;
+    key = script_key(src, st.st_size);
+    munmap(src, st.st_size);
+    if (cache_name(cpath, sizeof cpath, path) == -1)
+        return compile(fd, key, st.st_size, NULL);
+    if (mode == NULL || strcmp(mode, "cold") != 0)
+        sc = load(cpath, key, st.st_size);
+    return sc ? sc : compile(fd, key, st.st_size, cpath);
+}
+
+struct node *script_keep(struct node *n)
+/*
+ * purpose: copy the tree n, which lives in a line's arena, into one
+ *          block of its own
+ * returns: the copy, which is never freed
+ */
+{
+    struct image im = { NULL, 0, 0 };
+    struct script sc;
+    struct node *root;
+
+    put(&im, NULL, SC_ALIGN);		/* offset 0 stays NULL		*/
+    root = OFF(put_node(&im, n));
+    put(&im, "", 1);
+    sc.image = im.buf;
+    sc.size = im.len;
+    fix(&sc, &root, sizeof(struct node));
+    fix_node(&sc, root);
+    return root;
+}
+
+void script_run(struct script *sc, struct arena *arena)
+/*
+ * purpose: run each line's tree in turn, as the main loop would
+ */
+{
+    int i;
+
+    for (i = 0; i < sc->ntrees; i++) {
+        prof_mark();
+        run_node(arena, sc->trees[i]);
+        arena_reset(arena);
+    }
+}
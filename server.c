@@ -0,0 +1,354 @@
+/* server.c - smsh as a command server on a Unix socket
+ *
+ *    char *server_run(char *path, int n)       - serve; returns in a worker
+ *    int   server_send(char *path, char *cmd)  - run cmd on a server
+ *
+ *    "smsh4 --server /path.sock [N]" binds a SOCK_SEQPACKET socket at
+ *    path and keeps N workers (default: the online CPUs) forked and
+ *    waiting, each a copy of a shell that has already started.  The
+ *    server accepts each connection and hands it to an idle worker
+ *    over the worker's own socket pair (SCM_RIGHTS).  The worker reads
+ *    the request and returns from server_run() to run the command as
+ *    "smsh4 -c" would, then exits; the server, which kept its copy of
+ *    the connection, sends back the exit status the worker's wait
+ *    status gives, whatever ended it, and forks a fresh worker in its
+ *    place.  So a task costs a socket round trip, with no fork or exec
+ *    on the way, and no task sees what another left behind (a cd,
+ *    variables, functions): each has a worker to itself.
+ *
+ *    Protocol, one message each way on a SOCK_SEQPACKET connection:
+ *
+ *        request: the command text with its NUL, carrying up to four
+ *                 descriptors (SCM_RIGHTS): the task's stdin, stdout
+ *                 and stderr, and a directory to run it in; any of the
+ *                 three not sent is /dev/null, and without a directory
+ *                 it runs in the server's
+ *        reply:   the exit status in decimal, as $? would show it
+ *
+ *    Tasks get the server's environment.  "smsh4 --client /path.sock
+ *    cmd" sends cmd with its own stdin, stdout, stderr and directory
+ *    and exits with the status that comes back, for scripts and
+ *    tests.  SIGTERM or SIGINT stops the server: the workers are
+ *    killed and the socket removed.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<poll.h>
+#include	<signal.h>
+#include	<unistd.h>
+#include	<sys/socket.h>
+#include	<sys/syscall.h>
+#include	<sys/un.h>
+#include	<sys/wait.h>
+#include	"smsh.h"
+
+#define	SV_MAXFDS	4		/* stdin, stdout, stderr, directory */
+
+struct worker {
+    pid_t		pid;
+    int			pidfd;		/* readable once it has exited	*/
+    int			sock;		/* the server's end of its pair	*/
+    int			conn;		/* the connection it has, or -1	*/
+};
+
+static struct worker	*workers;
+static int		nworkers;
+static int		listen_fd = -1;
+static sigset_t		open_mask;	/* the mask to poll and run with */
+static volatile sig_atomic_t	stopping;
+
+static void on_stop(int sig)
+{
+    stopping = YES;
+}
+
+static int send_fds(int sock, char *buf, size_t len, int *fds, int nfds)
+/*
+ * purpose: send one message carrying nfds descriptors
+ * returns: 0, or -1 with errno set
+ */
+{
+    union {
+        struct cmsghdr	h;
+        char		space[CMSG_SPACE(SV_MAXFDS * sizeof(int))];
+    } u;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *c;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = u.space;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1)
+        if (errno != EINTR)
+            return -1;
+    return 0;
+}
+
+static ssize_t recv_fds(int sock, char *buf, size_t len, int *fds, int *nfds)
+/*
+ * purpose: receive one message and the descriptors it carries
+ * returns: its length, 0 at the end, or -1 with errno set
+ *   notes: up to SV_MAXFDS descriptors go in fds, close-on-exec, and
+ *          their number in *nfds; the kernel closes any more
+ */
+{
+    union {
+        struct cmsghdr	h;
+        char		space[CMSG_SPACE(SV_MAXFDS * sizeof(int))];
+    } u;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *c;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.space;
+    msg.msg_controllen = sizeof u.space;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    *nfds = 0;
+    for (c = n == -1 ? NULL : CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            *nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), *nfds * sizeof(int));
+        }
+    return n;
+}
+
+static char *serve_one(int sock)
+/*
+ * purpose: in a worker: wait for a connection, read its request and
+ *          make the descriptors that came with it the shell's own
+ * returns: the command
+ *   notes: exits if the server goes away first, or the request is bad
+ */
+{
+    int conn[SV_MAXFDS], fds[SV_MAXFDS], nfds, i, fd;
+    char c, *cmd;
+    ssize_t len;
+
+    if (recv_fds(sock, &c, 1, conn, &nfds) <= 0 || nfds != 1)
+        _exit(0);
+    close(sock);
+    if ((len = recv(conn[0], NULL, 0, MSG_PEEK | MSG_TRUNC)) <= 0)
+        _exit(2);
+    cmd = emalloc(len + 1);
+    if (recv_fds(conn[0], cmd, len, fds, &nfds) != len)
+        _exit(2);
+    cmd[len] = '\0';			/* it came with one; be sure	*/
+    close(conn[0]);
+    for (i = 0; i < 3; i++) {
+        fd = i < nfds ? fds[i] : open("/dev/null", O_RDWR);
+        if (fd != i) {
+            dup2(fd, i);
+            close(fd);
+        }
+    }
+    if (nfds > 3 && fchdir(fds[3]) == -1) {
+        perror("smsh: server: directory");
+        _exit(1);
+    }
+    if (nfds > 3)
+        close(fds[3]);
+    return cmd;
+}
+
+static char *start_worker(struct worker *w)
+/*
+ * purpose: fork a worker into slot w
+ * returns: NULL in the server; in the worker, the command it is to run
+ */
+{
+    int sv[2], i;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("smsh: server: socketpair");
+        exit(1);
+    }
+    fflush(stdout);
+    if ((pid = fork()) == -1) {
+        perror("smsh: server: fork");
+        exit(1);
+    }
+    if (pid == 0) {			/* nothing of the server's stays */
+        shell_pid = getpid();		/* a shell of its own, not a subshell */
+        signal(SIGTERM, SIG_DFL);	/* then a pending one kills it	*/
+        signal(SIGINT, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &open_mask, NULL);
+        close(listen_fd);
+        close(sv[0]);
+        for (i = 0; i < nworkers; i++) {
+            if (&workers[i] == w)
+                continue;
+            close(workers[i].pidfd);
+            close(workers[i].sock);
+            if (workers[i].conn != -1)
+                close(workers[i].conn);
+        }
+        return serve_one(sv[1]);
+    }
+    close(sv[1]);
+    w->pid = pid;
+    w->sock = sv[0];
+    w->conn = -1;
+    if ((w->pidfd = syscall(SYS_pidfd_open, pid, 0)) == -1) {
+        perror("smsh: server: pidfd_open");
+        exit(1);
+    }
+    return NULL;
+}
+
+static void finish(struct worker *w)
+/*
+ * purpose: reap the worker in w, which has exited, and answer its
+ *          connection with its status
+ */
+{
+    char reply[16];
+    int status;
+
+    while (waitpid(w->pid, &status, 0) == -1 && errno == EINTR)
+        ;
+    if (w->conn != -1) {
+        snprintf(reply, sizeof reply, "%d", exit_code(status));
+        send(w->conn, reply, strlen(reply), MSG_NOSIGNAL);
+        close(w->conn);
+    }
+    close(w->pidfd);
+    close(w->sock);
+}
+
+char *server_run(char *path, int n)
+/*
+ * purpose: serve commands on a socket at path with n workers (0: one
+ *          per online CPU) until SIGTERM or SIGINT
+ * returns: only in a worker, with the command it is to run; the server
+ *          itself exits
+ */
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct pollfd *pfd;
+    char *cmd;
+    int i, idle, conn;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "smsh: %s: socket path too long\n", path);
+        exit(2);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1
+        || bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) == -1
+        || listen(listen_fd, SOMAXCONN) == -1) {
+        perror(path);
+        exit(1);
+    }
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;			/* ppoll() is to return EINTR	*/
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigemptyset(&sa.sa_mask);		/* taken only inside ppoll()	*/
+    sigaddset(&sa.sa_mask, SIGTERM);
+    sigaddset(&sa.sa_mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &sa.sa_mask, &open_mask);
+
+    if ((nworkers = n) <= 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+        nworkers = 1;
+    workers = emalloc(nworkers * sizeof(struct worker));
+    for (i = 0; i < nworkers; i++)
+        workers[i].pidfd = workers[i].sock = workers[i].conn = -1;
+    for (i = 0; i < nworkers; i++)
+        if ((cmd = start_worker(&workers[i])) != NULL)
+            return cmd;
+
+    /* the workers' pidfds, then the socket while a worker is idle */
+    pfd = emalloc((nworkers + 1) * sizeof(struct pollfd));
+    while (!stopping) {
+        for (idle = -1, i = 0; i < nworkers; i++) {
+            pfd[i].fd = workers[i].pidfd;
+            pfd[i].events = POLLIN;
+            if (idle == -1 && workers[i].conn == -1)
+                idle = i;
+        }
+        pfd[nworkers].fd = idle != -1 ? listen_fd : -1;
+        pfd[nworkers].events = POLLIN;
+        if (ppoll(pfd, nworkers + 1, NULL, &open_mask) == -1)
+            continue;
+        for (i = 0; i < nworkers; i++) {
+            if (pfd[i].revents == 0)
+                continue;
+            finish(&workers[i]);
+            if ((cmd = start_worker(&workers[i])) != NULL)
+                return cmd;
+        }
+        if (idle == -1 || pfd[nworkers].revents == 0
+            || (conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+            continue;
+        if (send_fds(workers[idle].sock, "c", 1, &conn, 1) == -1)
+            close(conn);		/* the worker is gone: try again */
+        else
+            workers[idle].conn = conn;
+    }
+
+    for (i = 0; i < nworkers; i++)
+        kill(workers[i].pid, SIGTERM);
+    for (i = 0; i < nworkers; i++)
+        finish(&workers[i]);
+    unlink(path);
+    exit(0);
+}
+
+int server_send(char *path, char *cmd)
+/*
+ * purpose: run cmd on the server at path, with this process's stdin,
+ *          stdout, stderr and current directory
+ * returns: its exit status, or 2 if there was no server to run it
+ */
+{
+    struct sockaddr_un addr;
+    int fd, fds[SV_MAXFDS] = { 0, 1, 2, -1 }, nfds = 3;
+    char reply[16];
+    ssize_t n;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+    if ((fds[3] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC)) != -1)
+        nfds = 4;
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1
+        || connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1
+        || send_fds(fd, cmd, strlen(cmd) + 1, fds, nfds) == -1) {
+        perror(path);
+        return 2;
+    }
+    while ((n = recv(fd, reply, sizeof reply - 1, 0)) == -1 && errno == EINTR)
+        ;
+    if (n <= 0) {
+        fprintf(stderr, "smsh: %s: no reply from the server\n", path);
+        return 2;
+    }
+    reply[n] = '\0';
+    return atoi(reply);
+}
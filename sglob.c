@@ -0,0 +1,533 @@
+/* sglob.c - pathname expansion for smsh over cached directory listings
+ *
+ *    char **sglob(struct arena *a, char *pat, int *np) - expand pat
+ *    int    gmatch(const char *pat, const char *s)    - match one name
+ *
+ *    A pattern is split at '/' and walked one component at a time.
+ *    Components without wildcards are joined on without reading
+ *    anything; the others are matched with gmatch() against the names
+ *    of the directory so far.  Matches go straight into an arena
+ *    vector in sorted order, so nothing is copied or sorted twice.
+ *
+ *    Each directory listing read is kept, keyed by the directory's
+ *    device and inode and valid while its mtime is unchanged, so
+ *    "rm *.o" in a directory of 200k files reads it once and later
+ *    lines only stat it.  A listing read within a second of the
+ *    directory's last change may have missed a later change in the
+ *    same timestamp tick; it is marked racy and read again next time.
+ *    The cache is emptied when it grows past SG_CACHE bytes.
+ *
+ *    A "**" component matches any number of directories, none
+ *    included; that part of the pattern is handed to gstar(), which
+ *    walks the whole tree at once on a pool of threads.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<dirent.h>
+#include	<time.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+#define	SG_CACHE	(64 << 20)	/* bytes of listings kept	*/
+
+struct dname {
+    char		*name;
+    unsigned char	type;		/* d_type, DT_UNKNOWN if unsure	*/
+};
+
+struct dlist {
+    dev_t		dev;
+    ino_t		ino;
+    struct timespec	mtime;
+    int			racy;		/* read too close to a change	*/
+    int			n;
+    struct dname	*ents;		/* sorted by name		*/
+    char		*pool;		/* the names themselves		*/
+    size_t		bytes;
+    struct dlist	*next;		/* hash chain			*/
+};
+
+static struct dlist	**cache;	/* buckets, power of two	*/
+static int		nbucket, ncached;
+static size_t		cached_bytes;
+
+struct gstate {
+    struct arena	*a;
+    char		**v;		/* matches so far		*/
+    int			n, cap;
+    int			sorted;		/* v is in order so far		*/
+    char		*path;		/* directory being walked	*/
+    size_t		pcap;
+};
+
+/* matching */
+
+static const char *bracket(const char *p, int c)
+/*
+ * purpose: match c against the bracket expression at p (after '[')
+ * returns: pointer past the closing ']' if c matches, NULL if not,
+ *          and p - 1 itself if there is no closing ']' (so the '['
+ *          is an ordinary character)
+ */
+{
+    const char *start = p;
+    int neg = NO, ok = NO, lo, hi;
+    static const struct { char *name; int (*fn)(int); } cls[] = {
+        { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+        { "upper", isupper }, { "lower", islower }, { "space", isspace },
+        { "punct", ispunct }, { "xdigit", isxdigit }, { NULL, NULL }
+    };
+    int i;
+    size_t len;
+
+    if (*p == '!' || *p == '^') {
+        neg = YES;
+        p++;
+    }
+    if (*p == ']') {			/* a leading ] is literal	*/
+        ok = (c == ']');
+        p++;
+    }
+    while (*p != ']') {
+        if (*p == '\0')
+            return start - 1;
+        if (p[0] == '[' && p[1] == ':') {
+            for (i = 0; cls[i].name != NULL; i++) {
+                len = strlen(cls[i].name);
+                if (strncmp(p + 2, cls[i].name, len) == 0
+                    && strncmp(p + 2 + len, ":]", 2) == 0)
+                    break;
+            }
+            if (cls[i].name != NULL) {
+                ok |= cls[i].fn((unsigned char)c) != 0;
+                p += len + 4;
+                continue;
+            }
+        }
+        if (*p == '\\' && p[1] != '\0')
+            p++;
+        lo = (unsigned char)*p++;
+        hi = lo;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            if (*++p == '\\' && p[1] != '\0')
+                p++;
+            hi = (unsigned char)*p++;
+        }
+        if (c >= lo && c <= hi)
+            ok = YES;
+    }
+    return ok != neg ? p + 1 : NULL;
+}
+
+int gmatch(const char *pat, const char *s)
+/*
+ * purpose: match one name against a pattern of * ? [...] and \x
+ * returns: YES or NO
+ *   notes: only the last * is ever backtracked to, so the cost stays
+ *          close to linear in the length of s
+ */
+{
+    const char *star = NULL, *ss = NULL, *q;
+
+    for (;;) {
+        switch (*pat) {
+        case '\0':
+            if (*s == '\0')
+                return YES;
+            break;
+        case '*':
+            while (*pat == '*')
+                pat++;
+            if (*pat == '\0')
+                return YES;
+            star = pat;
+            ss = s;
+            continue;
+        case '?':
+            if (*s != '\0') {
+                pat++;
+                s++;
+                continue;
+            }
+            break;
+        case '[':
+            if (*s == '\0')
+                break;
+            if ((q = bracket(pat + 1, (unsigned char)*s)) == pat) {
+                if (*s == '[') {		/* unclosed: a plain [	*/
+                    pat++;
+                    s++;
+                    continue;
+                }
+                break;
+            }
+            if (q != NULL) {
+                pat = q;
+                s++;
+                continue;
+            }
+            break;
+        case '\\':
+            if (pat[1] != '\0')
+                pat++;
+            /* fall through */
+        default:
+            if (*pat == *s) {
+                pat++;
+                s++;
+                continue;
+            }
+            break;
+        }
+        if (star == NULL || *ss == '\0')	/* no * to give more to	*/
+            return NO;
+        pat = star;
+        s = ++ss;
+    }
+}
+
+static int has_meta(const char *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (p[i] == '\\' && i + 1 < n)
+            i++;
+        else if (p[i] == '*' || p[i] == '?' || p[i] == '[')
+            return YES;
+    }
+    return NO;
+}
+
+/* the listing cache */
+
+static int cmp_dname(const void *a, const void *b)
+{
+    return strcmp(((const struct dname *)a)->name, ((const struct dname *)b)->name);
+}
+
+static void drop_all()
+{
+    struct dlist *d, *next;
+    int i;
+
+    for (i = 0; i < nbucket; i++) {
+        for (d = cache[i]; d != NULL; d = next) {
+            next = d->next;
+            free(d->ents);
+            free(d->pool);
+            free(d);
+        }
+        cache[i] = NULL;
+    }
+    ncached = 0;
+    cached_bytes = 0;
+}
+
+static struct dlist **bucket(dev_t dev, ino_t ino)
+{
+    unsigned long h = (unsigned long)ino * 2654435761u ^ (unsigned long)dev;
+    struct dlist **old = cache, *d, *next;
+    int oldn = nbucket, i;
+
+    if (ncached >= nbucket) {		/* keep chains short		*/
+        nbucket = nbucket ? nbucket * 2 : 64;
+        cache = emalloc(nbucket * sizeof(struct dlist *));
+        memset(cache, 0, nbucket * sizeof(struct dlist *));
+        for (i = 0; i < oldn; i++)
+            for (d = old[i]; d != NULL; d = next) {
+                next = d->next;
+                d->next = *bucket(d->dev, d->ino);
+                *bucket(d->dev, d->ino) = d;
+            }
+        free(old);
+    }
+    return &cache[h & (nbucket - 1)];
+}
+
+static int fill(struct dlist *d, char *dir)
+/*
+ * purpose: read dir's names into d, sorted
+ * returns: YES, or NO if the directory cannot be read
+ */
+{
+    DIR *dp;
+    struct dirent *e;
+    struct timespec now;
+    size_t used = 0, pcap = 4096, len;
+    int cap = 64, i;
+
+    if ((dp = opendir(*dir ? dir : ".")) == NULL)
+        return NO;
+    clock_gettime(CLOCK_REALTIME, &now);
+    d->racy = now.tv_sec <= d->mtime.tv_sec + 1;
+    d->n = 0;
+    d->ents = emalloc(cap * sizeof(struct dname));
+    d->pool = emalloc(pcap);
+    while ((e = readdir(dp)) != NULL) {
+        if (e->d_name[0] == '.' && (e->d_name[1] == '\0'
+            || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+            continue;
+        len = strlen(e->d_name) + 1;
+        if (used + len > pcap) {
+            pcap = (used + len) * 2;
+            d->pool = erealloc(d->pool, pcap);
+        }
+        if (d->n == cap) {
+            cap *= 2;
+            d->ents = erealloc(d->ents, cap * sizeof(struct dname));
+        }
+        memcpy(d->pool + used, e->d_name, len);
+        d->ents[d->n].name = (char *)used;	/* offset until the end	*/
+        d->ents[d->n++].type = e->d_type;
+        used += len;
+    }
+    closedir(dp);
+    for (i = 0; i < d->n; i++)
+        d->ents[i].name = d->pool + (size_t)d->ents[i].name;
+    qsort(d->ents, d->n, sizeof(struct dname), cmp_dname);
+    d->bytes = used + d->n * sizeof(struct dname);
+    return YES;
+}
+
+static struct dlist *listing(char *dir)
+/*
+ * purpose: the sorted names in dir ("" is the current directory)
+ * returns: the cached listing, read again if dir has changed, or
+ *          NULL if dir is not a readable directory
+ */
+{
+    struct stat st;
+    struct dlist *d, **bp;
+
+    if (stat(*dir ? dir : ".", &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+    for (d = cache ? *bucket(st.st_dev, st.st_ino) : NULL; d != NULL; d = d->next)
+        if (d->dev == st.st_dev && d->ino == st.st_ino)
+            break;
+    if (d != NULL && !d->racy && d->mtime.tv_sec == st.st_mtim.tv_sec
+        && d->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return d;
+    if (d != NULL) {			/* stale: read it again in place */
+        cached_bytes -= d->bytes;
+        free(d->ents);
+        free(d->pool);
+    } else {
+        if (cached_bytes > SG_CACHE)
+            drop_all();
+        d = emalloc(sizeof(struct dlist));
+        d->dev = st.st_dev;
+        d->ino = st.st_ino;
+        bp = bucket(st.st_dev, st.st_ino);
+        d->next = *bp;
+        *bp = d;
+        ncached++;
+    }
+    d->mtime = st.st_mtim;
+    if (!fill(d, dir)) {
+        d->n = 0;			/* searchable but not readable	*/
+        d->ents = NULL;
+        d->pool = NULL;
+        d->bytes = 0;
+        d->racy = YES;
+        return NULL;
+    }
+    cached_bytes += d->bytes;
+    return d;
+}
+
+/* the walk */
+
+static void add(struct gstate *g, char *s)
+{
+    char **nv;
+
+    if (g->n > 0 && strcmp(g->v[g->n - 1], s) > 0)
+        g->sorted = NO;
+    if (g->n + 1 >= g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 64;
+        nv = arena_alloc(g->a, g->cap * sizeof(char *));
+        if (g->n > 0)
+            memcpy(nv, g->v, g->n * sizeof(char *));
+        g->v = nv;
+    }
+    g->v[g->n++] = s;
+}
+
+static void emit(struct gstate *g, size_t len)
+{
+    add(g, arena_strndup(g->a, g->path, len));
+}
+
+static size_t put(struct gstate *g, size_t at, const char *s, size_t n)
+/*
+ * purpose: write s[0..n) into the path buffer at offset at
+ * returns: the new length
+ */
+{
+    if (at + n + 2 > g->pcap) {
+        g->pcap = (at + n + 2) * 2;
+        g->path = erealloc(g->path, g->pcap);
+    }
+    memcpy(g->path + at, s, n);
+    g->path[at + n] = '\0';
+    return at + n;
+}
+
+static size_t unescape(struct gstate *g, size_t at, const char *s, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (s[i] == '\\' && i + 1 < n)
+            i++;
+        at = put(g, at, s + i, 1);
+    }
+    return at;
+}
+
+static int is_dir(struct gstate *g, struct dname *e)
+{
+    struct stat st;
+
+    if (e->type == DT_DIR)
+        return YES;
+    if (e->type != DT_LNK && e->type != DT_UNKNOWN)
+        return NO;
+    return stat(g->path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void walk(struct gstate *, size_t, const char *);
+
+static void globstar(struct gstate *g, size_t plen, const char *rest)
+/*
+ * purpose: expand "**" followed by rest (NULL if ** ends the pattern)
+ *          in the directory g->path[0..plen)
+ *   notes: ** alone is every name in the tree and ** / every
+ *          directory in it; with one more component that is matched
+ *          during the walk itself, with more the walk only finds the
+ *          directories and each one is expanded from there as usual
+ */
+{
+    char **v;
+    int n, i;
+
+    if (rest == NULL && plen > 0)	/* the directory itself, as bash */
+        emit(g, plen);
+    if (rest == NULL || (*rest != '\0' && strchr(rest, '/') == NULL)) {
+        v = gstar(g->a, g->path, plen, rest ? rest : "*", &n);
+        for (i = 0; i < n; i++)
+            add(g, v[i]);
+        return;
+    }
+    v = gstar(g->a, g->path, plen, NULL, &n);
+    for (i = 0; i < n; i++) {
+        if (*rest == '\0') {		/* a trailing /: directories only */
+            if (i > 0 || plen > 0)
+                add(g, v[i]);
+        } else {
+            walk(g, put(g, 0, v[i], strlen(v[i])), rest);
+        }
+    }
+}
+
+static void walk(struct gstate *g, size_t plen, const char *pat)
+/*
+ * purpose: expand pat relative to the directory in g->path[0..plen)
+ */
+{
+    const char *slash = strchr(pat, '/'), *rest;
+    size_t clen = slash ? (size_t)(slash - pat) : strlen(pat), len;
+    struct dlist *d;
+    struct dname *e;
+    struct stat st;
+    char dir[plen + 1], name[clen + 1];
+    int i;
+
+    rest = slash;
+    if (rest != NULL)
+        while (*rest == '/')
+            rest++;
+    memcpy(dir, g->path, plen);
+    dir[plen] = '\0';
+    if (clen == 2 && pat[0] == '*' && pat[1] == '*') {
+        globstar(g, plen, rest);
+        return;
+    }
+
+    if (!has_meta(pat, clen)) {		/* literal: no need to list it	*/
+        len = unescape(g, plen, pat, clen);
+        if (rest != NULL && *rest != '\0') {
+            walk(g, put(g, len, slash, rest - slash), rest);
+            return;
+        }
+        if (rest == NULL ? lstat(g->path, &st) == 0
+                         : stat(g->path, &st) == 0 && S_ISDIR(st.st_mode))
+            emit(g, rest == NULL ? len : put(g, len, slash, rest - slash));
+        return;
+    }
+
+    if ((d = listing(dir)) == NULL)
+        return;
+    memcpy(name, pat, clen);
+    name[clen] = '\0';
+    for (i = 0; i < d->n; i++) {
+        e = &d->ents[i];
+        if (e->name[0] == '.' && name[0] != '.')
+            continue;			/* * never matches a leading .	*/
+        if (!gmatch(name, e->name))
+            continue;
+        len = put(g, plen, e->name, strlen(e->name));
+        if (rest == NULL) {
+            emit(g, len);
+        } else if (is_dir(g, e)) {
+            len = put(g, len, slash, rest - slash);
+            if (*rest == '\0')
+                emit(g, len);
+            else
+                walk(g, len, rest);
+        }
+    }
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+char **sglob(struct arena *a, char *pat, int *np)
+/*
+ * purpose: expand a pathname pattern
+ * returns: the matching paths, NULL-terminated in a, with their
+ *          number in *np (0 if nothing matched)
+ */
+{
+    static struct gstate g;
+    size_t len = 0;
+    const char *p = pat;
+
+    g.a = a;
+    g.v = NULL;
+    g.n = g.cap = 0;
+    g.sorted = YES;
+    while (*p == '/')			/* absolute: start at the root	*/
+        p++;
+    if (p != pat)
+        len = put(&g, 0, pat, p - pat);
+    else
+        put(&g, 0, "", 0);
+    if (*p != '\0')
+        walk(&g, len, p);
+    /* per-directory order is sorted; whole paths may differ at '/' */
+    if (!g.sorted)
+        qsort(g.v, g.n, sizeof(char *), cmp_path);
+    *np = g.n;
+    if (g.n == 0)
+        return NULL;
+    g.v[g.n] = NULL;
+    return g.v;
+}
@@ -1,3 +1,5 @@
+#include	<sys/types.h>
+
 #define	YES	1
 #define	NO	0
 
@@ -11,3 +13,324 @@ int	execute(char **);
 void	fatal(char *, char *, int );
 
 int	process();
+
+/* spawn.c - launch plans: fd actions applied in the child before exec */
+#define	SPAWN_POSIX	0		/* posix_spawnp (vfork-style)	*/
+#define	SPAWN_FORK	1		/* classic fork + execvp	*/
+
+#define	FDA_OPEN	0
+#define	FDA_DUP2	1
+#define	FDA_CLOSE	2
+#define	FDA_OWNED	3		/* parent's copy, closed by spawn_free */
+
+struct fdact {
+	int		op;		/* FDA_*			*/
+	int		fd;		/* target fd (or source of dup2)*/
+	int		newfd;		/* dup2 destination		*/
+	const char	*path;		/* FDA_OPEN only (a FIFO)	*/
+	int		flags;
+	mode_t		mode;
+};
+
+struct spawn_plan {
+	struct fdact	*acts;
+	int		nact, cap;
+	pid_t		pgid;		/* -1 keep, 0 new group, else join */
+	int		tty;		/* give the group this terminal	*/
+	int		ignint;		/* start with SIGINT/SIGQUIT ignored */
+	char		**envp;		/* environment, NULL for environ */
+};
+
+void	spawn_set_mode(int);
+int	spawn_get_mode();
+void	spawn_init(struct spawn_plan *);
+void	spawn_free(struct spawn_plan *);
+void	spawn_dup2(struct spawn_plan *, int, int);
+void	spawn_close(struct spawn_plan *, int);
+int	spawn_open(struct spawn_plan *, int, const char *, int, mode_t);
+int	spawn_owned(struct spawn_plan *, int);
+int	spawn_hasfd(struct spawn_plan *, int);
+char	**spawn_redirects(struct spawn_plan *, char **);
+pid_t	spawn_run(struct spawn_plan *, char **);
+pid_t	spawn_func(struct spawn_plan *, int (*)(char **, int), char **);
+
+/* pathhash.c - command name to absolute path cache */
+char	*path_lookup(char *);
+void	path_forget(char *);
+void	path_clear();
+int	builtin_hash(char **);
+
+/* reader.c - block-buffered line reader handing out in-place views */
+struct reader {
+	int	fd;
+	int	tty;			/* prompt only on a terminal	*/
+	int	share;			/* children read fd too: sync offset */
+	int	mapped;			/* buf is an mmap of the file	*/
+	int	borrowed;		/* buf belongs to the caller	*/
+	int	eof;
+	char	*buf;
+	size_t	cap, len;		/* buffer size, bytes held	*/
+	size_t	pos, scan;		/* line start, memchr resume	*/
+	char	*tail;			/* copy of unterminated last line */
+};
+
+struct reader *rd_open(int);
+struct reader *rd_string(char *);
+char	*rd_line(struct reader *, char *);
+void	rd_close(struct reader *);
+
+/* arena.c - bump allocator released once per command line */
+struct arena_blk {
+	struct arena_blk *next;
+	size_t		size, used;
+	char		data[];
+};
+
+struct arena {
+	struct arena_blk *head;
+};
+
+void	arena_init(struct arena *);
+void	*arena_alloc(struct arena *, size_t);
+char	*arena_room(struct arena *, size_t);
+void	arena_commit(struct arena *, size_t);
+char	*arena_strndup(struct arena *, const char *, size_t);
+void	arena_reset(struct arena *);
+void	arena_free(struct arena *);
+
+/* parse.c - command line to pipeline tree, built in an arena */
+struct word {
+	char	*text;			/* quotes removed		*/
+	char	*pat;			/* glob pattern, NULL if none	*/
+	char	*exp;			/* text with $ marked, or NULL	*/
+};
+
+#define	CTLVAR	'\001'			/* exp: $name ... CTLEND	*/
+#define	CTLQVAR	'\002'			/* same, inside "": not split	*/
+#define	CTLEND	'\003'
+#define	CTLCMD	'\004'			/* $(command) or `command`	*/
+#define	CTLQCMD	'\005'			/* same, inside ""		*/
+#define	CTLPROC	'\006'			/* <(command) or >(command)	*/
+
+
+#define	R_IN		0		/* < file			*/
+#define	R_OUT		1		/* > file, truncated		*/
+#define	R_APPEND	2		/* >> file			*/
+#define	R_DUP		3		/* n>&m, n<&m; m of - closes n	*/
+#define	R_HEREDOC	4		/* << word: target is the body	*/
+#define	R_HERESTR	5		/* <<< word			*/
+
+struct redir {
+	int		op;		/* R_*				*/
+	int		fd;		/* descriptor redirected	*/
+	struct word	target;
+	struct redir	*next;
+};
+
+struct stage {
+	int		argc;
+	struct word	*words;
+	char		**argv;		/* word texts, NULL-terminated	*/
+	int		nglob;		/* words with a pattern or $	*/
+	struct redir	*redirs;
+	int		nassign;	/* NAME=value words before argv	*/
+	struct word	*assigns;
+	struct node	*body;		/* compound command, or NULL	*/
+};
+
+struct pipeline {
+	int		nstages;
+	struct stage	*stages;
+	int		nfan;		/* stages |{ a ; b }: lists that */
+	struct node	**fan;		/* each read all of the output	*/
+};
+
+#define	N_PIPE	0			/* pl				*/
+#define	N_AND	1			/* left && right		*/
+#define	N_OR	2			/* left || right		*/
+#define	N_SEQ	3			/* left ; right			*/
+#define	N_BG	4			/* left &			*/
+#define	N_IF	5			/* if left then right else other */
+#define	N_WHILE	6			/* while left do right done	*/
+#define	N_UNTIL	7			/* until left do right done	*/
+#define	N_FOR	8			/* for name in pl do left done	*/
+#define	N_GROUP	9			/* { left; }			*/
+#define	N_SUBSHELL 10			/* ( left )			*/
+#define	N_FUNC	11			/* name() left			*/
+
+struct node {
+	int		type;
+	struct pipeline	*pl;		/* N_FOR: one stage of words, or
+					   NULL for "$@"		*/
+	struct node	*left, *right;
+	struct node	*other;		/* N_IF: elif or else part	*/
+	char		*name;		/* N_FOR, N_FUNC		*/
+};
+
+extern int	parse_quiet;		/* syntax errors are not reported */
+extern int	parse_errors;		/* syntax errors so far		*/
+
+struct node *parse_line(struct arena *, char *);
+struct node *parse_lines(struct arena *, char *, struct reader *, char *);
+int	parse_heredocs(struct arena *, struct reader *, char *);
+struct word parse_word(struct arena *, char *, size_t);
+
+/* scache.c - scripts parsed once, their trees cached on disk */
+struct script;
+
+struct script *script_open(char *, int);
+void	script_run(struct script *, struct arena *);
+struct node *script_keep(struct node *);
+
+/* smsh4.c - pipeline launcher shared with the builtins */
+#define	LP_NONE	0			/* stay in the shell's group	*/
+#define	LP_FG	1			/* new group, owns the terminal	*/
+#define	LP_BG	2			/* new group in the background	*/
+
+#define	J_NONE	0			/* jump: nothing to unwind	*/
+#define	J_BREAK	1
+#define	J_CONTINUE 2
+#define	J_RETURN 3
+
+extern int	jump;			/* break, continue, return under way */
+extern int	jump_levels;		/* loops it has still to leave	*/
+extern int	loop_depth;		/* loops running in this function */
+extern int	func_depth;		/* function calls running	*/
+
+int	launch_pipeline(struct arena *, struct pipeline *, int, int, int, pid_t *, int *, int, int);
+pid_t	fork_subshell(struct arena *, struct node *, int, int, int, int, int);
+int	run_node(struct arena *, struct node *);
+char	*command_subst(struct arena *, char *, size_t);
+char	*proc_subst(struct arena *, char *, size_t);
+
+/* builtins.c - dispatch table of commands run inside the shell */
+#define	BI_OWNIN	1		/* reads input itself: < is passed
+					   as an fd, not put on stdin	*/
+#define	BI_PURE		2		/* changes nothing in the shell:
+					   $(cmd) may run it in place	*/
+struct builtin {
+	char		*name;
+	int		(*fn)(char **, int);
+	int		flags;		/* BI_*				*/
+};
+
+const struct builtin *find_builtin(char *);
+
+/* zcopy.c - in-shell cat, fan-out: copy_file_range, splice, tee, sendfile */
+int	kcopy(int, int);
+const struct builtin *zcopy_cat(struct stage *, int);
+void	zcopy_pipe(int, int);
+int	zcopy_tee(int, int *, int);
+
+/* redir.c - per-stage redirections, heredocs in memfds */
+char	*redir_target(struct arena *, struct redir *);
+int	redir_open(struct arena *, struct redir *);
+int	redir_dupfd(struct arena *, struct redir *, struct spawn_plan *);
+int	redir_plan(struct arena *, struct spawn_plan *, struct redir *);
+char	*redir_op(struct redir *);
+
+/* sglob.c - pathname expansion over cached directory listings */
+char	**sglob(struct arena *, char *, int *);
+int	gmatch(const char *, const char *);
+
+/* gstar.c - parallel tree walks for ** */
+char	**gstar(struct arena *, const char *, size_t, const char *, int *);
+
+/* parallel.c - run command lines N at a time */
+int	builtin_parallel(char **, int);
+
+/* cache.c - the cached builtin: command output kept on disk, LRU */
+int	builtin_cached(char **, int);
+
+/* server.c - smsh --server: pre-forked workers on a Unix socket */
+char	*server_run(char *, int);
+int	server_send(char *, char *);
+
+/* reap.c - child table keyed by pid, exit statuses */
+#define	TAG_FG		0		/* foreground pipeline		*/
+#define	TAG_PARALLEL	1		/* jobs of the parallel builtin	*/
+#define	TAG_JOB		2		/* background jobs		*/
+#define	TAG_PROC	3		/* <(cmd): nobody waits for it	*/
+
+extern int	last_status;		/* $?				*/
+extern int	*pipestatus;		/* $PIPESTATUS			*/
+extern int	npipestatus;
+struct rusage;
+extern void	(*child_done)(pid_t, int, const struct rusage *, long long);
+
+void	child_init();
+void	child_hold();
+void	child_release();
+void	child_add(pid_t, int);
+int	child_wait(pid_t);
+int	child_poll(pid_t, int *);
+void	child_cont(pid_t);
+pid_t	child_reap(int, int *);
+int	exit_code(int);
+void	set_pipestatus(int *, int);
+
+/* jobs.c - background jobs and job control */
+extern int	job_control;		/* interactive, on a terminal	*/
+extern int	job_async;		/* in a & list without job control */
+extern int	shell_tty;
+extern pid_t	last_bg;		/* $!				*/
+
+void	job_init(int);
+void	job_subshell(int);
+int	job_add(pid_t *, int *, int, struct node *, int);
+int	job_wait(pid_t *, int *, int);
+void	job_terminal();
+void	job_notify();
+void	job_hangup();
+int	builtin_jobs(char **);
+int	builtin_fg(char **);
+int	builtin_bg(char **);
+int	builtin_wait(char **);
+
+/* history.c - history file, ! expansion, line editor with ^R */
+void	hist_init();
+void	hist_add(char *);
+char	*hist_expand(char *);
+int	hist_search(const char *, size_t, int);
+char	*hist_readline(char *);
+int	builtin_history(char **);
+
+/* prof.c - opt-in profiler, stats builtin */
+extern int	prof_on;
+
+void	prof_init();
+long long	prof_now();
+void	prof_mark();
+long long	prof_start();
+void	prof_spawned(pid_t, char *, long long);
+void	prof_builtin(char *, long long, int);
+void	prof_pipeline(long long);
+int	builtin_stats(char **);
+
+/* expand.c - $ parameter expansion */
+int	expand_word(struct arena *, struct word *, char ***);
+char	*expand_string(struct arena *, struct word *);
+char	*param_value(struct arena *, char *, size_t);
+
+/* vars.c - shell variables, export, the environment children get */
+#define	V_EXPORT	1		/* in the environment		*/
+
+extern pid_t	shell_pid;		/* $$				*/
+extern char	*shell_name;		/* $0				*/
+extern char	**params;		/* $1 ..., NULL-terminated	*/
+extern int	nparams;		/* $#				*/
+
+void	var_init();
+char	*var_get(const char *, size_t);
+int	var_set(const char *, size_t, const char *, int);
+void	var_unset(const char *, size_t);
+int	var_isname(const char *, size_t);
+char	**var_envp(struct arena *, char **, int);
+int	var_push(char **, int);
+void	var_pop(int);
+char	**var_args(char **);
+void	func_set(const char *, struct node *);
+struct node *func_get(const char *);
+int	builtin_export(char **);
+int	builtin_unset(char **);
+int	builtin_set(char **);
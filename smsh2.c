@@ -22,9 +22,12 @@
  *
  * @param cmds An array of command strings.
  * @param num_cmds The number of commands in the pipeline.
+ * @return The last command's wait status, or -1 if it did not start.
  */
-void execute_pipeline(char *cmds[], int num_cmds) {
+int execute_pipeline(char *cmds[], int num_cmds) {
     int pipes[num_cmds - 1][2]; // Array to hold pipe file descriptors
+    pid_t pids[num_cmds];       // Each command's pid, -1 if it did not start
+    int status = -1;
 
     // Create pipes for communication between commands
     for (int i = 0; i < num_cmds - 1; i++) {
@@ -34,49 +37,40 @@ void execute_pipeline(char *cmds[], int num_cmds) {
         }
     }
 
-    // Loop to fork processes and set up pipes
+    // Loop to launch processes and set up pipes
     for (int i = 0; i < num_cmds; i++) {
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
-            if (i != 0) {
-                // Redirect stdin to the read end of the previous pipe
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1) {
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            if (i != num_cmds - 1) {
-                // Redirect stdout to the write end of the current pipe
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            // Close all pipe ends in the child process
-            for (int j = 0; j < num_cmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
+        struct spawn_plan plan;
+        spawn_init(&plan);
 
-            // Parse the command into arguments
-            char *args[MAX_CMD_LEN];
-            char *token = strtok(cmds[i], " ");
-            int arg_idx = 0;
-            while (token != NULL) {
-                args[arg_idx++] = token;
-                token = strtok(NULL, " ");
-            }
-            args[arg_idx] = NULL;
+        if (i != 0) {
+            // Redirect stdin to the read end of the previous pipe
+            spawn_dup2(&plan, pipes[i - 1][0], STDIN_FILENO);
+        }
+        if (i != num_cmds - 1) {
+            // Redirect stdout to the write end of the current pipe
+            spawn_dup2(&plan, pipes[i][1], STDOUT_FILENO);
+        }
+        // Close all pipe ends in the child process
+        for (int j = 0; j < num_cmds - 1; j++) {
+            spawn_close(&plan, pipes[j][0]);
+            spawn_close(&plan, pipes[j][1]);
+        }
 
-            // Execute the command
-            execvp(args[0], args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("fork");
-            exit(EXIT_FAILURE);
+        // Parse the command into arguments
+        char *args[MAX_CMD_LEN];
+        char *token = strtok(cmds[i], " ");
+        int arg_idx = 0;
+        while (token != NULL) {
+            args[arg_idx++] = token;
+            token = strtok(NULL, " ");
+        }
+        args[arg_idx] = NULL;
+
+        // Execute the command; the plan is applied in the child
+        if ((pids[i] = spawn_run(&plan, args)) != -1) {
+            child_add(pids[i], TAG_FG);
         }
+        spawn_free(&plan);
     }
 
     // Close all pipe ends in the parent process
@@ -85,10 +79,11 @@ void execute_pipeline(char *cmds[], int num_cmds) {
         close(pipes[i][1]);
     }
 
-    // Wait for all child processes to finish
+    // Wait for each of our own children, keeping the last one's status
     for (int i = 0; i < num_cmds; i++) {
-        wait(NULL);
+        status = pids[i] != -1 ? child_wait(pids[i]) : -1;
     }
+    return status;
 }
 
 int main()
@@ -112,7 +107,7 @@ int main()
 
             // Execute the pipeline or single command
             if (num_cmds > 1) {
-                execute_pipeline(arglist, num_cmds);
+                result = execute_pipeline(arglist, num_cmds);
             } else {
                 result = execute(arglist);
             }
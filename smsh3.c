@@ -18,53 +18,12 @@
 #define MAX_CMDS 1000
 #define MAX_CMD_LEN 1024
 
-// Function to check for redirection operators (">" and "<") in the argument list
-char **check_redirect(char **arglist) {
-    int i = 0;
-    while (arglist[i] != NULL) {
-        // Check for output redirection ">"
-        if (strcmp(arglist[i], ">") == 0) {
-            // Open or create the file for writing
-            int fd = open(arglist[i + 1], O_CREAT | O_WRONLY, 0777);
-            if (fd == -1) {  // Check for errors
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            // Redirect stdout to the file
-            if (dup2(fd, STDOUT_FILENO) == -1) {
-                perror("dup2");
-                close(fd);
-                exit(EXIT_FAILURE);
-            }
-            close(fd);  // Close the file descriptor
-            arglist[i] = NULL;
-            arglist[i + 1] = NULL;
-        // Check for input redirection "<"
-        } else if (strcmp(arglist[i], "<") == 0) {
-            // Open the file for reading
-            int fd = open(arglist[i + 1], O_RDONLY);
-            if (fd == -1) {  // Check for errors
-                perror("open");
-                exit(EXIT_FAILURE);
-            }
-            // Redirect stdin to the file
-            if (dup2(fd, STDIN_FILENO) == -1) {
-                perror("dup2");
-                close(fd);
-                exit(EXIT_FAILURE);
-            }
-            close(fd);  // Close the file descriptor
-            arglist[i] = NULL;
-            arglist[i + 1] = NULL;
-        }
-        i++;
-    }
-    return arglist;
-}
-
-// Function to execute a pipeline of commands
+// Function to execute a pipeline of commands.  Returns the last
+// command's wait status, or -1 if it did not start.
 int execute_pipeline(char *cmds[], int num_cmds) {
     int pipes[num_cmds - 1][2];
+    pid_t pids[num_cmds];  // -1 for a command that did not start
+    int status = -1;
     
     // Create pipes for inter-process communication
     for (int i = 0; i < num_cmds - 1; i++) {
@@ -75,51 +34,42 @@ int execute_pipeline(char *cmds[], int num_cmds) {
     }
 
     for (int i = 0; i < num_cmds; i++) {
-        pid_t pid = fork();  // Fork a new process
-        if (pid == 0) {
-            // Child process
-
-            // Redirect input from previous command's pipe
-            if (i != 0) {
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1) {
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            // Redirect output to next command's pipe
-            if (i != num_cmds - 1) {
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
-            }
-            // Close all pipe ends
-            for (int j = 0; j < num_cmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
-            }
+        struct spawn_plan plan;  // fd work the child does before exec
+        spawn_init(&plan);
 
-            // Prepare arguments for execvp
-            char *args[MAX_CMD_LEN];
-            char *token = strtok(cmds[i], " ");
-            int arg_idx = 0;
-            while (token != NULL) {
-                args[arg_idx++] = token;
-                token = strtok(NULL, " ");
-            }
-            args[arg_idx] = NULL;
+        // Redirect input from previous command's pipe
+        if (i != 0) {
+            spawn_dup2(&plan, pipes[i - 1][0], STDIN_FILENO);
+        }
+        // Redirect output to next command's pipe
+        if (i != num_cmds - 1) {
+            spawn_dup2(&plan, pipes[i][1], STDOUT_FILENO);
+        }
+        // Close all pipe ends
+        for (int j = 0; j < num_cmds - 1; j++) {
+            spawn_close(&plan, pipes[j][0]);
+            spawn_close(&plan, pipes[j][1]);
+        }
 
-            // Check for redirection in the arguments
-            char **newArgs = check_redirect(args);
+        // Prepare arguments for the child
+        char *args[MAX_CMD_LEN];
+        char *token = strtok(cmds[i], " ");
+        int arg_idx = 0;
+        while (token != NULL) {
+            args[arg_idx++] = token;
+            token = strtok(NULL, " ");
+        }
+        args[arg_idx] = NULL;
 
-            // Execute the command
-            execvp(newArgs[0], newArgs);
-            perror("execvp");  // If execvp returns, there was an error
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("fork");
-            exit(EXIT_FAILURE);
+        // Check for redirection in the arguments; a file that cannot be
+        // opened is reported here and the stage is not started
+        char **newArgs = spawn_redirects(&plan, args);
+
+        // Launch the command and enter it in the child table
+        if ((pids[i] = spawn_run(&plan, newArgs)) != -1) {
+            child_add(pids[i], TAG_FG);
         }
+        spawn_free(&plan);
     }
 
     // Close all pipe ends in the parent process
@@ -128,11 +78,11 @@ int execute_pipeline(char *cmds[], int num_cmds) {
         close(pipes[i][1]);
     }
 
-    // Wait for all child processes to finish
+    // Wait for each of our own children, keeping the last one's status
     for (int i = 0; i < num_cmds; i++) {
-        wait(NULL);
+        status = pids[i] != -1 ? child_wait(pids[i]) : -1;
     }
-    return 0;
+    return status;
 }
 
 int main() {
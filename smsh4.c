@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,213 +8,1083 @@
 #include <string.h>
 #include "smsh.h"
 #include <fcntl.h>
-#include <dirent.h>
-#include <fnmatch.h>
-#include <glob.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// Define default prompt and constants for maximum commands and command length
+// Define default prompt and constant for maximum command length
 #define DFL_PROMPT "> "
-#define MAX_CMDS 1000
 #define MAX_CMD_LEN 1024
 
-// Function to duplicate a string
-char *strdup(const char *src) {
-    char *dst = malloc(strlen(src) + 1);  // Allocate space for the new string
-    if (dst == NULL) return NULL;         // Check if memory allocation failed
-    strcpy(dst, src);                     // Copy the string to the new location
-    return dst;                           // Return the duplicated string
+// Function to add one argument to an arena-backed argument list
+static char **push_arg(struct arena *arena, char **list, int *n, int *cap, char *arg) {
+    if (*n + 1 >= *cap) {  // Keep room for the terminating NULL
+        char **bigger = arena_alloc(arena, *cap * 2 * sizeof(char *));
+        memcpy(bigger, list, *n * sizeof(char *));
+        list = bigger;
+        *cap *= 2;
+    }
+    list[(*n)++] = arg;
+    return list;
 }
 
-// Function to handle globbing for wildcard characters in arguments
-char **handle_globbing(char **arglist) {
-    char **newArglist = malloc(MAX_CMD_LEN * sizeof(char *));  // Allocate memory for the new argument list
-    if (newArglist == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+// Bytes the last handle_globbing() argv takes in an exec (strings and pointers)
+static size_t argv_bytes;
+
+// Function to handle globbing for wildcard characters in arguments.
+// Matches come from the cached-listing glob engine (sglob.c) and the
+// argv grows in the arena as they arrive, so its size has no limit here;
+// argv_bytes is left for the caller to check against ARG_MAX.
+char **handle_globbing(struct arena *arena, struct stage *st) {
+    if (st->nglob == 0) {
+        argv_bytes = 0;  // Parsed words never come near ARG_MAX
+        return st->argv;  // Nothing to expand: use the parsed argv as is
     }
-    
+
+    int cap = st->argc + 16;
     int newArgIndex = 0;
+    char **newArglist = arena_alloc(arena, cap * sizeof(char *));
 
-    for (int argIndex = 0; arglist[argIndex] != NULL; argIndex++) {
-        // Check for wildcard characters
-        if (strchr(arglist[argIndex], '*') != NULL || strchr(arglist[argIndex], '?') != NULL) {
-            glob_t globbuf;
-            int glob_flags = 0;
-
-            // Perform globbing
-            if (glob(arglist[argIndex], glob_flags, NULL, &globbuf) == 0) {
-                // Add matched paths to the new argument list
-                for (int i = 0; i < globbuf.gl_pathc; i++) {
-                    newArglist[newArgIndex] = strdup(globbuf.gl_pathv[i]);
-                    if (newArglist[newArgIndex] == NULL) {
-                        perror("strdup");
-                        exit(EXIT_FAILURE);
-                    }
-                    newArgIndex++;
-                }
-            } else {
-                perror("glob");
+    for (int argIndex = 0; argIndex < st->argc; argIndex++) {
+        struct word *w = &st->words[argIndex];
+        // Only words with unquoted wildcards carry a pattern
+        if (w->pat == NULL && w->exp == NULL) {
+            newArglist = push_arg(arena, newArglist, &newArgIndex, &cap, w->text);
+            continue;
+        }
+
+        // Parameters are expanded first; the result may be several words
+        char *single[2] = { w->pat, NULL };
+        char **fields = single;
+        if (w->exp != NULL) {
+            expand_word(arena, w, &fields);
+        }
+
+        for (int f = 0; fields[f] != NULL; f++) {
+            if (w->pat == NULL) {
+                newArglist = push_arg(arena, newArglist, &newArgIndex, &cap, fields[f]);
+                continue;
             }
-            globfree(&globbuf);
-        } else {
-            // Add the argument to the new argument list
-            newArglist[newArgIndex] = strdup(arglist[argIndex]);
-            if (newArglist[newArgIndex] == NULL) {
-                perror("strdup");
-                exit(EXIT_FAILURE);
+            int nmatch;
+            char **matches = sglob(arena, fields[f], &nmatch);
+            if (nmatch == 0) {
+                // No match: pass the word through unchanged
+                newArglist = push_arg(arena, newArglist, &newArgIndex, &cap, w->exp ? fields[f] : w->text);
+                continue;
             }
-            newArgIndex++;
+            if (newArgIndex + nmatch >= cap) {  // One copy for the whole match list
+                char **bigger = arena_alloc(arena, (cap = newArgIndex + nmatch + 16) * sizeof(char *));
+                memcpy(bigger, newArglist, newArgIndex * sizeof(char *));
+                newArglist = bigger;
+            }
+            memcpy(newArglist + newArgIndex, matches, nmatch * sizeof(char *));
+            newArgIndex += nmatch;
         }
     }
     newArglist[newArgIndex] = NULL;  // Null-terminate the new argument list
+
+    argv_bytes = 0;
+    for (int i = 0; i < newArgIndex; i++) {
+        argv_bytes += strlen(newArglist[i]) + 1 + sizeof(char *);
+    }
     return newArglist;
 }
 
-// Function to check for redirection operators and handle them
-char **check_redirect(char **arglist) {
-    int i = 0;
-    while (arglist[i] != NULL) {
-        // Check for output redirection
-        if (strcmp(arglist[i], ">") == 0) {
-            int fd = open(arglist[i + 1], O_CREAT | O_WRONLY, 0777);  // Create or open the file
-            if (fd == -1) {
-                perror("open");
-                exit(EXIT_FAILURE);
+// Function to expand a stage's NAME=value assignments, which are
+// never split or globbed.  Returns st->nassign strings in the arena.
+static char **assignments(struct arena *arena, struct stage *st) {
+    char **assigns = arena_alloc(arena, (st->nassign + 1) * sizeof(char *));
+    for (int i = 0; i < st->nassign; i++) {
+        assigns[i] = expand_string(arena, &st->assigns[i]);
+    }
+    assigns[st->nassign] = NULL;
+    return assigns;
+}
+
+// Function to tell whether an argv is too big to exec: ARG_MAX covers
+// the arguments and the environment together
+static int too_long(char **args) {
+    static long arg_max;
+    extern char **environ;
+    if (argv_bytes < 32 * 1024) {
+        return NO;  // Below any ARG_MAX there has ever been
+    }
+    if (arg_max == 0) {
+        arg_max = sysconf(_SC_ARG_MAX);
+    }
+    size_t env_bytes = 0;
+    for (char **e = environ; *e != NULL; e++) {
+        env_bytes += strlen(*e) + 1 + sizeof(char *);
+    }
+    if (argv_bytes + env_bytes + 2048 <= (size_t)arg_max) {
+        return NO;
+    }
+    fprintf(stderr, "smsh: %s: argument list too long (%zu bytes, limit %ld)\n",
+            args[0], argv_bytes + env_bytes, arg_max);
+    return YES;
+}
+
+// Set by break, continue and return, and checked after every command
+// until the loop or function they are for has unwound to them
+int jump = J_NONE;
+int jump_levels;  // loops still to leave (break 2, continue 2)
+int loop_depth;  // loops running in the current function
+int func_depth;  // function calls running
+
+static int nsubst;  // Command substitutions run, for x=$(cmd)'s status
+
+static int run_body(struct arena *arena, struct node *body, char **args);
+
+// A stage that is a compound command or calls a function runs through
+// this entry, in the shell or (in a pipeline) in a forked copy of it
+static int fork_body(char **args, int fd);
+static const struct builtin shell_body = { "(compound)", fork_body, 0 };
+static struct arena *body_arena;  // What the next forked copy runs
+static struct node *body_node;
+
+static int fork_body(char **args, int fd) {
+    struct sigaction sa;
+    sigaction(SIGINT, NULL, &sa);
+    job_subshell(sa.sa_handler == SIG_IGN);  // A copy of the shell: its children are its own
+    return run_body(body_arena, body_node, args);
+}
+
+// Function to find what a stage runs in the shell, given its command
+// name: a compound command, a function, or a builtin.  Returns the
+// builtin entry to run it with, or NULL for an external command.
+static const struct builtin *shell_command(struct stage *st, char *name) {
+    struct node *f = name != NULL ? func_get(name) : NULL;
+    if (st->body == NULL && f == NULL) {
+        return find_builtin(name ? name : ":");
+    }
+    body_node = st->body ? st->body : f;
+    return &shell_body;
+}
+
+// The shell's ends of the <(command) and >(command) pipes made for the
+// commands now running; each is closed when the command it was made for
+// is done.  They are close-on-exec, and handed on only to the stages
+// that are to use them.
+static int *procfds;
+static int nprocfds, procfdcap;
+
+// Function to close the process substitution pipes made since mark
+static void proc_close(int mark) {
+    while (nprocfds > mark) {
+        close(procfds[--nprocfds]);
+    }
+}
+
+// The shell's ends of the pipes of a fan-out it is copying: the read
+// end from its producer and the write ends to its consumers.  No copy
+// of the shell keeps them, or a consumer would wait for the end of its
+// input as long as another consumer held its pipe open.
+static int *fanfds;
+static int nfanfds, fanfdcap;
+
+// Function to note one of those ends
+static void fan_keep(int fd) {
+    if (nfanfds == fanfdcap) {
+        fanfdcap = fanfdcap ? fanfdcap * 2 : 8;
+        fanfds = erealloc(fanfds, fanfdcap * sizeof(int));
+    }
+    fanfds[nfanfds++] = fd;
+}
+
+// Function to close the fan-out pipe ends noted since mark
+static void fan_close(int mark) {
+    while (nfanfds > mark) {
+        close(fanfds[--nfanfds]);
+    }
+}
+
+// Function to start every stage of a pipeline without waiting for it.
+// in_fd, out_fd and err_fd, when not -1, replace the first stage's stdin,
+// the last stage's stdout and every stage's stderr.  Each child is
+// entered in the child table under tag.  mode (LP_*) says whether the
+// stages get a process group of their own and the terminal.  Returns the
+// number of processes started; pids[i] is the pid of stage i, or -1 if
+// that stage could not be started, and then codes[i] (if codes is not
+// NULL) is 1 where a redirection failed.  Other codes are left alone.
+// Each pipe is made as the stage that writes into it starts, close-on-exec,
+// so the shell holds two pipe ends at a time whatever the length, and an
+// exec'd stage has nothing to close but the ends it was given.
+int launch_pipeline(struct arena *arena, struct pipeline *pl, int in_fd, int out_fd, int err_fd, pid_t pids[], int codes[], int tag, int mode) {
+    int num_cmds = pl->nstages;
+    int started = 0;
+    pid_t pgid = 0;  // 0 until the first stage starts the job's group
+    int in = in_fd;  // What the next stage reads: the last pipe made, after the first
+
+    child_hold();  // The SIGCHLD handler must not reap a child before child_add
+    for (int i = 0; i < num_cmds; i++) {
+        struct stage *st = &pl->stages[i];
+        struct spawn_plan plan;  // Pipe and redirect work done in the child
+        spawn_init(&plan);
+
+        // Job control: one process group per job, the foreground one on the terminal
+        if (job_control && mode != LP_NONE) {
+            plan.pgid = pgid;
+            if (mode == LP_FG && pgid == 0) {
+                plan.tty = shell_tty;
             }
-            if (dup2(fd, STDOUT_FILENO) == -1) {  // Redirect stdout to the file
-                perror("dup2");
-                close(fd);
+        }
+        plan.ignint = job_async || (mode == LP_BG && !job_control);
+
+        // Expand wildcards; the argv itself already came from the parser
+        char **args = handle_globbing(arena, st);
+        if (st->nassign > 0) {  // X=1 cmd: only cmd's environment has X
+            plan.envp = var_envp(arena, assignments(arena, st), st->nassign);
+        }
+        for (int j = 0; j < nprocfds; j++) {  // Its /dev/fd/N paths stay open
+            spawn_dup2(&plan, procfds[j], procfds[j]);
+        }
+
+        // Stdin from the previous pipe (or in_fd), stdout to a new one
+        // (or out_fd, where the caller captures the output)
+        int out = out_fd, next_in = -1;
+        if (i != num_cmds - 1) {
+            int p[2];
+            if (pipe2(p, O_CLOEXEC) == -1) {
+                perror("pipe");
                 exit(EXIT_FAILURE);
             }
-            arglist[i] = NULL;
-            arglist[i + 1] = NULL;
-        // Check for input redirection
-        } else if (strcmp(arglist[i], "<") == 0) {
-            int fd = open(arglist[i + 1], O_RDONLY);  // Open the file for reading
-            if (fd == -1) {
-                perror("open");
-                exit(EXIT_FAILURE);
+            zcopy_pipe(p[1], NO);
+            out = p[1];
+            next_in = p[0];
+        }
+        if (in != -1) {
+            spawn_dup2(&plan, in, STDIN_FILENO);
+        }
+        if (out != -1) {
+            spawn_dup2(&plan, out, STDOUT_FILENO);
+        }
+        if (err_fd != -1) {
+            spawn_dup2(&plan, err_fd, STDERR_FILENO);
+        }
+
+        // A copy of the shell never execs: it closes its pipe ends itself
+        const struct builtin *b = shell_command(st, args[0]);
+        if (b != NULL) {
+            if (i != 0 && in != STDIN_FILENO) {
+                spawn_close(&plan, in);
             }
-            if (dup2(fd, STDIN_FILENO) == -1) {  // Redirect stdin to the file
-                perror("dup2");
-                close(fd);
-                exit(EXIT_FAILURE);
+            if (next_in != -1) {
+                spawn_close(&plan, next_in);
+                if (out != STDOUT_FILENO) {
+                    spawn_close(&plan, out);
+                }
+            }
+            for (int j = 0; j < nfanfds; j++) {
+                spawn_close(&plan, fanfds[j]);
+            }
+        }
+
+        // Redirections are applied after the pipe work, in the order written
+        body_arena = arena;
+        long long t0 = prof_on ? prof_now() : 0;  // Spawn latency starts here
+        if (redir_plan(arena, &plan, st->redirs) == -1) {
+            pids[i] = -1;  // A bad redirection: the stage does not run, status 1
+            if (codes != NULL) {
+                codes[i] = 1;
+            }
+        } else if (b != NULL) {  // A builtin not run by the shell itself gets a forked child
+            pids[i] = spawn_func(&plan, b->fn, args);
+        } else if (too_long(args)) {
+            pids[i] = -1;  // The exec would fail with E2BIG anyway
+        } else {
+            pids[i] = spawn_run(&plan, args);  // Launch the command with the plan applied
+        }
+        if (pids[i] != -1) {
+            child_add(pids[i], tag);
+            if (prof_on) {
+                prof_spawned(pids[i], args[0] ? args[0] : ":", t0);
             }
-            close(fd);
-            arglist[i] = NULL;
-            arglist[i + 1] = NULL;
+            started++;
+            if (plan.pgid == 0) {
+                pgid = pids[i];
+            }
+        }
+        spawn_free(&plan);
+
+        // The shell keeps only the read end the next stage is to get
+        if (i != 0) {
+            close(in);
         }
-        i++;
+        if (next_in != -1) {
+            close(out);
+        }
+        in = next_in;
     }
-    return arglist;
+    child_release();
+    return started;
 }
 
-// Function to execute a pipeline of commands
-int execute_pipeline(char *cmds[], int num_cmds) {
-    int pipes[num_cmds - 1][2];  // Array to hold pipe file descriptors
-    for (int i = 0; i < num_cmds - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
-            perror("pipe");
-            exit(EXIT_FAILURE);
+// Function to run a whole command tree in a forked copy of the shell,
+// for lists that must run concurrently with the shell itself.
+// in_fd/out_fd/err_fd/mode as for launch_pipeline; with LP_FG the copy
+// gets the terminal.  Returns the child's pid.
+pid_t fork_subshell(struct arena *arena, struct node *n, int in_fd, int out_fd, int err_fd, int tag, int mode) {
+    int group = job_control && mode != LP_NONE;
+    long long t0 = prof_on ? prof_now() : 0;
+    fflush(stdout);
+    child_hold();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        child_release();
+        return -1;
+    }
+    if (pid == 0) {
+        if (group) {
+            setpgid(0, 0);
+            if (mode == LP_FG) {
+                tcsetpgrp(shell_tty, getpid());
+            }
+        }
+        job_subshell(mode == LP_BG);  // The copy does no job control of its own
+        child_release();
+        if (tag == TAG_PROC) {  // Holding a pipe end would keep its reader waiting
+            proc_close(0);
+        }
+        fan_close(0);
+        if (in_fd != -1) {
+            dup2(in_fd, STDIN_FILENO);
+        }
+        if (out_fd != -1) {
+            dup2(out_fd, STDOUT_FILENO);
+        }
+        if (err_fd != -1) {
+            dup2(err_fd, STDERR_FILENO);
+        }
+        run_node(arena, n);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (group) {
+        setpgid(pid, pid);  // Both sides, so neither can run ahead of it
+        if (mode == LP_FG) {
+            tcsetpgrp(shell_tty, pid);
         }
     }
+    child_add(pid, tag);
+    if (prof_on) {
+        prof_spawned(pid, "(subshell)", t0);
+    }
+    child_release();
+    return pid;
+}
 
-    for (int i = 0; i < num_cmds; i++) {
-        pid_t pid = fork();  // Fork a new process
-        if (pid == 0) {
-            // Child process
-            if (i != 0) {
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1) {  // Redirect stdin from the previous pipe
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
+// Function to look up the builtin a stage runs, if any.  A command
+// name that comes from an expansion is never taken for a builtin or a
+// function; a stage of redirections alone ("> file") runs as ":", and
+// a compound command runs in the shell too.
+static const struct builtin *stage_builtin(struct stage *st) {
+    if (st->argc == 0) {
+        return shell_command(st, NULL);
+    }
+    if (st->words[0].exp != NULL) {
+        return NULL;
+    }
+    return shell_command(st, st->argv[0]);
+}
+
+// Function to point fd somewhere else for the duration of a builtin,
+// remembering where it pointed before in saved[*nsaved]
+static void save_fd(int fd, int saved[][2], int *nsaved) {
+    saved[*nsaved][0] = fd;
+    saved[*nsaved][1] = fcntl(fd, F_DUPFD_CLOEXEC, 10);  // -1 if fd was closed
+    (*nsaved)++;
+}
+
+// Function to run a builtin inside the shell itself.  Its redirections
+// are applied around the call and undone afterwards; in_fd and out_fd,
+// when not -1, are its stdin and stdout (the pipes to the stages it
+// runs alongside).  Assignments in front of it last as long as it runs,
+// unless there is no command, when they set shell variables.  Returns
+// its status.
+static int run_builtin(struct arena *arena, const struct builtin *b, struct stage *st, int in_fd, int out_fd) {
+    int nredir = 2;
+    for (struct redir *r = st->redirs; r != NULL; r = r->next) {
+        nredir++;
+    }
+    int saved[nredir][2];
+    int nsaved = 0, rv = 1, opened = -1;
+    int substs = nsubst;  // x=$(cmd) alone has cmd's status
+    long long t0 = prof_on ? prof_now() : 0;
+    char **args = handle_globbing(arena, st);
+
+    fflush(stdout);
+    if (in_fd != -1 && !(b->flags & BI_OWNIN)) {
+        save_fd(STDIN_FILENO, saved, &nsaved);
+        dup2(in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        save_fd(STDOUT_FILENO, saved, &nsaved);
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    for (struct redir *r = st->redirs; r != NULL; r = r->next) {
+        if (r->op == R_DUP) {  // n>&m, n>&-: copy or close, no new file
+            int m = redir_dupfd(arena, r, NULL);
+            if (m == -2) {
+                goto out;
             }
-            if (i != num_cmds - 1) {
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {  // Redirect stdout to the next pipe
-                    perror("dup2");
-                    exit(EXIT_FAILURE);
-                }
+            save_fd(r->fd, saved, &nsaved);
+            if (m == -1) {
+                close(r->fd);
+            } else {
+                dup2(m, r->fd);
             }
-            for (int j = 0; j < num_cmds - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            continue;
+        }
+        int fd = redir_open(arena, r);
+        if (fd == -1) {
+            goto out;
+        }
+        if (r->fd == STDIN_FILENO && r->op != R_OUT && r->op != R_APPEND && (b->flags & BI_OWNIN)) {
+            if (opened != -1) {
+                close(opened);
             }
+            in_fd = opened = fd;  // parallel -j4 < jobs.txt: its input, not its children's
+            continue;
+        }
+        if (fd == r->fd) {  // r->fd was closed, so the open took it: close it again after
+            saved[nsaved][0] = fd;
+            saved[nsaved++][1] = -1;
+            fcntl(fd, F_SETFD, 0);  // Open to what it runs, as dup2 would leave it
+            continue;
+        }
+        save_fd(r->fd, saved, &nsaved);
+        dup2(fd, r->fd);
+        close(fd);
+    }
+    int mark = -1;
+    if (st->nassign > 0) {
+        char **assigns = assignments(arena, st);
+        if (st->argc > 0) {
+            mark = var_push(assigns, st->nassign);
+        }
+        for (int i = 0; st->argc == 0 && i < st->nassign; i++) {
+            char *eq = strchr(assigns[i], '=');
+            var_set(assigns[i], eq - assigns[i], eq + 1, 0);
+        }
+    }
+    if (b == &shell_body) {  // Which body: stage_builtin may since have run again
+        rv = run_body(arena, st->body ? st->body : func_get(st->argv[0]), args);
+    } else {
+        rv = b->fn(args, (b->flags & BI_OWNIN) && in_fd != -1 ? in_fd : STDIN_FILENO);
+    }
+    if (st->argc == 0 && nsubst != substs) {
+        rv = last_status;
+    }
+    fflush(stdout);
+    if (mark != -1) {
+        var_pop(mark);
+    }
+out:
+    // Put every redirected fd back, last first
+    while (nsaved-- > 0) {
+        if (saved[nsaved][1] == -1) {
+            close(saved[nsaved][0]);
+        } else {
+            dup2(saved[nsaved][1], saved[nsaved][0]);
+            close(saved[nsaved][1]);
+        }
+    }
+    if (opened != -1) {
+        close(opened);
+    }
+    if (prof_on) {
+        prof_builtin(b->name, t0, rv);
+    }
+    return rv;
+}
 
-            // Close unused pipe ends in child processes
-            for (int j = 0; j < num_cmds - 1; j++) {
-                if ((i != j) && (i != j + 1)) {
-                    close(pipes[j][0]);
-                    close(pipes[j][1]);
-                }
-            }
+// Function to run a fan-out, "producer |{ list ; list ... }", in the
+// foreground: every list reads all of what the producer's stages write.
+// The shell itself copies the stream, from the producer's pipe into one
+// pipe per list, in the kernel (zcopy_tee), so it is read once and no
+// process copies it.  On a terminal the whole fan-out runs in a forked
+// copy of the shell instead, which gets the terminal, so that producer,
+// lists and copier are one job that ^C and ^Z reach together.  Returns
+// the last list's status; $PIPESTATUS has every stage's and list's.
+static int run_fanout(struct arena *arena, struct node *n) {
+    struct pipeline *pl = n->pl;
+    if (job_control) {
+        pid_t pid = fork_subshell(arena, n, -1, -1, -1, TAG_FG, LP_FG);
+        int code = 127;
+        if (pid != -1 && job_wait(&pid, &code, 1)) {
+            job_add(&pid, &code, 1, n, YES);
+        }
+        job_terminal();
+        set_pipestatus(&code, 1);
+        return code;
+    }
 
-            // Execute the command
-            char *args[MAX_CMD_LEN];
-            char *token = strtok(cmds[i], " ");
-            int arg_idx = 0;
-            while (token != NULL) {
-                args[arg_idx++] = token;
-                token = strtok(NULL, " ");
-            }
-            char **newArgs = handle_globbing(args);
-            execvp(newArgs[0], newArgs);  // Replace the process image with the command
-            perror("execvp");
+    int count = pl->nstages + pl->nfan, mark = nfanfds;
+    pid_t *pids = arena_alloc(arena, count * sizeof(pid_t));
+    int *codes = arena_alloc(arena, count * sizeof(int));
+    int *outs = arena_alloc(arena, pl->nfan * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        codes[i] = 127;
+    }
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    zcopy_pipe(p[1], YES);
+    fan_keep(p[0]);
+    launch_pipeline(arena, pl, -1, p[1], -1, pids, codes, TAG_FG, LP_NONE);
+    close(p[1]);
+    for (int i = 0; i < pl->nfan; i++) {
+        int c[2];
+        if (pipe2(c, O_CLOEXEC) == -1) {
+            perror("pipe");
             exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("fork");
+        }
+        zcopy_pipe(c[1], YES);
+        fan_keep(outs[i] = c[1]);  // Its own copy closes it too
+        pids[pl->nstages + i] = fork_subshell(arena, pl->fan[i], c[0], -1, -1, TAG_FG, LP_NONE);
+        close(c[0]);
+    }
+    if (zcopy_tee(p[0], outs, pl->nfan) == -1) {
+        fprintf(stderr, "smsh: fan-out: %s\n", strerror(errno));
+    }
+    fan_close(mark);  // The end of input for every list, SIGPIPE for the producer
+
+    if (job_wait(pids, codes, count)) {
+        job_add(pids, codes, count, n, YES);
+    }
+    set_pipestatus(codes, count);
+    return last_status;
+}
+
+// Function to execute a pipeline of commands in the foreground.
+// Returns the exit status of the last stage; every stage's status is
+// kept for $PIPESTATUS.  A pipeline stopped by ^Z becomes a job.
+// With the profiler on, its wall time is recorded too.
+int execute_pipeline(struct arena *arena, struct node *n) {
+    long long t0 = prof_on ? prof_start() : 0;
+    int mark = nprocfds;  // <(cmd) pipes made for it are closed after it
+    struct pipeline *pl = n->pl;
+    int last = pl->nstages - 1;
+    const struct builtin *b = stage_builtin(&pl->stages[last]);
+    const struct builtin *first = NULL;
+    int rv;
+    if (pl->nfan > 0) {
+        rv = run_fanout(arena, n);
+        proc_close(mark);
+        if (prof_on) {
+            prof_pipeline(t0);
+        }
+        return rv;
+    }
+    if (b == NULL) {  // A bare "cat" with redirections is a kernel copy
+        b = zcopy_cat(&pl->stages[last], last > 0);
+    }
+    if (b == NULL && last > 0) {
+        first = zcopy_cat(&pl->stages[0], NO);
+    }
+    if (b != NULL && last == 0) {  // A lone builtin: no process at all
+        rv = run_builtin(arena, b, &pl->stages[0], -1, -1);
+        proc_close(mark);
+        set_pipestatus(&rv, 1);
+        if (prof_on) {
+            prof_pipeline(t0);
+        }
+        return rv;
+    }
+
+    pid_t *pids = arena_alloc(arena, pl->nstages * sizeof(pid_t));  // No limit on stages
+    int *codes = arena_alloc(arena, pl->nstages * sizeof(int));
+    for (int i = 0; i < pl->nstages; i++) {
+        codes[i] = 127;  // A stage that never started is "command not found"
+    }
+    if (b == NULL && first == NULL) {
+        launch_pipeline(arena, pl, -1, -1, -1, pids, codes, TAG_FG, LP_FG);
+    } else {
+        // A builtin last stage runs in the shell, reading what the
+        // stages before it write into one pipe; an in-shell cat first
+        // stage writes into the pipe the rest read
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) == -1) {
+            perror("pipe");
             exit(EXIT_FAILURE);
         }
+        zcopy_pipe(p[1], YES);
+        if (b != NULL) {
+            struct pipeline head = { last, pl->stages };
+            launch_pipeline(arena, &head, -1, p[1], -1, pids, codes, TAG_FG, LP_FG);
+            close(p[1]);
+            codes[last] = run_builtin(arena, b, &pl->stages[last], p[0], -1);
+            close(p[0]);
+            pids[last] = -1;
+        } else {
+            struct pipeline tail = { last, pl->stages + 1 };
+            launch_pipeline(arena, &tail, p[0], -1, -1, pids + 1, codes + 1, TAG_FG, LP_FG);
+            close(p[0]);
+            codes[0] = run_builtin(arena, first, &pl->stages[0], -1, p[1]);
+            close(p[1]);
+            pids[0] = -1;
+        }
     }
 
-    // Close all pipe ends in parent process
-    for (int i = 0; i < num_cmds - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    // Wait for each stage through the child table
+    if (job_wait(pids, codes, pl->nstages)) {
+        job_add(pids, codes, pl->nstages, n, YES);
     }
+    job_terminal();  // Take the terminal back from the job
+    proc_close(mark);
+    set_pipestatus(codes, pl->nstages);
+    if (prof_on) {
+        prof_pipeline(t0);
+    }
+    return last_status;
+}
 
-    // Wait for all child processes to finish
-    for (int i = 0; i < num_cmds; i++) {
-        wait(NULL);
+// Function to start a list in the background as a job.
+// A plain pipeline is launched directly; anything else (and a lone
+// builtin) runs in a forked copy of the shell.  Returns 0.
+static int run_background(struct arena *arena, struct node *n) {
+    int mark = nprocfds;
+    int count = n->type == N_PIPE ? n->pl->nstages : 1;
+    pid_t *pids = arena_alloc(arena, count * sizeof(pid_t));
+    int *codes = arena_alloc(arena, count * sizeof(int));
+    int started;
+
+    for (int i = 0; i < count; i++) {
+        codes[i] = 127;  // Until it is known to have started
+    }
+    if (n->type == N_PIPE && n->pl->nfan == 0 && !(count == 1 && stage_builtin(&n->pl->stages[0]))) {
+        started = launch_pipeline(arena, n->pl, -1, -1, -1, pids, codes, TAG_JOB, LP_BG);
+    } else {
+        count = 1;
+        pids[0] = fork_subshell(arena, n, -1, -1, -1, TAG_JOB, LP_BG);
+        started = pids[0] != -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (pids[i] != -1) {
+            codes[i] = 0;
+        }
+    }
+    if (started > 0) {
+        job_add(pids, codes, count, n, NO);
+    }
+    proc_close(mark);  // The job has its own copies
+    return 0;
+}
+
+// Function to settle a break or continue at the end of a loop's pass.
+// Returns YES if the loop is to stop: a break for it, or any jump that
+// is for a loop or function further out.
+static int loop_done() {
+    if (jump != J_BREAK && jump != J_CONTINUE) {
+        return jump != J_NONE;
+    }
+    if (--jump_levels > 0) {
+        return YES;
+    }
+    int stop = jump == J_BREAK;
+    jump = J_NONE;
+    return stop;
+}
+
+// Function to run a while or until loop.  Each pass expands into an
+// arena of its own, emptied after it, so a long loop stays small.
+// Returns the status of the last body run, or 0 if none was.
+static int run_loop(struct node *n) {
+    struct arena pass;
+    int rv = 0;
+    arena_init(&pass);
+    loop_depth++;
+    for (;;) {
+        int status = run_node(&pass, n->left);
+        if (jump == J_NONE && (status == 0) == (n->type == N_WHILE)) {
+            rv = run_node(&pass, n->right);
+        } else if (jump == J_NONE) {
+            break;  // The condition says stop
+        }
+        arena_reset(&pass);
+        if (loop_done()) {
+            break;
+        }
+    }
+    loop_depth--;
+    arena_free(&pass);
+    return last_status = rv;
+}
+
+// Function to run a for loop over its words, expanded and globbed
+// once before the first pass, or over "$@".  Returns as run_loop.
+static int run_for(struct arena *arena, struct node *n) {
+    int mark = nprocfds;
+    char **words = n->pl ? handle_globbing(arena, &n->pl->stages[0]) : params;
+    struct arena pass;
+    int rv = 0;
+    arena_init(&pass);
+    loop_depth++;
+    for (int i = 0; words[i] != NULL; i++) {
+        var_set(n->name, strlen(n->name), words[i], 0);
+        rv = run_node(&pass, n->left);
+        arena_reset(&pass);
+        if (loop_done()) {
+            break;
+        }
     }
+    loop_depth--;
+    arena_free(&pass);
+    proc_close(mark);
+    return last_status = rv;
+}
 
+// Function to call a shell function.  args[0] is its name; the rest
+// are $1, $2 ... while it runs.  A break inside cannot reach the
+// caller's loops, and return ends only this call.
+static int call_function(struct arena *arena, struct node *body, char **args) {
+    char **saved = var_args(args + 1);
+    int loops = loop_depth;
+    loop_depth = 0;
+    func_depth++;
+    run_node(arena, body);
+    if (jump == J_RETURN) {
+        jump = J_NONE;
+    }
+    func_depth--;
+    loop_depth = loops;
+    var_args(saved);
+    return last_status;
+}
+
+// Function to run what a shell_body stage stands for: the compound
+// command body, or with a command name in args, the function body.
+static int run_body(struct arena *arena, struct node *body, char **args) {
+    if (args[0] != NULL) {
+        return call_function(arena, body, args);
+    }
+    run_node(arena, body);
+    return last_status;
+}
+
+// Function to run a ( list ) in a forked copy of the shell and wait.
+static int run_subshell(struct arena *arena, struct node *n) {
+    pid_t pid = fork_subshell(arena, n->left, -1, -1, -1, TAG_FG, LP_NONE);
+    int code = 127;
+    if (pid != -1 && job_wait(&pid, &code, 1)) {
+        job_add(&pid, &code, 1, n, YES);
+    }
+    set_pipestatus(&code, 1);
+    return code;
+}
+
+// Function to read fd to its end straight into the arena, where the
+// text is left NUL-terminated, less its trailing newlines.  A regular
+// file is read in one go; a pipe fills room that doubles as it goes,
+// copied only when the arena has to start a new block for it.
+static char *read_all(struct arena *arena, int fd) {
+    struct stat sb;
+    size_t len = 0, cap = 4096;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+        cap = sb.st_size + 1;  // + 1 to see the end without growing
+    }
+    char *buf = arena_room(arena, cap + 1);
+    for (;;) {
+        if (len == cap) {
+            char *bigger = arena_room(arena, (cap *= 2) + 1);
+            if (bigger != buf) {
+                memcpy(bigger, buf, len);
+            }
+            buf = bigger;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n > 0) {
+            len += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    while (len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    buf[len] = '\0';
+    arena_commit(arena, len + 1);
+    return buf;
+}
+
+// Function to tell whether a command substitution can run in the shell
+// itself: lone builtins that leave the shell as they found it (echo,
+// pwd, test ...), joined by ; && or ||.  Anything else runs in a
+// forked copy, so that a cd or x=1 inside cannot reach the shell.
+static int pure_node(struct node *n) {
+    if (n->type == N_AND || n->type == N_OR || n->type == N_SEQ) {
+        return pure_node(n->left) && pure_node(n->right);
+    }
+    if (n->type != N_PIPE || n->pl->nstages != 1 || n->pl->stages[0].nassign > 0) {
+        return NO;
+    }
+    const struct builtin *b = stage_builtin(&n->pl->stages[0]);
+    return b != NULL && (b->flags & BI_PURE);
+}
+
+// Function to run a pure command substitution in place, its stdout a
+// memory file while it runs (nobody would be reading a pipe).  Returns
+// the memory file, rewound, or -1 if there can be none.
+static int run_in_memfd(struct arena *arena, struct node *tree) {
+    int fd = memfd_create("smsh-subst", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDOUT_FILENO);
+    run_node(arena, tree);
+    fflush(stdout);
+    if (saved == -1) {
+        close(STDOUT_FILENO);
+    } else {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Function to run the command of a $(command) or `command` and return
+// what it wrote, less its trailing newlines, in the arena; $? becomes
+// its status.  The output comes through a pipe from a forked copy of
+// the shell, straight into the arena.  Two cases need no fork: $(< file)
+// just reads the file, and builtins that change nothing in the shell
+// (pure_node) run in place.
+char *command_subst(struct arena *arena, char *cmd, size_t len) {
+    struct node *tree = parse_line(arena, arena_strndup(arena, cmd, len));
+    char *out;
+    int fd;
+    nsubst++;
+    if (tree == NULL) {
+        return "";  // Blank, or a syntax error already reported
+    }
+    parse_heredocs(arena, NULL, NULL);  // A << here has no lines to read
+    struct stage *st = tree->type == N_PIPE ? &tree->pl->stages[0] : NULL;
+    if (st != NULL && tree->pl->nstages == 1 && tree->pl->nfan == 0 && st->argc == 0 && st->nassign == 0 && st->body == NULL
+        && st->redirs != NULL && st->redirs->next == NULL && st->redirs->op == R_IN) {
+        if ((fd = redir_open(arena, st->redirs)) == -1) {
+            last_status = 1;
+            return "";
+        }
+        out = read_all(arena, fd);
+        close(fd);
+        last_status = 0;
+        return out;
+    }
+    if (pure_node(tree) && (fd = run_in_memfd(arena, tree)) != -1) {
+        out = read_all(arena, fd);
+        close(fd);
+        return out;
+    }
+
+    int p[2], code = 127;
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return "";
+    }
+    pid_t pid = fork_subshell(arena, tree, -1, p[1], -1, TAG_FG, LP_NONE);
+    close(p[1]);
+    out = read_all(arena, p[0]);
+    close(p[0]);
+    if (pid != -1 && job_wait(&pid, &code, 1)) {
+        job_add(&pid, &code, 1, tree, YES);
+    }
+    last_status = code;
+    return out;
+}
+
+// Function to start the command of a <(command) or >(command), text
+// starting with the < or >, in a forked copy of the shell writing into
+// or reading from a pipe, and not wait for it.  The shell keeps the
+// other end open for the command being run, as /dev/fd/N.  Returns
+// that path, in the arena.
+char *proc_subst(struct arena *arena, char *text, size_t len) {
+    struct node *tree = parse_line(arena, arena_strndup(arena, text + 1, len - 1));
+    int reads = *text == '>';  // >(command) reads what the command being run writes
+    int p[2];
+    if (tree == NULL) {
+        return "";
+    }
+    parse_heredocs(arena, NULL, NULL);
+    if (pipe2(p, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return "";
+    }
+    zcopy_pipe(p[1], NO);
+    if (nprocfds == procfdcap) {
+        procfdcap = procfdcap ? procfdcap * 2 : 8;
+        procfds = erealloc(procfds, procfdcap * sizeof(int));
+    }
+    procfds[nprocfds++] = reads ? p[1] : p[0];
+    fork_subshell(arena, tree, reads ? p[0] : -1, reads ? -1 : p[1], -1, TAG_PROC, LP_NONE);
+    close(reads ? p[0] : p[1]);
+
+    char *path = arena_alloc(arena, 24);
+    snprintf(path, 24, "/dev/fd/%d", reads ? p[1] : p[0]);
+    return path;
+}
+
+// Function to run a parsed command tree, short-circuiting && and ||
+// and interpreting compound commands in the shell itself.  After a
+// break, continue or return nothing more runs until it is settled.
+// Returns the exit status of the last pipeline that ran.
+int run_node(struct arena *arena, struct node *n) {
+    int status;
+    switch (n->type) {
+    case N_PIPE:
+        return execute_pipeline(arena, n);
+    case N_AND:
+        status = run_node(arena, n->left);
+        return status == 0 && jump == J_NONE ? run_node(arena, n->right) : status;
+    case N_OR:
+        status = run_node(arena, n->left);
+        return status != 0 && jump == J_NONE ? run_node(arena, n->right) : status;
+    case N_SEQ:
+        status = run_node(arena, n->left);
+        return jump == J_NONE ? run_node(arena, n->right) : status;
+    case N_BG:
+        return last_status = run_background(arena, n->left);
+    case N_IF:
+        status = run_node(arena, n->left);
+        if (jump != J_NONE) {
+            return status;
+        }
+        if (status == 0) {
+            return run_node(arena, n->right);
+        }
+        return n->other ? run_node(arena, n->other) : (last_status = 0);
+    case N_WHILE:
+    case N_UNTIL:
+        return run_loop(n);
+    case N_FOR:
+        return run_for(arena, n);
+    case N_GROUP:
+        return run_node(arena, n->left);
+    case N_SUBSHELL:
+        return run_subshell(arena, n);
+    case N_FUNC:
+        func_set(n->name, script_keep(n->left));  // Outlives this line's arena
+        return last_status = 0;
+    }
     return 0;
 }
 
+// Function to open the command source named on the command line
+//   smsh4              interactive when stdin is a terminal
+//   smsh4 -c 'cmds'    run the string and exit
+//   smsh4 script.sh    run the file and exit
+// (smsh4 --server and --client, server.c, are dealt with in main)
+static struct reader *open_input(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "smsh: -c: option requires an argument\n");
+            exit(2);
+        }
+        return rd_string(argv[2]);
+    }
+    if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);  // Children must not inherit the script
+        if (fd == -1) {
+            perror(argv[1]);
+            exit(127);
+        }
+        return rd_open(fd);
+    }
+    return rd_open(STDIN_FILENO);
+}
+
 // Main function
-int main() {
-    char *cmdline, *prompt, **arglist;
-    int result;
+int main(int argc, char *argv[]) {
+    char *cmdline, *prompt;
+    struct node *tree;
+    struct arena arena;  // Everything parsed from one line lives here
+    struct script *script = NULL;
     void setup();
 
-    prompt = DFL_PROMPT;  // Set the prompt
-    setup();  // Initialize the shell
-
-    // Main loop to read and execute commands
-    while ((cmdline = next_cmd(prompt, stdin)) != NULL) {
-        // Split the command line based on "|"
-        if ((arglist = splitline2(cmdline, "|")) != NULL) {
-            arglist = check_redirect(arglist);  // Check for redirection
-            if (arglist != NULL) {
-                // Count the number of commands
-                int num_cmds = 0;
-                while (arglist[num_cmds] != NULL) {
-                    num_cmds++;
+    // smsh4 --server /path.sock [N]: a worker comes back from server_run
+    // with one command, and runs it as -c would; the server never does.
+    // smsh4 --client /path.sock 'cmds' runs cmds on that server.
+    char *task = NULL;
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+        var_init();  // Once, before any worker is forked
+        task = server_run(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+    } else if (argc > 2 && strcmp(argv[1], "--client") == 0) {
+        return server_send(argv[2], argc > 3 ? argv[3] : "");
+    }
+
+    struct reader *rd = task ? rd_string(task) : open_input(argc, argv);
+    int args = task ? argc : argc > 1 && strcmp(argv[1], "-c") == 0 ? 3 : 1;  // smsh4 -c cmds name arg...
+    if (argc > args) {
+        shell_name = argv[args];  // $0, and $1 ... after it
+        var_args(argv + args + 1);
+    } else {
+        shell_name = argv[0];
+    }
+    child_init();  // Children are reaped as they exit, even at the prompt
+    if (task == NULL) {
+        var_init();  // Shell variables, starting with the environment
+    }
+    prof_init();  // SMSH_PROF: time every stage, for stats and a JSON dump
+    if (task == NULL && argc > 1 && strcmp(argv[1], "-c") != 0) {
+        script = script_open(argv[1], rd->fd);  // SMSH_SCRIPTCACHE=off|cold
+    }
+
+    // Only a terminal session gets a prompt and job control;
+    // scripts and -c strings go straight to the read/parse/spawn loop
+    prompt = NULL;
+    if (rd->tty) {
+        prompt = DFL_PROMPT;  // Set the prompt
+        setup();  // Initialize the shell
+    }
+    arena_init(&arena);
+
+    // A script file runs from its compiled trees, parsed once and cached;
+    // anything else goes through the read/parse/run loop a line at a time
+    if (script != NULL) {
+        script_run(script, &arena);
+    } else {
+        // Main loop to read and execute commands; lines are views into the reader
+        for (;;) {
+            if (job_control) {
+                job_notify();  // Report background jobs that finished or stopped
+            }
+            // A terminal gets the line editor; scripts are read a block at a time
+            cmdline = job_control ? hist_readline(prompt) : rd_line(rd, prompt);
+            if (cmdline == NULL) {
+                break;
+            }
+            if (prompt != NULL) {  // Interactive lines go through history
+                if ((cmdline = hist_expand(cmdline)) == NULL) {
+                    continue;  // !event not found: nothing runs
                 }
-                // Execute the pipeline or single command
-                result = execute_pipeline(arglist, num_cmds);
+                hist_add(cmdline);
+            }
+            // Parse the line into a command tree in one pass; an open
+            // if, while, for or { goes on to the lines after it
+            prof_mark();
+            if ((tree = parse_lines(&arena, cmdline, rd, prompt ? "> " : NULL)) != NULL) {
+                parse_heredocs(&arena, rd, prompt ? "> " : NULL);  // << bodies follow the line
+                run_node(&arena, tree);
             }
-            // Free the memory allocated for cmdline and arglist
-            free(cmdline);
-            freelist(arglist);
+            arena_reset(&arena);  // Free the whole parse at once
         }
     }
-    return 0;
+    job_hangup();  // Stopped jobs would wait forever once we are gone
+    rd_close(rd);
+    arena_free(&arena);
+    return last_status;  // Scripts and -c report their last command's status
 }
 
-// Function to set up signal handling
+// Function to set up signal handling, job control and history.
+// The shell ignores Ctrl+C, Ctrl+\ and Ctrl+Z itself; they reach
+// whichever job owns the terminal, since each job is its own group.
 void setup() {
-    signal(SIGINT, SIG_IGN);  // Ignore SIGINT (Ctrl+C)
-    signal(SIGQUIT, SIG_IGN);  // Ignore SIGQUIT (Ctrl+\)
+    job_init(STDIN_FILENO);
+    hist_init();
 }
 
 // Function to handle fatal errors
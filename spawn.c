@@ -0,0 +1,501 @@
+/* spawn.c - process launch engine for smsh
+ *
+ *    void  spawn_init(struct spawn_plan *sp)          - empty plan
+ *    void  spawn_dup2(sp, int fd, int newfd)          - queue a dup2
+ *    void  spawn_close(sp, int fd)                    - queue a close
+ *    int   spawn_open(sp, fd, path, flags, mode)      - open for child
+ *    int   spawn_owned(sp, int fd)                    - close fd after
+ *    int   spawn_hasfd(sp, int fd)                    - fd open in child?
+ *    char **spawn_redirects(sp, char **argv)          - strip < and >
+ *    pid_t spawn_run(struct spawn_plan *sp, char **argv) - launch
+ *    pid_t spawn_func(sp, fn, char **argv)            - fork for a builtin
+ *    void  spawn_free(struct spawn_plan *sp)          - release plan
+ *
+ *    A plan is the list of fd changes a child needs before exec.
+ *    Files it redirects to are opened by the parent as the plan is
+ *    made, so one that cannot be opened is reported against its name
+ *    and nothing is started; only a FIFO, whose open waits for the
+ *    other end, is still opened by the child.
+ *    argv[0] is resolved once through the path cache (pathhash.c)
+ *    and the child execs that file directly.
+ *    By default the plan is handed to posix_spawn() as file actions, which
+ *    glibc runs from a CLONE_VFORK child so no page tables are copied.
+ *    SMSH_SPAWN=fork in the environment (or spawn_set_mode()) selects
+ *    the old fork()+exec path, which is also used when posix_spawn
+ *    is not available.
+ *
+ *    A plan also carries the job control settings: the process group
+ *    to put the child in, the terminal to hand that group, and whether
+ *    the child starts with SIGINT and SIGQUIT ignored (a background
+ *    job of a shell without job control).  The child always starts
+ *    with an empty signal mask and the keyboard signals at default.
+ *    It gets environ unless the plan names another environment.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<spawn.h>
+#include	<unistd.h>
+#include	<sys/stat.h>
+#include	<sys/wait.h>
+#include	"smsh.h"
+
+extern char **environ;
+
+static int spawn_mode = -1;		/* -1 until first use	*/
+
+void spawn_set_mode(int mode)
+{
+    spawn_mode = mode;
+}
+
+int spawn_get_mode()
+/*
+ * purpose: report the launch path in use
+ * returns: SPAWN_POSIX or SPAWN_FORK
+ *    note: first call reads SMSH_SPAWN from the environment
+ */
+{
+    char *s;
+
+    if (spawn_mode == -1) {
+        s = getenv("SMSH_SPAWN");
+        spawn_mode = (s != NULL && strcmp(s, "fork") == 0) ? SPAWN_FORK
+                                                          : SPAWN_POSIX;
+    }
+    return spawn_mode;
+}
+
+void spawn_init(struct spawn_plan *sp)
+{
+    sp->acts = NULL;
+    sp->nact = 0;
+    sp->cap  = 0;
+    sp->pgid = -1;
+    sp->tty  = -1;
+    sp->ignint = NO;
+    sp->envp = NULL;
+}
+
+void spawn_free(struct spawn_plan *sp)
+{
+    int i;
+
+    for (i = 0; i < sp->nact; i++)
+        if (sp->acts[i].op == FDA_OWNED)
+            close(sp->acts[i].fd);
+    free(sp->acts);
+    spawn_init(sp);
+}
+
+static struct fdact *newact(struct spawn_plan *sp, int op, int fd)
+/*
+ * purpose: append an action slot to the plan
+ * returns: pointer to the new slot, never NULL
+ */
+{
+    struct fdact *a;
+
+    if (sp->nact == sp->cap) {
+        sp->cap = sp->cap ? sp->cap * 2 : 8;
+        sp->acts = erealloc(sp->acts, sp->cap * sizeof(struct fdact));
+    }
+    a = &sp->acts[sp->nact++];
+    a->op = op;
+    a->fd = fd;
+    a->newfd = -1;
+    a->path = NULL;
+    a->flags = 0;
+    a->mode = 0;
+    return a;
+}
+
+void spawn_dup2(struct spawn_plan *sp, int fd, int newfd)
+{
+    newact(sp, FDA_DUP2, fd)->newfd = newfd;
+}
+
+void spawn_close(struct spawn_plan *sp, int fd)
+{
+    newact(sp, FDA_CLOSE, fd);
+}
+
+int spawn_open(struct spawn_plan *sp, int fd, const char *path,
+               int flags, mode_t mode)
+/*
+ * purpose: give the child path, opened with flags, as fd
+ * returns: 0, or -1 with errno set if path cannot be opened
+ *   notes: the open is done here, close-on-exec and without blocking;
+ *          a FIFO is closed again and opened by the child instead, as
+ *          is one with no reader yet (ENXIO): a blocking open of one
+ *          waits for the other end, and a read of one opened here
+ *          could see the end before any writer came
+ */
+{
+    struct fdact *a;
+    struct stat st;
+    int ofd;
+
+    ofd = open(path, flags | O_CLOEXEC | O_NONBLOCK, mode);
+    if (ofd != -1 && fstat(ofd, &st) == 0 && !S_ISFIFO(st.st_mode)) {
+        fcntl(ofd, F_SETFL, fcntl(ofd, F_GETFL) & ~O_NONBLOCK);
+        if ((ofd = spawn_owned(sp, ofd)) == -1)
+            return -1;
+        spawn_dup2(sp, ofd, fd);
+        return 0;
+    }
+    if (ofd != -1)
+        close(ofd);
+    else if (errno != ENXIO)
+        return -1;
+    a = newact(sp, FDA_OPEN, fd);
+    a->path  = path;
+    a->flags = flags;
+    a->mode  = mode;
+    return 0;
+}
+
+int spawn_owned(struct spawn_plan *sp, int fd)
+/*
+ * purpose: hand the plan an fd the parent opened only for the child
+ *          (a heredoc's memfd, say); the child gets it through a dup2
+ *          queued separately, and spawn_free() closes the parent's copy
+ * returns: the fd to dup2 from, or -1 (fd closed, errno set)
+ *   notes: if an action already queued changes fd in the child, which
+ *          would clobber it before its dup2, it is moved above them all
+ */
+{
+    int i, high = -1, clash = NO, moved;
+
+    for (i = 0; i < sp->nact; i++) {
+        int t = sp->acts[i].op == FDA_DUP2 ? sp->acts[i].newfd : sp->acts[i].fd;
+        if (sp->acts[i].op != FDA_OWNED && t == fd)
+            clash = YES;
+        if (t > high)
+            high = t;
+    }
+    if (clash) {
+        moved = fcntl(fd, F_DUPFD_CLOEXEC, high + 1);
+        close(fd);
+        if ((fd = moved) == -1)
+            return -1;
+    }
+    newact(sp, FDA_OWNED, fd);
+    return fd;
+}
+
+int spawn_hasfd(struct spawn_plan *sp, int fd)
+/*
+ * purpose: say whether fd will be open in the child once the actions
+ *          queued so far are done, for n>&fd
+ * returns: YES or NO
+ *   notes: the child starts with the parent's fds that are not
+ *          close-on-exec; everything smsh opens for itself is
+ */
+{
+    int i, flags, open = (flags = fcntl(fd, F_GETFD)) != -1 && !(flags & FD_CLOEXEC);
+
+    for (i = 0; i < sp->nact; i++) {
+        if ((sp->acts[i].op == FDA_OPEN && sp->acts[i].fd == fd)
+            || (sp->acts[i].op == FDA_DUP2 && sp->acts[i].newfd == fd))
+            open = YES;
+        else if (sp->acts[i].op == FDA_CLOSE && sp->acts[i].fd == fd)
+            open = NO;
+    }
+    return open;
+}
+
+char **spawn_redirects(struct spawn_plan *sp, char **argv)
+/*
+ * purpose: turn "< file" and "> file" words into open actions
+ * returns: argv, compacted in place with the redirection words removed,
+ *          or NULL (reported) if a file cannot be opened
+ *    note: the path strings stay owned by argv's storage, so argv must
+ *          outlive spawn_run()
+ */
+{
+    int i, j, rv = 0;
+
+    for (i = j = 0; argv[i] != NULL && rv == 0; i++) {
+        if (strcmp(argv[i], ">") == 0 && argv[i + 1] != NULL) {
+            rv = spawn_open(sp, STDOUT_FILENO, argv[++i], O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        } else if (strcmp(argv[i], "<") == 0 && argv[i + 1] != NULL) {
+            rv = spawn_open(sp, STDIN_FILENO, argv[++i], O_RDONLY, 0);
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    if (rv == -1) {
+        perror(argv[i - 1]);
+        return NULL;
+    }
+    argv[j] = NULL;
+    return argv;
+}
+
+static void apply_plan(struct spawn_plan *sp)
+/*
+ * purpose: carry out a plan by hand in a forked child
+ *  errors: reports and _exit()s on any failure
+ */
+{
+    struct fdact *a;
+    int i, fd;
+
+    for (i = 0; i < sp->nact; i++) {
+        a = &sp->acts[i];
+        switch (a->op) {
+        case FDA_OPEN:
+            if ((fd = open(a->path, a->flags, a->mode)) == -1) {
+                perror(a->path);
+                _exit(1);
+            }
+            if (fd != a->fd) {
+                dup2(fd, a->fd);
+                close(fd);
+            }
+            break;
+        case FDA_DUP2:
+            if (a->fd == a->newfd) {	/* in place: just keep it on exec */
+                fcntl(a->fd, F_SETFD, 0);
+                break;
+            }
+            if (dup2(a->fd, a->newfd) == -1) {
+                perror("dup2");
+                _exit(1);
+            }
+            break;
+        case FDA_CLOSE:
+            close(a->fd);
+            break;
+        }
+    }
+}
+
+static void child_signals(struct spawn_plan *sp)
+/*
+ * purpose: give a forked child the process group, terminal and
+ *          signal state the plan asks for
+ */
+{
+    sigset_t none;
+
+    if (sp->pgid != -1)
+        setpgid(0, sp->pgid);
+    if (sp->tty != -1)			/* SIGTTOU is still ignored here */
+        tcsetpgrp(sp->tty, getpgrp());
+    signal(SIGINT, sp->ignint ? SIG_IGN : SIG_DFL);
+    signal(SIGQUIT, sp->ignint ? SIG_IGN : SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+static int run_fork(struct spawn_plan *sp, char *path, char **argv,
+                    pid_t *pidp)
+/*
+ * purpose: launch with fork() and execv(), the plan applied by hand
+ * returns: 0, or the errno that stopped the exec
+ *  action: a close-on-exec pipe carries a failed exec's errno back,
+ *          so callers see the same errors as with posix_spawn
+ */
+{
+    int errpipe[2], err = 0;
+    pid_t pid;
+
+    if (pipe2(errpipe, O_CLOEXEC) == -1)
+        return errno;
+    if ((pid = fork()) == -1) {
+        err = errno;
+        close(errpipe[0]);
+        close(errpipe[1]);
+        return err;
+    }
+    if (pid == 0) {
+        close(errpipe[0]);
+        child_signals(sp);
+        apply_plan(sp);
+        execve(path, argv, sp->envp ? sp->envp : environ);
+        err = errno;
+        write(errpipe[1], &err, sizeof err);
+        _exit(127);
+    }
+    close(errpipe[1]);
+    if (sp->pgid != -1)			/* both sides: no race with exec */
+        setpgid(pid, sp->pgid ? sp->pgid : pid);
+    if (sp->tty != -1)
+        tcsetpgrp(sp->tty, sp->pgid ? sp->pgid : pid);
+    if (read(errpipe[0], &err, sizeof err) == sizeof err)
+        waitpid(pid, NULL, 0);		/* exec failed: reap it now	*/
+    else
+        err = 0;
+    close(errpipe[0]);
+    *pidp = pid;
+    return err;
+}
+
+static int run_posix(struct spawn_plan *sp, char *path, char **argv,
+                     pid_t *pidp)
+/*
+ * purpose: launch path with posix_spawn, plan as file actions
+ * returns: 0, or the errno reported by posix_spawn
+ */
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    struct sigaction ign, oldint, oldquit;
+    sigset_t dfl, none;
+    struct fdact *a;
+    int i, err;
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+
+    posix_spawn_file_actions_init(&fa);
+    for (i = 0; i < sp->nact; i++) {
+        a = &sp->acts[i];
+        if (a->op == FDA_OPEN)
+            posix_spawn_file_actions_addopen(&fa, a->fd, a->path,
+                                             a->flags, a->mode);
+        else if (a->op == FDA_DUP2)
+            posix_spawn_file_actions_adddup2(&fa, a->fd, a->newfd);
+        else if (a->op == FDA_CLOSE)
+            posix_spawn_file_actions_addclose(&fa, a->fd);
+    }
+
+    /* the shell ignores these; the child must not */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&dfl);
+    if (!sp->ignint) {
+        sigaddset(&dfl, SIGINT);
+        sigaddset(&dfl, SIGQUIT);
+    }
+    sigaddset(&dfl, SIGTSTP);
+    sigaddset(&dfl, SIGTTIN);
+    sigaddset(&dfl, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &dfl);
+    sigemptyset(&none);			/* the shell may hold SIGCHLD	*/
+    posix_spawnattr_setsigmask(&attr, &none);
+    if (sp->pgid != -1) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, sp->pgid);
+    }
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+    if (sp->tty != -1)			/* in the child, before exec	*/
+        posix_spawn_file_actions_addtcsetpgrp_np(&fa, sp->tty);
+#endif
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    /* an ignored signal stays ignored across exec */
+    if (sp->ignint) {
+        ign.sa_handler = SIG_IGN;
+        sigemptyset(&ign.sa_mask);
+        ign.sa_flags = 0;
+        sigaction(SIGINT, &ign, &oldint);
+        sigaction(SIGQUIT, &ign, &oldquit);
+    }
+    err = posix_spawn(pidp, path, &fa, &attr, argv, sp->envp ? sp->envp : environ);
+    if (sp->ignint) {
+        sigaction(SIGINT, &oldint, NULL);
+        sigaction(SIGQUIT, &oldquit, NULL);
+    }
+    if (err == 0 && sp->tty != -1)	/* harmless if the child did it */
+        tcsetpgrp(sp->tty, sp->pgid ? sp->pgid : *pidp);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+
+    if (err == ENOSYS)			/* no spawn support: fall back	*/
+        return run_fork(sp, path, argv, pidp);
+    return err;
+}
+
+static int launch(struct spawn_plan *sp, char *path, char **argv, pid_t *pidp)
+{
+    if (spawn_get_mode() == SPAWN_FORK)
+        return run_fork(sp, path, argv, pidp);
+    return run_posix(sp, path, argv, pidp);
+}
+
+pid_t spawn_run(struct spawn_plan *sp, char **argv)
+/*
+ * purpose: start argv in a new process with the fd plan applied
+ * returns: pid of the child, or -1 if nothing was started
+ *  errors: reported on stderr
+ *   notes: argv[0] is resolved through the path cache and the child
+ *          execs that file directly; a cached path that has vanished
+ *          is dropped and looked up once more
+ */
+{
+    char *path;
+    pid_t pid;
+    int err;
+
+    if (argv == NULL || argv[0] == NULL)
+        return -1;
+    if ((path = path_lookup(argv[0])) == NULL) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        return -1;
+    }
+    err = launch(sp, path, argv, &pid);
+    if (err == ENOENT && path != argv[0] && access(path, F_OK) == -1) {
+        path_forget(argv[0]);
+        if ((path = path_lookup(argv[0])) == NULL) {
+            fprintf(stderr, "%s: command not found\n", argv[0]);
+            return -1;
+        }
+        err = launch(sp, path, argv, &pid);
+    }
+    if (err != 0) {
+        fprintf(stderr, "cannot execute command: %s: %s\n",
+                argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+pid_t spawn_func(struct spawn_plan *sp, int (*fn)(char **, int), char **argv)
+/*
+ * purpose: run a builtin in a forked child with the fd plan applied,
+ *          for a builtin that is not the last stage of a pipeline
+ * returns: pid of the child, or -1 if fork failed
+ *   notes: if the plan gives it a stdin (a pipe or a < redirection),
+ *          fn is passed a copy of that, not STDIN_FILENO, as a lone
+ *          builtin would be: cached then knows it has input to hash
+ */
+{
+    pid_t pid;
+    int rv, i, in = STDIN_FILENO;
+
+    fflush(stdout);
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        child_signals(sp);
+        child_release();		/* forked while the launcher held it */
+        apply_plan(sp);
+        if (sp->envp != NULL)
+            environ = sp->envp;
+        for (i = 0; i < sp->nact && in == STDIN_FILENO; i++)
+            if ((sp->acts[i].op == FDA_OPEN && sp->acts[i].fd == STDIN_FILENO)
+                || (sp->acts[i].op == FDA_DUP2 && sp->acts[i].newfd == STDIN_FILENO))
+                in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 10);
+        rv = fn(argv, in != -1 ? in : STDIN_FILENO);
+        fflush(stdout);
+        _exit(rv);
+    }
+    if (sp->pgid != -1)
+        setpgid(pid, sp->pgid ? sp->pgid : pid);
+    if (sp->tty != -1)
+        tcsetpgrp(sp->tty, sp->pgid ? sp->pgid : pid);
+    return pid;
+}
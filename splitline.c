@@ -5,6 +5,7 @@
 
  */
 
+#define _GNU_SOURCE
 #include	<stdio.h>
 #include	<stdlib.h>
 #include	<string.h>
@@ -16,37 +17,22 @@ char * next_cmd(char *prompt, FILE *fp)
  * returns: dynamically allocated string holding command line
  *  errors: NULL at EOF (not really an error)
  *          calls fatal from emalloc()
- *   notes: allocates space in BUFSIZ chunks.  
+ *   notes: reads through a block reader on fp's descriptor, so the
+ *          prompt appears only on a terminal.  Callers that do not
+ *          need their own copy should use rd_line() directly.
  */
 {
-	char	*buf ; 				/* the buffer		*/
-	int	bufspace = 0;			/* total size		*/
-	int	pos = 0;			/* current position	*/
-	int	c;				/* input char		*/
+	static struct reader *rd;	/* reader for fp	*/
+	char	*line;
 
-	printf("%s", prompt);				/* prompt user	*/
-	while( ( c = getc(fp)) != EOF ) {
-
-		/* need space? */
-		if( pos+1 >= bufspace ){		/* 1 for \0	*/
-			if ( bufspace == 0 )		/* y: 1st time	*/
-				buf = emalloc(BUFSIZ);
-			else				/* or expand	*/
-				buf = erealloc(buf,bufspace+BUFSIZ);
-			bufspace += BUFSIZ;		/* update size	*/
-		}
-
-		/* end of command? */
-		if ( c == '\n' )
-			break;
-
-		/* no, add to buffer */
-		buf[pos++] = c;
+	if ( rd == NULL || rd->fd != fileno(fp) ){
+		if ( rd != NULL )
+			rd_close(rd);
+		rd = rd_open(fileno(fp));
 	}
-	if ( c == EOF && pos == 0 )		/* EOF and no input	*/
-		return NULL;			/* say so		*/
-	buf[pos] = '\0';
-	return buf;
+	if ( (line = rd_line(rd, prompt)) == NULL )
+		return NULL;
+	return strcpy(emalloc(strlen(line)+1), line);
 }
 
 /**
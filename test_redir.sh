@@ -0,0 +1,48 @@
+#!/bin/sh
+# test_redir.sh - redirection errors under both launch paths
+#
+#    usage: ./test_redir.sh [shell]
+#
+#    A file a redirection cannot open must be reported against its
+#    name, not as a failed exec, and leave $? at 1 (not 127), whether
+#    the command is started by posix_spawn or by fork (SMSH_SPAWN).
+
+SH=${1:-./smsh4}
+dir=${TMPDIR:-/tmp}/smsh-test.$$
+fails=0
+
+mkdir "$dir" || exit 1
+trap 'rm -rf "$dir"' 0
+
+# check mode name command want-stderr want-stdout
+check() {
+    SMSH_SPAWN=$1 "$SH" -c "$3" </dev/null >"$dir/out" 2>"$dir/err"
+    if [ "$(cat "$dir/err")" != "$4" ] || [ "$(cat "$dir/out")" != "$5" ]; then
+        echo "FAIL ($1) $2"
+        echo "  stderr: $(cat "$dir/err")  want: $4"
+        echo "  stdout: $(cat "$dir/out")  want: $5"
+        fails=$((fails + 1))
+    fi
+}
+
+for mode in posix fork; do
+    check $mode "missing input file" \
+        "wc -l < $dir/none; echo \$?" \
+        "smsh: $dir/none: No such file or directory" "1"
+    check $mode "output in a missing directory" \
+        "ls > $dir/none/f; echo \$?" \
+        "smsh: $dir/none/f: No such file or directory" "1"
+    check $mode "bad redirection in a pipeline stage" \
+        "wc -l < $dir/none | cat; echo \$PIPESTATUS" \
+        "smsh: $dir/none: No such file or directory" "1 0"
+    check $mode "good redirections still work" \
+        "echo hi > $dir/f; wc -l < $dir/f; echo \$?" \
+        "" "1
+0"
+done
+
+if [ $fails -ne 0 ]; then
+    echo "$fails failed"
+    exit 1
+fi
+echo "all passed"
@@ -0,0 +1,449 @@
+/* vars.c - shell variables: an interned symbol table and a cached envp
+ *
+ *    void  var_init()                           - import the environment
+ *    char *var_get(const char *name, size_t len) - value, or NULL if unset
+ *    int   var_set(name, len, const char *value, int flags) - assign
+ *    void  var_unset(const char *name, size_t len)
+ *    int   var_isname(const char *s, size_t len) - a valid NAME?
+ *    char **var_envp(struct arena *a, char **assigns, int n) - for a child
+ *    int   var_push(char **assigns, int n)     - assign for one builtin
+ *    void  var_pop(int mark)                    - and put things back
+ *    char **var_args(char **args)               - set $1 ..., return the old
+ *    void  func_set(const char *name, struct node *body) - define a function
+ *    struct node *func_get(const char *name)    - its body, or NULL
+ *    int   builtin_export(char **), builtin_unset(char **), builtin_set(char **)
+ *
+ *    Every name the shell has seen is interned once in an open hash
+ *    table and never removed (unset just drops the value), so a lookup
+ *    is one hash of the name as it lies in the command text, with no
+ *    copy, and a struct var never moves once made.
+ *
+ *    The environment children get is kept ready in envp, which
+ *    environ also points at, so posix_spawn, exec and getenv all see
+ *    it.  Each exported variable holds its own "NAME=value" string and
+ *    its slot in envp: assigning a new value replaces that one pointer,
+ *    and only exporting or unsetting a name rebuilds the array.  A
+ *    spawn never copies or formats the environment, except for a
+ *    command run with assignments of its own ("X=1 cmd"), which gets
+ *    the array copied with those entries replaced, in the arena.
+ *
+ *    Functions share the table: a name can have a value, a body, or
+ *    both.  A body is a tree copied out of the line that defined it
+ *    (script_keep) and is never freed, since a function may be
+ *    redefining itself while it runs.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<unistd.h>
+#include	"smsh.h"
+
+struct var {
+    char	*value;			/* NULL when unset		*/
+    char	*env;			/* "name=value" if exported	*/
+    int		envix;			/* its slot in envp, or -1	*/
+    int		flags;			/* V_*				*/
+    struct node	*func;			/* function body, or NULL	*/
+    unsigned	hash;
+    size_t	len;
+    char	name[1];		/* interned, NUL-terminated	*/
+};
+
+struct saved {				/* var_push() undo record	*/
+    struct var	*v;
+    char	*value;
+    int		flags;
+};
+
+extern char **environ;
+
+pid_t			shell_pid;	/* $$, the same in subshells	*/
+char			*shell_name = "smsh";	/* $0			*/
+static char		*noparams[] = { NULL };
+char			**params = noparams;	/* $1 ...		*/
+int			nparams;
+
+static struct var	**tab;		/* open addressing, power of 2	*/
+static int		tsize, tused;
+static char		**envp;		/* exported values, NULL-ended	*/
+static int		nenv, envcap;
+static struct saved	*stack;
+static int		nstack, stackcap;
+
+static unsigned hash_name(const char *s, size_t len)
+{
+    unsigned h = 2166136261u;
+
+    while (len-- > 0)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static struct var **slot(const char *name, size_t len, unsigned h)
+/*
+ * purpose: find name's slot, or the empty slot it would take
+ */
+{
+    struct var **p;
+    unsigned i;
+
+    for (i = h & (tsize - 1); *(p = &tab[i]) != NULL; i = (i + 1) & (tsize - 1))
+        if ((*p)->hash == h && (*p)->len == len && memcmp((*p)->name, name, len) == 0)
+            break;
+    return p;
+}
+
+static struct var *find(const char *name, size_t len)
+{
+    return tsize ? *slot(name, len, hash_name(name, len)) : NULL;
+}
+
+static struct var *intern(const char *name, size_t len)
+/*
+ * purpose: the variable called name, made (unset) if new
+ */
+{
+    struct var **old = tab, **p, *v;
+    unsigned h = hash_name(name, len);
+    int i, n = tsize;
+
+    if (2 * (tused + 1) > tsize) {
+        tsize = tsize ? 2 * tsize : 256;
+        tab = emalloc(tsize * sizeof *tab);
+        memset(tab, 0, tsize * sizeof *tab);
+        for (i = 0; i < n; i++)
+            if (old[i] != NULL)
+                *slot(old[i]->name, old[i]->len, old[i]->hash) = old[i];
+        free(old);
+    }
+    if (*(p = slot(name, len, h)) != NULL)
+        return *p;
+    v = *p = emalloc(sizeof(struct var) + len);
+    memcpy(v->name, name, len);
+    v->name[len] = '\0';
+    v->len = len;
+    v->hash = h;
+    v->value = v->env = NULL;
+    v->envix = -1;
+    v->flags = 0;
+    v->func = NULL;
+    tused++;
+    return v;
+}
+
+/*
+ * the cached environment
+ */
+
+static void env_add(struct var *v)
+{
+    if (nenv + 2 > envcap) {
+        envcap *= 2;
+        envp = erealloc(envp, envcap * sizeof(char *));
+    }
+    v->envix = nenv;
+    envp[nenv++] = v->env;
+    envp[nenv] = NULL;
+    environ = envp;
+}
+
+static void env_drop(struct var *v)
+/*
+ * purpose: take v out of envp, moving the last entry into its slot
+ */
+{
+    struct var *last;
+    char *eq;
+
+    if (v->envix == -1)
+        return;
+    if (v->envix != nenv - 1) {
+        eq = strchr(envp[nenv - 1], '=');
+        last = find(envp[nenv - 1], eq - envp[nenv - 1]);
+        envp[v->envix] = envp[nenv - 1];
+        last->envix = v->envix;
+    }
+    envp[--nenv] = NULL;
+    v->envix = -1;
+    free(v->env);
+    v->env = NULL;
+}
+
+static void env_update(struct var *v)
+/*
+ * purpose: bring v's entry in envp into line with its value and flags
+ */
+{
+    char *old = v->env;
+
+    if (!(v->flags & V_EXPORT) || v->value == NULL) {
+        env_drop(v);
+        return;
+    }
+    v->env = emalloc(v->len + strlen(v->value) + 2);
+    sprintf(v->env, "%s=%s", v->name, v->value);
+    if (v->envix == -1)
+        env_add(v);
+    else {
+        envp[v->envix] = v->env;
+        free(old);
+    }
+}
+
+void var_init()
+/*
+ * purpose: make every environment variable an exported shell variable
+ */
+{
+    char **e, *eq;
+
+    shell_pid = getpid();
+    envcap = 64;
+    envp = emalloc(envcap * sizeof(char *));
+    envp[0] = NULL;
+    for (e = environ; *e != NULL; e++)
+        if ((eq = strchr(*e, '=')) != NULL && var_isname(*e, eq - *e)
+            && find(*e, eq - *e) == NULL)
+            var_set(*e, eq - *e, eq + 1, V_EXPORT);
+    environ = envp;
+}
+
+int var_isname(const char *s, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || isdigit((unsigned char)*s))
+        return NO;
+    for (i = 0; i < len; i++)
+        if (!isalnum((unsigned char)s[i]) && s[i] != '_')
+            return NO;
+    return YES;
+}
+
+char *var_get(const char *name, size_t len)
+{
+    struct var *v = find(name, len);
+
+    return v ? v->value : NULL;
+}
+
+int var_set(const char *name, size_t len, const char *value, int flags)
+/*
+ * purpose: give name a value (NULL leaves the value as it is) and add
+ *          flags to it; V_EXPORT puts it in the environment
+ * returns: 0, or -1 (not reported) if name is not a valid name
+ */
+{
+    struct var *v;
+
+    if (!var_isname(name, len))
+        return -1;
+    v = intern(name, len);
+    if (value != NULL) {
+        free(v->value);
+        v->value = strcpy(emalloc(strlen(value) + 1), value);
+    }
+    v->flags |= flags;
+    if (v->flags & V_EXPORT)
+        env_update(v);
+    return 0;
+}
+
+void var_unset(const char *name, size_t len)
+{
+    struct var *v = find(name, len);
+
+    if (v == NULL)
+        return;
+    free(v->value);
+    v->value = NULL;
+    v->flags = 0;
+    env_drop(v);
+}
+
+char **var_envp(struct arena *a, char **assigns, int n)
+/*
+ * purpose: the environment for a command run with assignments of its
+ *          own, each "NAME=value"
+ * returns: envp itself when there are none, else a copy in a with
+ *          those names replaced or added
+ */
+{
+    char **e, *eq;
+    struct var *v;
+    int i, m = nenv;
+
+    if (n == 0)
+        return envp;
+    e = arena_alloc(a, (nenv + n + 1) * sizeof(char *));
+    memcpy(e, envp, nenv * sizeof(char *));
+    for (i = 0; i < n; i++) {
+        eq = strchr(assigns[i], '=');
+        v = find(assigns[i], eq - assigns[i]);
+        if (v != NULL && v->envix != -1)
+            e[v->envix] = assigns[i];
+        else
+            e[m++] = assigns[i];
+    }
+    e[m] = NULL;
+    return e;
+}
+
+int var_push(char **assigns, int n)
+/*
+ * purpose: assign and export each "NAME=value" until var_pop(), for a
+ *          builtin run with assignments of its own
+ * returns: the mark to give var_pop()
+ */
+{
+    struct var *v;
+    char *eq;
+    int i, mark = nstack;
+
+    for (i = 0; i < n; i++) {
+        eq = strchr(assigns[i], '=');
+        v = intern(assigns[i], eq - assigns[i]);
+        if (nstack == stackcap) {
+            stackcap = stackcap ? 2 * stackcap : 8;
+            stack = erealloc(stack, stackcap * sizeof *stack);
+        }
+        stack[nstack].v = v;
+        stack[nstack].value = v->value;
+        stack[nstack++].flags = v->flags;
+        v->value = NULL;
+        var_set(v->name, v->len, eq + 1, V_EXPORT);
+    }
+    return mark;
+}
+
+void var_pop(int mark)
+/*
+ * purpose: undo the var_push() that returned mark, and any after it
+ */
+{
+    struct saved *s;
+
+    while (nstack > mark) {
+        s = &stack[--nstack];
+        free(s->v->value);
+        s->v->value = s->value;
+        s->v->flags = s->flags;
+        env_update(s->v);
+    }
+}
+
+char **var_args(char **args)
+/*
+ * purpose: make args (NULL-terminated) the positional parameters
+ * returns: the ones they replace, to put back the same way
+ */
+{
+    char **old = params;
+
+    params = args;
+    for (nparams = 0; args[nparams] != NULL; nparams++)
+        ;
+    return old;
+}
+
+void func_set(const char *name, struct node *body)
+{
+    intern(name, strlen(name))->func = body;
+}
+
+struct node *func_get(const char *name)
+{
+    struct var *v = find(name, strlen(name));
+
+    return v ? v->func : NULL;
+}
+
+/*
+ * builtins
+ */
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp((*(struct var **)a)->name, (*(struct var **)b)->name);
+}
+
+static void list(int flags, char *fmt)
+/*
+ * purpose: print every set variable with all of flags, sorted, in fmt
+ *          (name, value)
+ */
+{
+    struct var **v = emalloc((tused + 1) * sizeof *v);
+    int i, n = 0;
+
+    for (i = 0; i < tsize; i++)
+        if (tab[i] != NULL && tab[i]->value != NULL
+            && (tab[i]->flags & flags) == flags)
+            v[n++] = tab[i];
+    qsort(v, n, sizeof *v, by_name);
+    for (i = 0; i < n; i++)
+        printf(fmt, v[i]->name, v[i]->value);
+    free(v);
+}
+
+int builtin_export(char **argv)
+/*
+ * purpose: export [name[=value] ...]: put names in the environment;
+ *          with no names, list it
+ */
+{
+    char *eq;
+    int i, rv = 0;
+
+    if (argv[1] == NULL)
+        list(V_EXPORT, "export %s=\"%s\"\n");
+    for (i = 1; argv[i] != NULL; i++) {
+        eq = strchr(argv[i], '=');
+        if (var_set(argv[i], eq ? (size_t)(eq - argv[i]) : strlen(argv[i]),
+                    eq ? eq + 1 : NULL, V_EXPORT) == -1) {
+            fprintf(stderr, "export: '%s': not a valid identifier\n", argv[i]);
+            rv = 1;
+        }
+    }
+    return rv;
+}
+
+int builtin_unset(char **argv)
+/*
+ * purpose: unset [-v|-f] name ...: forget variables, or functions
+ */
+{
+    int i = 1, rv = 0, funcs = NO;
+    struct var *v;
+
+    if (argv[1] != NULL && (strcmp(argv[1], "-f") == 0 || strcmp(argv[1], "-v") == 0)) {
+        funcs = argv[1][1] == 'f';
+        i++;
+    }
+    for (; argv[i] != NULL; i++) {
+        if (funcs) {
+            if ((v = find(argv[i], strlen(argv[i]))) != NULL)
+                v->func = NULL;
+            continue;
+        }
+        if (!var_isname(argv[i], strlen(argv[i]))) {
+            fprintf(stderr, "unset: '%s': not a valid identifier\n", argv[i]);
+            rv = 1;
+            continue;
+        }
+        var_unset(argv[i], strlen(argv[i]));
+    }
+    return rv;
+}
+
+int builtin_set(char **argv)
+/*
+ * purpose: set: list every shell variable
+ */
+{
+    list(0, "%s='%s'\n");
+    return 0;
+}
@@ -0,0 +1,377 @@
+/* zcopy.c - kernel-side copies in place of a cat process
+ *
+ *    int   kcopy(int in, int out)                  - move all of in to out
+ *    const struct builtin *zcopy_cat(struct stage *st, int piped)
+ *    void  zcopy_pipe(int fd, int shell)           - size a pipe
+ *    int   zcopy_tee(int in, int outs[], int n)    - one pipe into n
+ *
+ *    "cat < big > copy", "cat < log | grep x" and "cmd | cat > out"
+ *    spend a process and two copies through user space on every byte.
+ *    When a cat stage has no operands and only redirections, the shell
+ *    runs it itself and moves the data with copy_file_range (file to
+ *    file, which some filesystems do without reading at all), splice
+ *    (when either end is a pipe, moving page references instead of
+ *    bytes) or sendfile, falling back to read/write.
+ *
+ *    A fan-out, "producer |{ a ; b }", has the shell copy one pipe into
+ *    several.  tee() puts references to the pages in the producer's
+ *    pipe into each consumer's pipe but the last, and splice() then
+ *    moves them into that one, so each byte is read once and none is
+ *    copied through user space.  Only when a consumer's pipe had room
+ *    for less than the others took is that round read, once, and
+ *    written to the ones it is short in.
+ *
+ *    SMSH_ZCOPY=off in the environment turns this off.  SMSH_PIPESZ=N
+ *    sets every pipeline pipe to N bytes with F_SETPIPE_SZ; without it
+ *    only the pipe the shell itself copies through is enlarged, since
+ *    big pipe buffers count against the per-user pipe page limit.
+ */
+
+#define _GNU_SOURCE
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<unistd.h>
+#include	<sys/ioctl.h>
+#include	<sys/sendfile.h>
+#include	<sys/stat.h>
+#include	"smsh.h"
+
+#define	ZC_CHUNK	(1 << 30)	/* per copy_file_range/sendfile	*/
+#define	ZC_SPLICE	(1 << 20)	/* per splice			*/
+#define	ZC_PIPESZ	(1 << 20)	/* pipe the shell copies through */
+
+static int zc_mode = -1;		/* -1 until first use		*/
+static int pipesz;			/* SMSH_PIPESZ, 0 if unset	*/
+
+static int enabled()
+{
+    char *s;
+
+    if (zc_mode == -1) {
+        s = getenv("SMSH_ZCOPY");
+        zc_mode = !(s != NULL && strcmp(s, "off") == 0);
+        if ((s = getenv("SMSH_PIPESZ")) != NULL)
+            pipesz = atoi(s);
+    }
+    return zc_mode;
+}
+
+void zcopy_pipe(int fd, int shell)
+/*
+ * purpose: enlarge a pipe: to SMSH_PIPESZ if set, else only when the
+ *          shell copies through it (shell is YES)
+ *    note: a size the kernel refuses just leaves the pipe as it was
+ */
+{
+    enabled();
+    if (pipesz > 0)
+        fcntl(fd, F_SETPIPE_SZ, pipesz);
+    else if (shell)
+        fcntl(fd, F_SETPIPE_SZ, ZC_PIPESZ);
+}
+
+static int copy_loop(int how, int in, int out)
+/*
+ * purpose: copy until EOF with one kind of system call
+ * returns: 1 when done, 0 if the call refused these fds before
+ *          anything moved (try the next kind), -1 on an error
+ */
+{
+    ssize_t n;
+    int moved = NO;
+
+    for (;;) {
+        if (how == 0)
+            n = copy_file_range(in, NULL, out, NULL, ZC_CHUNK, 0);
+        else if (how == 1)
+            n = splice(in, NULL, out, NULL, ZC_SPLICE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else
+            n = sendfile(out, in, NULL, ZC_CHUNK);
+        if (n == 0)
+            return 1;
+        if (n > 0) {
+            moved = YES;
+            continue;
+        }
+        if (errno == EINTR)
+            continue;
+        if (!moved && (errno == EINVAL || errno == EXDEV || errno == ENOSYS
+                       || errno == EOPNOTSUPP || errno == EBADF))
+            return 0;
+        return -1;
+    }
+}
+
+static int put_all(int fd, char *buf, size_t len)
+/*
+ * purpose: write all of buf to fd
+ * returns: 0, or -1 with errno set
+ */
+{
+    ssize_t w;
+    size_t off;
+
+    for (off = 0; off < len; off += w)
+        if ((w = write(fd, buf + off, len - off)) == -1) {
+            if (errno != EINTR)
+                return -1;
+            w = 0;
+        }
+    return 0;
+}
+
+int kcopy(int in, int out)
+/*
+ * purpose: move everything readable on in to out
+ * returns: 0, or -1 with errno set
+ */
+{
+    struct stat si, so;
+    char buf[128 * 1024];
+    ssize_t n;
+    int rv;
+
+    if (fstat(in, &si) == -1 || fstat(out, &so) == -1)
+        return -1;
+    if (S_ISREG(si.st_mode) && S_ISREG(so.st_mode)
+        && (rv = copy_loop(0, in, out)) != 0)
+        return rv == 1 ? 0 : -1;
+    if ((S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode))
+        && (rv = copy_loop(1, in, out)) != 0)
+        return rv == 1 ? 0 : -1;
+    if (S_ISREG(si.st_mode) && (rv = copy_loop(2, in, out)) != 0)
+        return rv == 1 ? 0 : -1;
+
+    while ((n = read(in, buf, sizeof buf)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (put_all(out, buf, n) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static int read_all(int fd, char *buf, size_t len)
+/*
+ * purpose: read len bytes that are already in the pipe fd
+ * returns: 0, or -1 with errno set
+ */
+{
+    ssize_t n;
+    size_t off;
+
+    for (off = 0; off < len; off += n)
+        if ((n = read(fd, buf + off, len - off)) <= 0) {
+            if (n == 0 || errno != EINTR)
+                return -1;
+            n = 0;
+        }
+    return 0;
+}
+
+static int fullest(int outs[], int last)
+/*
+ * purpose: find the reader before last with the most left unread in
+ *          its pipe
+ * returns: its index, or -1 if there is none
+ *   notes: teed to first, it sizes the round to the room it has, which
+ *          the others, with less waiting, have too
+ */
+{
+    int i, q, most = -1, best = -1;
+
+    for (i = 0; i < last; i++) {
+        if (outs[i] == -1)
+            continue;
+        if (ioctl(outs[i], FIONREAD, &q) == -1)
+            q = 0;
+        if (q > most) {
+            most = q;
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int tee_round(int in, int outs[], int n, size_t *sent, char **bufp)
+/*
+ * purpose: copy what is in the pipe in, up to ZC_SPLICE bytes, to each
+ *          reader still in outs[0..n)
+ * returns: how much was taken from in, 0 at its end, or -1 on an error
+ *   notes: a reader that is gone (EPIPE) has its entry set to -1; the
+ *          round goes through *bufp, allocated here, only if some pipe
+ *          took less than the first did, if the last reader went away
+ *          halfway, or with SMSH_ZCOPY=off
+ */
+{
+    ssize_t len = 0, m, moved = 0;
+    int i, k, first, last, kernel = enabled(), whole = YES;
+
+    for (last = n - 1; outs[last] == -1; last--)
+        ;
+    first = fullest(outs, last);
+    for (k = -1; kernel && first != -1 && k < last; k++) {
+        i = k == -1 ? first : k;
+        if (outs[i] == -1 || (k != -1 && i == first))
+            continue;
+        do
+            m = tee(in, outs[i], len ? len : ZC_SPLICE, 0);
+        while (m == -1 && errno == EINTR);
+        if (m == -1) {
+            if (errno != EPIPE)
+                return -1;
+            outs[i] = -1;
+            continue;
+        }
+        if (len == 0 && m == 0)
+            return 0;
+        if (len == 0)
+            len = m;
+        if ((sent[i] = m) < (size_t)len)
+            whole = NO;
+    }
+    if (kernel && len == 0) {		/* one reader left: just move it */
+        do
+            m = splice(in, NULL, outs[last], NULL, ZC_SPLICE, SPLICE_F_MOVE | SPLICE_F_MORE);
+        while (m == -1 && errno == EINTR);
+        if (m == -1 && errno == EPIPE) {
+            outs[last] = -1;		/* none left: the copy stops	*/
+            return 1;
+        }
+        return m;
+    }
+    while (kernel && whole && moved < len && outs[last] != -1) {
+        m = splice(in, NULL, outs[last], NULL, len - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (m > 0)
+            moved += m;
+        else if (m == -1 && errno == EPIPE)
+            outs[last] = -1;
+        else if (m == -1 && errno != EINTR)
+            return -1;
+    }
+    if (kernel && moved == len)
+        return len;
+
+    if (*bufp == NULL)
+        *bufp = emalloc(ZC_SPLICE);
+    if (!kernel) {
+        while ((len = read(in, *bufp, ZC_SPLICE)) == -1 && errno == EINTR)
+            ;
+        if (len <= 0)
+            return len;
+        for (i = 0; i < last; i++)
+            sent[i] = 0;
+    } else if (read_all(in, *bufp, len - moved) == -1) {
+        return -1;
+    }
+    for (i = 0; i <= last; i++) {	/* each from where its pipe stopped */
+        m = i < last ? (ssize_t)sent[i] : moved;
+        if (outs[i] == -1 || m == len)
+            continue;
+        if (put_all(outs[i], *bufp + m, len - m) == -1) {
+            if (errno != EPIPE)
+                return -1;
+            outs[i] = -1;
+        }
+    }
+    return len;
+}
+
+int zcopy_tee(int in, int outs[], int n)
+/*
+ * purpose: copy everything written into the pipe in to each of the
+ *          pipes outs[0..n), as it comes
+ * returns: 0, or -1 with errno set
+ *   notes: a reader that goes away is dropped, its entry set to -1, and
+ *          the rest go on; once none is left the copy stops, so the
+ *          writer gets SIGPIPE as it would writing to one reader
+ */
+{
+    struct sigaction ign, old;
+    size_t *sent = emalloc(n * sizeof(size_t));
+    char *buf = NULL;
+    ssize_t len = 1;
+    int i;
+
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    ign.sa_flags = 0;
+    sigaction(SIGPIPE, &ign, &old);
+    for (;;) {
+        for (i = 0; i < n && outs[i] == -1; i++)
+            ;
+        if (i == n || (len = tee_round(in, outs, n, sent, &buf)) <= 0)
+            break;
+    }
+    sigaction(SIGPIPE, &old, NULL);
+    free(sent);
+    free(buf);
+    return len == -1 ? -1 : 0;
+}
+
+static int zc_cat(char **argv, int in_fd)
+/*
+ * purpose: the in-shell cat: stdin to stdout in the kernel
+ * returns: 0, 1 on an error, 128+SIGPIPE when the reader went away
+ *          (what a real cat would have died of)
+ */
+{
+    struct sigaction ign, old;
+    int rv = 0;
+
+    fflush(stdout);
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    ign.sa_flags = 0;
+    sigaction(SIGPIPE, &ign, &old);
+    if (kcopy(STDIN_FILENO, STDOUT_FILENO) == -1) {
+        if (errno == EPIPE)
+            rv = 128 + SIGPIPE;
+        else {
+            fprintf(stderr, "cat: %s\n", strerror(errno));
+            rv = 1;
+        }
+    }
+    sigaction(SIGPIPE, &old, NULL);
+    return rv;
+}
+
+static const struct builtin cat_builtin = { "cat", zc_cat, 0 };
+
+const struct builtin *zcopy_cat(struct stage *st, int piped)
+/*
+ * purpose: decide whether a stage is a cat the shell can do itself
+ *    args: piped is YES when the stage reads a pipe from earlier stages
+ * returns: a builtin entry to run it with, or NULL
+ *   notes: without a pipe in, the input must be a < redirection from a
+ *          regular file or a heredoc, so the copy always ends on its
+ *          own; the shell ignores ^C and could not otherwise be stopped
+ */
+{
+    struct redir *r;
+    struct stat sb;
+    int input = piped;
+
+    if (!enabled() || st->argc != 1 || st->words[0].exp != NULL
+        || strcmp(st->argv[0], "cat") != 0)
+        return NULL;
+    for (r = st->redirs; r != NULL; r = r->next) {
+        if (r->fd > STDOUT_FILENO)
+            return NULL;
+        if (r->fd != STDIN_FILENO)
+            continue;
+        if (r->op == R_IN)
+            input = r->target.exp == NULL && stat(r->target.text, &sb) == 0
+                    && S_ISREG(sb.st_mode);
+        else		/* a heredoc's memfd is a regular file too	*/
+            input = r->op == R_HEREDOC || r->op == R_HERESTR;
+    }
+    return input ? &cat_builtin : NULL;
+}